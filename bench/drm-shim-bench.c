@@ -0,0 +1,936 @@
+/*
+ * drm-shim-bench.c
+ *
+ * Microbenchmarks for the shim.  Each case is timed over a number
+ * of iterations, best of several runs, and reported as one JSON
+ * object per line so results can be compared between builds.
+ *
+ * Usage: drm-shim-bench [--mode LABEL] [--iterations N] [--filter STR]
+ *                       [--check-tiling]
+ *
+ * The mode label is copied into the output; run-bench.sh sets it
+ * to describe the backend and instrumentation settings in effect.
+ * Cases whose setup fails (the sync_file merge cases need the
+ * kernel's sw_sync debugfs interface) are skipped.
+ *
+ * Copyright (c) 2018-2019, Matthew Madison
+ * Distributed under license; see the LICENSE file for details.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "xf86drm.h"
+#include "xf86drmMode.h"
+#include "libsync.h"
+#include "tegra_drm.h"
+#include "drm-shim.h"
+
+#define BENCH_RUNS 5
+#define BENCH_FENCES 32
+
+struct bench_case {
+    const char *name;
+    /* returns the number of operations performed, 0 if unsupported */
+    unsigned long (*run)(unsigned long iterations);
+    /* iterations are divided by this, for cases that make syscalls */
+    unsigned long divisor;
+    /* bytes moved per operation, for cases reporting throughput */
+    unsigned long bytes;
+};
+
+static volatile int sink;
+
+static uint64_t
+now_ns (void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+static unsigned long
+bench_ioctl (unsigned long iterations)
+{
+    unsigned long i;
+    int acc = 0;
+
+    for (i = 0; i < iterations; i++)
+        acc += drmIoctl(-1, 0, NULL);
+    sink = acc;
+    return iterations;
+}
+
+static unsigned long
+bench_available (unsigned long iterations)
+{
+    unsigned long i;
+    int acc = 0;
+
+    for (i = 0; i < iterations; i++)
+        acc += drmAvailable();
+    sink = acc;
+    return iterations;
+}
+
+static unsigned long
+bench_atomic_add_property (unsigned long iterations)
+{
+    unsigned long i;
+    int acc = 0;
+
+    for (i = 0; i < iterations; i++)
+        acc += drmModeAtomicAddProperty(NULL, 1, 2, i);
+    sink = acc;
+    return iterations;
+}
+
+/*
+ * Fence wait cases use signalled eventfds, which poll() the same
+ * way as a signalled sync_file.  Each operation waits on (or
+ * merges) BENCH_FENCES fences.
+ */
+static int fence_fds[BENCH_FENCES];
+
+static int
+eventfd_fences (void)
+{
+    static int ready;
+    unsigned int i;
+
+    if (ready)
+        return 1;
+    for (i = 0; i < BENCH_FENCES; i++) {
+        fence_fds[i] = eventfd(1, EFD_CLOEXEC);
+        if (fence_fds[i] < 0)
+            return 0;
+    }
+    ready = 1;
+    return 1;
+}
+
+static unsigned long
+bench_sync_wait_loop (unsigned long iterations)
+{
+    unsigned long i;
+    unsigned int f;
+    int acc = 0;
+
+    if (!eventfd_fences())
+        return 0;
+    for (i = 0; i < iterations; i++)
+        for (f = 0; f < BENCH_FENCES; f++)
+            acc += sync_wait(fence_fds[f], 1000);
+    sink = acc;
+    return iterations;
+}
+
+static unsigned long
+bench_sync_wait_many (unsigned long iterations)
+{
+    unsigned long i;
+    int acc = 0;
+
+    if (!eventfd_fences())
+        return 0;
+    for (i = 0; i < iterations; i++)
+        acc += sync_wait_many(fence_fds, BENCH_FENCES, 1000, SYNC_WAIT_ALL, NULL);
+    sink = acc;
+    return iterations;
+}
+
+static unsigned long
+bench_fence_wait_many (unsigned long iterations)
+{
+    unsigned long i;
+    int acc = 0;
+
+    if (!eventfd_fences())
+        return 0;
+    for (i = 0; i < iterations; i++)
+        acc += drmShimFenceWaitMany(fence_fds, BENCH_FENCES, 1000, SYNC_WAIT_ALL, NULL);
+    sink = acc;
+    return iterations;
+}
+
+/*
+ * Consumer side of the shared fence table: each operation checks
+ * BENCH_FENCES fences that have completed, by table lookup instead
+ * of the poll() in sync_wait_loop.  The table file is unlinked once
+ * it is open.
+ */
+static unsigned long
+bench_fence_table (unsigned long iterations)
+{
+    char path[64];
+    drmShimFenceTablePtr table;
+    unsigned long i;
+    unsigned int f;
+    int acc = 0;
+
+    if (!eventfd_fences())
+        return 0;
+    snprintf(path, sizeof(path), "/tmp/drm-shim-bench-%d", (int) getpid());
+    table = drmShimFenceTableOpen(path, BENCH_FENCES);
+    unlink(path);
+    if (table == NULL)
+        return 0;
+    for (f = 0; f < BENCH_FENCES; f++)
+        drmShimFenceTablePublish(table, f, 1);
+    for (i = 0; i < iterations; i++)
+        for (f = 0; f < BENCH_FENCES; f++)
+            acc += drmShimFenceTableWait(table, f, 1, fence_fds[f], 1000);
+    sink = acc;
+    drmShimFenceTableClose(table);
+    return iterations;
+}
+
+/*
+ * Syncpoint cases need a backend with syncpoints (fake or vendor).
+ * Each operation checks a threshold that has already passed.
+ */
+static int
+syncpt_device (uint32_t *value)
+{
+    static int fd = -1;
+
+    if (fd < 0)
+        fd = drmOpen("tegra", NULL);
+    if (fd < 0 || drmShimSyncptRead(fd, 1, value) < 0)
+        return -1;
+    return fd;
+}
+
+static unsigned long
+bench_syncpt_read (unsigned long iterations)
+{
+    struct drm_tegra_syncpt_read args = { .id = 1 };
+    unsigned long i;
+    uint32_t value;
+    int fd = syncpt_device(&value);
+    int acc = 0;
+
+    if (fd < 0)
+        return 0;
+    for (i = 0; i < iterations; i++) {
+        drmIoctl(fd, DRM_IOCTL_TEGRA_SYNCPT_READ, &args);
+        acc += (int32_t) (args.value - value) >= 0;
+    }
+    sink = acc;
+    return iterations;
+}
+
+static unsigned long
+bench_syncpt_passed (unsigned long iterations)
+{
+    unsigned long i;
+    uint32_t value;
+    int fd = syncpt_device(&value);
+    int acc = 0;
+
+    if (fd < 0)
+        return 0;
+    for (i = 0; i < iterations; i++)
+        acc += drmShimSyncptPassed(fd, 1, value);
+    sink = acc;
+    return iterations;
+}
+
+/*
+ * Wait latency against simulated jobs.  The fake backend completes
+ * each SUBMIT DRM_SHIM_FAKE_JOB_NS after it is made (20us unless
+ * set otherwise), and its blocking SYNCPT_WAIT sleeps between
+ * checks, like a thread waiting to be woken.  Each operation
+ * submits one job and waits for it under the given wait policy.
+ */
+static unsigned long
+bench_wait_latency (unsigned long iterations, int policy)
+{
+    struct drm_tegra_open_channel channel = { .client = 0 };
+    struct drm_tegra_close_channel close_channel = { 0 };
+    struct drm_tegra_get_syncpt getsp = { .index = 0 };
+    struct drm_tegra_syncpt incr = { .incrs = 1 };
+    struct drm_tegra_submit submit = { .num_syncpts = 1 };
+    unsigned long i;
+    uint32_t value;
+    int fd = syncpt_device(&value);
+
+    if (fd < 0)
+        return 0;
+    setenv("DRM_SHIM_FAKE_JOB_NS", "20000", 0);
+    if (drmIoctl(fd, DRM_IOCTL_TEGRA_OPEN_CHANNEL, &channel) < 0)
+        return 0;
+    getsp.context = channel.context;
+    if (drmIoctl(fd, DRM_IOCTL_TEGRA_GET_SYNCPT, &getsp) < 0)
+        return 0;
+    incr.id = getsp.id;
+    submit.context = channel.context;
+    submit.syncpts = (uintptr_t) &incr;
+    drmShimSetWaitPolicy(policy, 0);
+    for (i = 0; i < iterations; i++) {
+        if (drmIoctl(fd, DRM_IOCTL_TEGRA_SUBMIT, &submit) < 0 ||
+            drmShimSyncptWait(fd, incr.id, submit.fence, 1000) != 0)
+            break;
+    }
+    drmShimSetWaitPolicy(DRM_SHIM_WAIT_BLOCK, 0);
+    close_channel.context = channel.context;
+    drmIoctl(fd, DRM_IOCTL_TEGRA_CLOSE_CHANNEL, &close_channel);
+    return i == iterations ? iterations : 0;
+}
+
+static unsigned long
+bench_wait_block (unsigned long iterations)
+{
+    return bench_wait_latency(iterations, DRM_SHIM_WAIT_BLOCK);
+}
+
+static unsigned long
+bench_wait_spin (unsigned long iterations)
+{
+    return bench_wait_latency(iterations, DRM_SHIM_WAIT_SPIN);
+}
+
+static unsigned long
+bench_wait_adaptive (unsigned long iterations)
+{
+    return bench_wait_latency(iterations, DRM_SHIM_WAIT_ADAPTIVE);
+}
+
+/*
+ * Per-frame syncobjs: each operation takes a syncobj, signals it,
+ * and gives it back, either creating and destroying it or through
+ * a pool.  Needs a backend with syncobjs (fake).
+ */
+static int
+syncobj_device (void)
+{
+    static int fd = -1;
+    uint64_t cap = 0;
+
+    if (fd < 0)
+        fd = drmOpen("tegra", NULL);
+    if (fd < 0 || drmGetCap(fd, DRM_CAP_SYNCOBJ, &cap) != 0 || cap == 0)
+        return -1;
+    return fd;
+}
+
+static unsigned long
+bench_syncobj_create (unsigned long iterations)
+{
+    unsigned long i;
+    uint32_t handle;
+    int fd = syncobj_device();
+
+    if (fd < 0)
+        return 0;
+    for (i = 0; i < iterations; i++) {
+        if (drmSyncobjCreate(fd, 0, &handle) != 0)
+            return 0;
+        drmSyncobjSignal(fd, &handle, 1);
+        drmSyncobjDestroy(fd, handle);
+    }
+    return iterations;
+}
+
+static unsigned long
+bench_syncobj_pool (unsigned long iterations)
+{
+    drmShimSyncobjPoolStats stats;
+    drmShimSyncobjPoolPtr pool;
+    unsigned long i;
+    uint32_t handle;
+    int fd = syncobj_device();
+
+    if (fd < 0 || (pool = drmShimSyncobjPoolCreate(fd)) == NULL)
+        return 0;
+    for (i = 0; i < iterations; i++) {
+        if (drmShimSyncobjPoolGet(pool, 0, &handle) != 0)
+            break;
+        drmSyncobjSignal(fd, &handle, 1);
+        drmShimSyncobjPoolPut(pool, handle);
+    }
+    drmShimSyncobjPoolGetStats(pool, &stats);
+    sink = (int) stats.hits;
+    drmShimSyncobjPoolDestroy(pool);
+    return i == iterations ? iterations : 0;
+}
+
+/*
+ * Per-frame buffers: each operation creates a 1MiB GEM object and
+ * closes it again.  Needs a backend with GEM objects (fake or
+ * vendor); the BO cache is on in run-bench.sh's fake-cached mode.
+ */
+static unsigned long
+bench_gem_create_close (unsigned long iterations)
+{
+    static int fd = -1;
+    struct drm_tegra_gem_create create;
+    struct drm_gem_close close_args;
+    unsigned long i;
+
+    if (fd < 0)
+        fd = drmOpen("tegra", NULL);
+    if (fd < 0)
+        return 0;
+    for (i = 0; i < iterations; i++) {
+        memset(&create, 0, sizeof(create));
+        create.size = 1 << 20;
+        if (drmIoctl(fd, DRM_IOCTL_TEGRA_GEM_CREATE, &create) != 0)
+            return 0;
+        memset(&close_args, 0, sizeof(close_args));
+        close_args.handle = create.handle;
+        drmIoctl(fd, DRM_IOCTL_GEM_CLOSE, &close_args);
+    }
+    return iterations;
+}
+
+/*
+ * Small buffers: each operation allocates and frees one 256-byte
+ * buffer, with BENCH_SMALL_BUFFERS of them live at a time, either
+ * as a GEM object each or out of a slab allocator.
+ */
+#define BENCH_SMALL_BUFFERS 64
+
+static unsigned long
+bench_small_gem (unsigned long iterations)
+{
+    static int fd = -1;
+    struct drm_tegra_gem_create create;
+    struct drm_gem_close close_args;
+    uint32_t handles[BENCH_SMALL_BUFFERS];
+    unsigned long i;
+    unsigned int b;
+
+    if (fd < 0)
+        fd = drmOpen("tegra", NULL);
+    if (fd < 0)
+        return 0;
+    for (i = 0; i < iterations; i += BENCH_SMALL_BUFFERS) {
+        for (b = 0; b < BENCH_SMALL_BUFFERS; b++) {
+            memset(&create, 0, sizeof(create));
+            create.size = 256;
+            if (drmIoctl(fd, DRM_IOCTL_TEGRA_GEM_CREATE, &create) != 0)
+                return 0;
+            handles[b] = create.handle;
+        }
+        for (b = 0; b < BENCH_SMALL_BUFFERS; b++) {
+            memset(&close_args, 0, sizeof(close_args));
+            close_args.handle = handles[b];
+            drmIoctl(fd, DRM_IOCTL_GEM_CLOSE, &close_args);
+        }
+    }
+    return i;
+}
+
+static unsigned long
+bench_slab (unsigned long iterations)
+{
+    static drmShimSlabPtr slab;
+    uint32_t handles[BENCH_SMALL_BUFFERS], offsets[BENCH_SMALL_BUFFERS];
+    unsigned long i;
+    unsigned int b;
+    int fd;
+
+    if (slab == NULL) {
+        fd = drmOpen("tegra", NULL);
+        if (fd < 0)
+            return 0;
+        slab = drmShimSlabCreate(fd, 0, 0);
+        if (slab == NULL)
+            return 0;
+    }
+    for (i = 0; i < iterations; i += BENCH_SMALL_BUFFERS) {
+        for (b = 0; b < BENCH_SMALL_BUFFERS; b++)
+            if (drmShimSlabAlloc(slab, 256, 0, &handles[b], &offsets[b]) != 0)
+                return 0;
+        for (b = 0; b < BENCH_SMALL_BUFFERS; b++)
+            drmShimSlabFree(slab, handles[b], offsets[b]);
+    }
+    return i;
+}
+
+/*
+ * Upload path: each operation maps a 1MiB GEM object, touches it
+ * and unmaps it.  The mapping is kept between operations in
+ * run-bench.sh's fake-cached mode.
+ */
+static unsigned long
+bench_bo_map_unmap (unsigned long iterations)
+{
+    static int fd = -1;
+    static uint32_t handle;
+    struct drm_tegra_gem_create create;
+    unsigned long i;
+    void *ptr;
+
+    if (fd < 0) {
+        fd = drmOpen("tegra", NULL);
+        if (fd < 0)
+            return 0;
+        memset(&create, 0, sizeof(create));
+        create.size = 1 << 20;
+        if (drmIoctl(fd, DRM_IOCTL_TEGRA_GEM_CREATE, &create) != 0) {
+            drmClose(fd);
+            fd = -1;
+            return 0;
+        }
+        handle = create.handle;
+    }
+    for (i = 0; i < iterations; i++) {
+        if (drmShimBoMap(fd, handle, 1 << 20, &ptr) != 0)
+            return 0;
+        *(volatile uint32_t *) ptr = (uint32_t) i;
+        drmShimBoUnmap(fd, handle, ptr);
+    }
+    return iterations;
+}
+
+/*
+ * Import path: each operation imports a dma-buf, as a compositor
+ * does for every client buffer it is handed, and closes the
+ * handle.  The dma-buf is exported once from a GEM object that is
+ * then closed, so only the fd keeps the buffer alive.  Imports are
+ * served from the cache in run-bench.sh's fake-cached mode.
+ */
+static unsigned long
+bench_prime_import (unsigned long iterations)
+{
+    static int fd = -1, prime_fd = -1;
+    struct drm_tegra_gem_create create;
+    struct drm_gem_close close_args;
+    unsigned long i;
+    uint32_t handle;
+
+    if (fd < 0) {
+        fd = drmOpen("tegra", NULL);
+        if (fd < 0)
+            return 0;
+        memset(&create, 0, sizeof(create));
+        create.size = 1 << 20;
+        if (drmIoctl(fd, DRM_IOCTL_TEGRA_GEM_CREATE, &create) != 0)
+            return 0;
+        if (drmPrimeHandleToFD(fd, create.handle, DRM_CLOEXEC, &prime_fd) != 0)
+            prime_fd = -1;
+        memset(&close_args, 0, sizeof(close_args));
+        close_args.handle = create.handle;
+        drmIoctl(fd, DRM_IOCTL_GEM_CLOSE, &close_args);
+    }
+    if (prime_fd < 0)
+        return 0;
+    for (i = 0; i < iterations; i++) {
+        if (drmPrimeFDToHandle(fd, prime_fd, &handle) != 0)
+            return 0;
+        memset(&close_args, 0, sizeof(close_args));
+        close_args.handle = handle;
+        drmIoctl(fd, DRM_IOCTL_GEM_CLOSE, &close_args);
+    }
+    return iterations;
+}
+
+/*
+ * Surface conversion: each operation detiles or tiles a whole
+ * 512x512 RGBA texture, small enough to stay in cache so the copy
+ * kernels rather than memory bandwidth set the pace.  Before the
+ * first run of each layout the conversions are checked against a
+ * byte-at-a-time reference, for every block height, for the whole
+ * surface and for rectangles with ragged edges.  --check-tiling
+ * runs just the checks, for the kernels DRM_SHIM_TILE_KERNELS picks.
+ */
+#define BENCH_SURFACE_PITCH	(512 * 4)
+#define BENCH_SURFACE_HEIGHT	512
+#define BENCH_SURFACE_BYTES	((unsigned long) BENCH_SURFACE_PITCH * BENCH_SURFACE_HEIGHT)
+
+static size_t
+surface_ref_offset (const drmShimSurface *surf, uint32_t x, uint32_t y)
+{
+    uint32_t gobs_high, gob, xg, yg;
+
+    if (surf->mode == DRM_TEGRA_GEM_TILING_MODE_TILED)
+        return ((size_t) (y / 16) * (surf->pitch / 16) + x / 16) * 256 + (y % 16) * 16 + x % 16;
+    gobs_high = 1U << surf->value;
+    gob = ((y / 8 / gobs_high) * (surf->pitch / 64) + x / 64) * gobs_high + y / 8 % gobs_high;
+    xg = x % 64;
+    yg = y % 8;
+    return (size_t) gob * 512 + (xg / 32) * 256 + (yg / 2) * 64 + (xg % 32 / 16) * 32 +
+        (yg % 2) * 16 + xg % 16;
+}
+
+/*
+ * x, y, width, height: across many tiles and GOBs, inside one, and
+ * across a few, none starting or ending on a boundary
+ */
+static const uint32_t surface_rects[][4] = {
+    { 37, 5, 1001, 300 },
+    { 3, 1, 5, 2 },
+    { 63, 7, 66, 18 },
+};
+
+static uint8_t *surface_tiled, *surface_linear, *surface_out;
+
+static int
+surface_rect_check (const drmShimSurface *surf, const uint32_t *rect)
+{
+    uint8_t *tiled = surface_tiled, *linear = surface_linear, *out = surface_out;
+    const uint32_t rx = rect[0], ry = rect[1], rw = rect[2], rh = rect[3];
+    uint32_t x, y;
+
+    for (x = 0; x < BENCH_SURFACE_BYTES; x++)
+        linear[x] = (uint8_t) ((x * 2654435761U) >> 24);
+    memset(tiled, 0, drmShimSurfaceSize(surf));
+    if (drmShimSurfaceTile(surf, tiled, linear, BENCH_SURFACE_PITCH, 0, 0,
+                           BENCH_SURFACE_PITCH, BENCH_SURFACE_HEIGHT) != 0)
+        return 0;
+    for (y = 0; y < BENCH_SURFACE_HEIGHT; y++)
+        for (x = 0; x < BENCH_SURFACE_PITCH; x++)
+            if (tiled[surface_ref_offset(surf, x, y)] != linear[y * BENCH_SURFACE_PITCH + x])
+                return 0;
+    memset(out, 0, BENCH_SURFACE_BYTES);
+    drmShimSurfaceDetile(surf, tiled, out, BENCH_SURFACE_PITCH, 0, 0,
+                         BENCH_SURFACE_PITCH, BENCH_SURFACE_HEIGHT);
+    if (memcmp(out, linear, BENCH_SURFACE_BYTES) != 0)
+        return 0;
+    memset(out, 0, BENCH_SURFACE_BYTES);
+    drmShimSurfaceDetile(surf, tiled, out, rw, rx, ry, rw, rh);
+    for (y = 0; y < rh; y++)
+        if (memcmp(out + y * rw, linear + (ry + y) * BENCH_SURFACE_PITCH + rx, rw) != 0)
+            return 0;
+    /* zeros tiled into the rectangle must land there and nowhere else */
+    memset(out, 0, BENCH_SURFACE_BYTES);
+    drmShimSurfaceTile(surf, tiled, out, rw, rx, ry, rw, rh);
+    for (y = 0; y < BENCH_SURFACE_HEIGHT; y++)
+        for (x = 0; x < BENCH_SURFACE_PITCH; x++) {
+            int inside = x >= rx && x < rx + rw && y >= ry && y < ry + rh;
+            if (tiled[surface_ref_offset(surf, x, y)] !=
+                (inside ? 0 : linear[y * BENCH_SURFACE_PITCH + x]))
+                return 0;
+        }
+    return 1;
+}
+
+static int
+surface_alloc (void)
+{
+    /* block-linear with the tallest blocks pads the height the most */
+    drmShimSurface surf = { DRM_TEGRA_GEM_TILING_MODE_BLOCK, 5,
+                            BENCH_SURFACE_PITCH, BENCH_SURFACE_HEIGHT };
+
+    if (surface_tiled == NULL) {
+        surface_tiled = malloc(drmShimSurfaceSize(&surf));
+        surface_linear = malloc(BENCH_SURFACE_BYTES);
+        surface_out = malloc(BENCH_SURFACE_BYTES);
+    }
+    return surface_tiled != NULL && surface_linear != NULL && surface_out != NULL;
+}
+
+/* Checks a layout at every block height; reports the first mismatch. */
+static int
+surface_check (unsigned int mode)
+{
+    drmShimSurface surf = { mode, 0, BENCH_SURFACE_PITCH, BENCH_SURFACE_HEIGHT };
+    uint32_t last = (mode == DRM_TEGRA_GEM_TILING_MODE_BLOCK ? 5 : 0);
+    unsigned int i;
+
+    for (surf.value = 0; surf.value <= last; surf.value++)
+        for (i = 0; i < sizeof(surface_rects)/sizeof(surface_rects[0]); i++)
+            if (!surface_rect_check(&surf, surface_rects[i])) {
+                fprintf(stderr, "surface conversion (mode %u, block height %u, rectangle %u, "
+                        "%s kernels) does not match the reference\n",
+                        mode, surf.value, i, drmShimSurfaceKernels());
+                return 0;
+            }
+    return 1;
+}
+
+/*
+ * Runs the checks alone, for run-bench.sh to repeat with each set of
+ * kernels.  A set the CPU lacks is skipped: the shim falls back to
+ * the one it would have chosen.
+ */
+static int
+surface_check_all (void)
+{
+    const char *want = getenv("DRM_SHIM_TILE_KERNELS");
+
+    if (want != NULL && strcmp(want, drmShimSurfaceKernels()) != 0) {
+        fprintf(stderr, "tiling check: %s kernels skipped, not supported here\n", want);
+        return 1;
+    }
+    if (!surface_alloc()) {
+        fprintf(stderr, "tiling check: out of memory\n");
+        return 0;
+    }
+    if (!surface_check(DRM_TEGRA_GEM_TILING_MODE_TILED) ||
+        !surface_check(DRM_TEGRA_GEM_TILING_MODE_BLOCK))
+        return 0;
+    fprintf(stderr, "tiling check: %s kernels match the reference\n", drmShimSurfaceKernels());
+    return 1;
+}
+
+static unsigned long
+bench_surface (unsigned int mode, int to_tiled, unsigned long iterations)
+{
+    static int checked[3];
+    drmShimSurface surf = { mode, 4, BENCH_SURFACE_PITCH, BENCH_SURFACE_HEIGHT };
+    unsigned long i;
+
+    if (!surface_alloc())
+        return 0;
+    if (!checked[mode]) {
+        if (!surface_check(mode))
+            exit(1);
+        checked[mode] = 1;
+    }
+    for (i = 0; i < iterations; i++) {
+        if (to_tiled)
+            drmShimSurfaceTile(&surf, surface_tiled, surface_linear, BENCH_SURFACE_PITCH, 0, 0,
+                               BENCH_SURFACE_PITCH, BENCH_SURFACE_HEIGHT);
+        else
+            drmShimSurfaceDetile(&surf, surface_tiled, surface_linear, BENCH_SURFACE_PITCH, 0, 0,
+                                 BENCH_SURFACE_PITCH, BENCH_SURFACE_HEIGHT);
+    }
+    return iterations;
+}
+
+static unsigned long
+bench_detile_tiled (unsigned long iterations)
+{
+    return bench_surface(DRM_TEGRA_GEM_TILING_MODE_TILED, 0, iterations);
+}
+
+static unsigned long
+bench_tile_tiled (unsigned long iterations)
+{
+    return bench_surface(DRM_TEGRA_GEM_TILING_MODE_TILED, 1, iterations);
+}
+
+static unsigned long
+bench_detile_block (unsigned long iterations)
+{
+    return bench_surface(DRM_TEGRA_GEM_TILING_MODE_BLOCK, 0, iterations);
+}
+
+static unsigned long
+bench_tile_block (unsigned long iterations)
+{
+    return bench_surface(DRM_TEGRA_GEM_TILING_MODE_BLOCK, 1, iterations);
+}
+
+/*
+ * Each operation adds BENCH_REACTOR_FENCES fences to a reactor,
+ * signals them all, and waits for every callback to run.
+ */
+#define BENCH_REACTOR_FENCES 256
+
+static int reactor_done;
+
+static void
+reactor_callback (int fd, int status, void *user_data)
+{
+    __atomic_fetch_add(&reactor_done, 1, __ATOMIC_RELEASE);
+}
+
+static unsigned long
+bench_reactor (unsigned long iterations)
+{
+    static int fds[BENCH_REACTOR_FENCES];
+    drmShimReactorPtr reactor;
+    unsigned long i;
+    unsigned int f;
+    uint64_t one = 1;
+
+    reactor = drmShimReactorCreate(4);
+    if (reactor == NULL)
+        return 0;
+    for (i = 0; i < iterations; i++) {
+        reactor_done = 0;
+        for (f = 0; f < BENCH_REACTOR_FENCES; f++) {
+            fds[f] = eventfd(0, EFD_CLOEXEC);
+            drmShimReactorAddFence(reactor, fds[f], reactor_callback, NULL);
+        }
+        for (f = 0; f < BENCH_REACTOR_FENCES; f++)
+            if (write(fds[f], &one, sizeof(one)) < 0)
+                break;
+        while (__atomic_load_n(&reactor_done, __ATOMIC_ACQUIRE) < BENCH_REACTOR_FENCES)
+            sched_yield();
+        for (f = 0; f < BENCH_REACTOR_FENCES; f++)
+            close(fds[f]);
+    }
+    drmShimReactorDestroy(reactor);
+    return iterations;
+}
+
+/*
+ * The merge cases need real sync_file fences, created on a
+ * software timeline through sw_sync in debugfs.
+ */
+struct sw_sync_create_fence_data {
+    uint32_t value;
+    char name[32];
+    int32_t fence;
+};
+#define SW_SYNC_IOC_CREATE_FENCE _IOWR('W', 0, struct sw_sync_create_fence_data)
+
+static int sync_fences[BENCH_FENCES];
+
+static int
+sw_sync_fences (void)
+{
+    static int ready = -1;
+    struct sw_sync_create_fence_data data;
+    unsigned int i;
+    int timeline;
+
+    if (ready >= 0)
+        return ready;
+    ready = 0;
+    timeline = open("/sys/kernel/debug/sync/sw_sync", O_RDWR|O_CLOEXEC);
+    if (timeline < 0)
+        return 0;
+    for (i = 0; i < BENCH_FENCES; i++) {
+        memset(&data, 0, sizeof(data));
+        data.value = i + 1;
+        snprintf(data.name, sizeof(data.name), "bench%u", i);
+        if (ioctl(timeline, SW_SYNC_IOC_CREATE_FENCE, &data) < 0)
+            return 0;
+        sync_fences[i] = data.fence;
+    }
+    ready = 1;
+    return 1;
+}
+
+static unsigned long
+bench_sync_accumulate (unsigned long iterations)
+{
+    unsigned long i;
+    unsigned int f;
+
+    if (!sw_sync_fences())
+        return 0;
+    for (i = 0; i < iterations; i++) {
+        int fd = -1;
+        for (f = 0; f < BENCH_FENCES; f++)
+            if (sync_accumulate("bench", &fd, sync_fences[f]) < 0)
+                return 0;
+        close(fd);
+    }
+    return iterations;
+}
+
+static unsigned long
+bench_sync_merge_many (unsigned long iterations)
+{
+    unsigned long i;
+    int fd;
+
+    if (!sw_sync_fences())
+        return 0;
+    for (i = 0; i < iterations; i++) {
+        fd = sync_merge_many("bench", sync_fences, BENCH_FENCES);
+        if (fd < 0)
+            return 0;
+        close(fd);
+    }
+    return iterations;
+}
+
+static const struct bench_case cases[] = {
+    { "drmIoctl", bench_ioctl, 1 },
+    { "drmAvailable", bench_available, 1 },
+    { "drmModeAtomicAddProperty", bench_atomic_add_property, 1 },
+    { "sync_wait_loop/32", bench_sync_wait_loop, 1000 },
+    { "sync_wait_many/32", bench_sync_wait_many, 1000 },
+    { "drmShimFenceWaitMany/32", bench_fence_wait_many, 1 },
+    { "drmShimFenceTableWait/32", bench_fence_table, 1 },
+    { "drmShimReactor/256", bench_reactor, 100000 },
+    { "syncpt_read", bench_syncpt_read, 1 },
+    { "drmShimSyncptPassed", bench_syncpt_passed, 1 },
+    { "syncobj_create_destroy", bench_syncobj_create, 10 },
+    { "drmShimSyncobjPool", bench_syncobj_pool, 10 },
+    { "gem_create_close/1M", bench_gem_create_close, 10 },
+    { "bo_map_unmap/1M", bench_bo_map_unmap, 10 },
+    { "gem_create_close/256", bench_small_gem, 10 },
+    { "drmShimSlabAlloc/256", bench_slab, 1 },
+    { "detile/tiled", bench_detile_tiled, 10000, BENCH_SURFACE_BYTES },
+    { "tile/tiled", bench_tile_tiled, 10000, BENCH_SURFACE_BYTES },
+    { "detile/block", bench_detile_block, 10000, BENCH_SURFACE_BYTES },
+    { "tile/block", bench_tile_block, 10000, BENCH_SURFACE_BYTES },
+    { "prime_import_close", bench_prime_import, 10 },
+    { "syncpt_wait_latency/block", bench_wait_block, 2000 },
+    { "syncpt_wait_latency/spin", bench_wait_spin, 2000 },
+    { "syncpt_wait_latency/adaptive", bench_wait_adaptive, 2000 },
+    { "sync_accumulate/32", bench_sync_accumulate, 1000 },
+    { "sync_merge_many/32", bench_sync_merge_many, 1000 },
+};
+
+int
+main (int argc, char **argv)
+{
+    static const struct option opts[] = {
+        { "mode",       required_argument, NULL, 'm' },
+        { "iterations", required_argument, NULL, 'n' },
+        { "filter",     required_argument, NULL, 'f' },
+        { "check-tiling", no_argument,     NULL, 'c' },
+        { "help",       no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 },
+    };
+    const char *mode = "default", *filter = NULL;
+    unsigned long iterations = 10000000;
+    unsigned int i, run;
+    int c;
+
+    while ((c = getopt_long(argc, argv, "m:n:f:ch", opts, NULL)) != -1) {
+        switch (c) {
+        case 'm':
+            mode = optarg;
+            break;
+        case 'n':
+            iterations = strtoul(optarg, NULL, 0);
+            break;
+        case 'f':
+            filter = optarg;
+            break;
+        case 'c':
+            return surface_check_all() ? 0 : 1;
+        default:
+            fprintf(stderr, "Usage: %s [--mode LABEL] [--iterations N] [--filter STR] [--check-tiling]\n",
+                    argv[0]);
+            return (c == 'h' ? 0 : 1);
+        }
+    }
+    if (iterations == 0)
+        iterations = 1;
+
+    for (i = 0; i < sizeof(cases)/sizeof(cases[0]); i++) {
+        unsigned long n = iterations / cases[i].divisor + 1;
+        double best = 0.0;
+        unsigned long ops = 0;
+
+        if (filter != NULL && strstr(cases[i].name, filter) == NULL)
+            continue;
+        if (cases[i].run(n / 10 + 1) == 0) {
+            fprintf(stderr, "%s: skipped, not supported here\n", cases[i].name);
+            continue;
+        }
+        for (run = 0; run < BENCH_RUNS; run++) {
+            uint64_t start = now_ns();
+            double per_op;
+            ops = cases[i].run(n);
+            per_op = (double) (now_ns() - start) / (ops ? ops : 1);
+            if (run == 0 || per_op < best)
+                best = per_op;
+        }
+        printf("{\"mode\": \"%s\", \"case\": \"%s\", \"ns_per_op\": %.3f, \"ops\": %lu, \"stats\": %d",
+               mode, cases[i].name, best, ops, drmShimStatsEnabled());
+        if (cases[i].bytes != 0)
+            printf(", \"gb_per_s\": %.3f", cases[i].bytes / best);
+        printf("}\n");
+    }
+    return 0;
+}
@@ -0,0 +1,29 @@
+/*
+ * fake-libdrm.c
+ *
+ * Minimal stand-in for the Tegra libdrm, used by the benchmarks
+ * to measure the shim's forwarding cost on hosts without Tegra
+ * hardware.  Each function does as little as possible.
+ *
+ * Copyright (c) 2018-2019, Matthew Madison
+ * Distributed under license; see the LICENSE file for details.
+ */
+#include <stdint.h>
+
+int
+drmIoctl (int fd, unsigned long request, void *arg)
+{
+    return 0;
+}
+
+int
+drmAvailable (void)
+{
+    return 1;
+}
+
+int
+drmModeAtomicAddProperty (void *req, uint32_t object_id, uint32_t property_id, uint64_t value)
+{
+    return 1;
+}
@@ -0,0 +1,44 @@
+#!/bin/sh
+#
+# run-bench.sh
+#
+# Checks the tiling kernels, then runs drm-shim-bench against each
+# backend the shim can use.  Invoked by 'make bench'.
+#
+# Usage: run-bench.sh <bench-program> <target-library-path> [bench args...]
+#
+# The vendor modes need a libdrm.so.2 in the target library path.
+# Configure with --with-target-library-path=<builddir>/bench to
+# use the stand-in library built by 'make bench'.
+#
+
+if [ $# -lt 2 ]; then
+    echo "Usage: $0 <bench-program> <target-library-path> [bench args...]" >&2
+    exit 1
+fi
+bench="$1"
+targetdir="$2"
+shift 2
+
+run_mode() {
+    mode="$1"
+    shift
+    env "$@" "$bench" --mode "$mode" $benchargs || exit 1
+}
+
+benchargs="$*"
+
+# Each set of tiling kernels the CPU has, against the reference.
+for kernels in generic sse2 sse4.1 neon; do
+    env DRM_SHIM_BACKEND=stub DRM_SHIM_TILE_KERNELS=$kernels "$bench" --check-tiling || exit 1
+done
+
+run_mode stub DRM_SHIM_BACKEND=stub
+run_mode fake DRM_SHIM_BACKEND=fake
+run_mode fake-cached DRM_SHIM_BACKEND=fake DRM_SHIM_BO_CACHE=64 DRM_SHIM_MMAP_CACHE=256 DRM_SHIM_PRIME_CACHE=16
+if [ -e "$targetdir/libdrm.so.2" ]; then
+    run_mode vendor DRM_SHIM_BACKEND=vendor
+    run_mode vendor-stats DRM_SHIM_BACKEND=vendor DRM_SHIM_STATS=/dev/null
+else
+    echo "run-bench.sh: no libdrm.so.2 in $targetdir, skipping vendor modes" >&2
+fi
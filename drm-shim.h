@@ -0,0 +1,353 @@
+/*
+ * drm-shim.h
+ *
+ * Extensions provided by the Tegra libdrm shim on top of the
+ * standard libdrm API.
+ *
+ * Copyright (c) 2018-2019, Matthew Madison
+ * Distributed under license; see the LICENSE file for details.
+ */
+#ifndef _DRM_SHIM_H_
+#define _DRM_SHIM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/*
+ * Per-function call statistics.  Only collected when the shim is
+ * built with --enable-instrumentation and DRM_SHIM_STATS is set in
+ * the environment.  hist[n] counts calls that took between 2^(n-1)
+ * and 2^n - 1 nanoseconds; the last bucket also holds anything slower.
+ */
+#define DRM_SHIM_HIST_BUCKETS 32
+
+typedef struct _drmShimCallStats {
+    const char *name;
+    uint64_t    calls;
+    uint64_t    total_ns;
+    uint64_t    hist[DRM_SHIM_HIST_BUCKETS];
+} drmShimCallStats, *drmShimCallStatsPtr;
+
+extern int drmShimStatsEnabled(void);
+extern unsigned int drmShimStatsCount(void);
+extern int drmShimStatsGet(unsigned int index, drmShimCallStatsPtr stats);
+extern void drmShimStatsDump(int fd);
+
+/*
+ * Fence helpers built on the libsync.h functions.  Fences seen
+ * signalled are remembered per thread, so later checks, waits and
+ * merges involving them make no syscalls.  Since fd numbers are
+ * reused, fences passed to these functions must be closed with
+ * drmShimFenceClose(), or drmShimFenceForget() called both before
+ * and after they are closed some other way.  drmShimFenceWaitMany()
+ * takes the SYNC_WAIT_* flags from libsync.h.
+ */
+extern int drmShimFenceSignaled(int fd);
+extern int drmShimFenceWait(int fd, int timeout);
+extern int drmShimFenceWaitMany(const int *fds, unsigned int count, int timeout,
+                                int flags, unsigned int *first);
+extern int drmShimFenceMerge(const char *name, const int *fds, unsigned int count);
+extern int drmShimFenceAccumulate(const char *name, int *fd1, int fd2);
+extern void drmShimFenceForget(int fd);
+extern int drmShimFenceClose(int fd);
+
+/*
+ * Fence completion table shared between processes through a file,
+ * e.g. one under /dev/shm.  Each slot stands for one producer
+ * timeline whose fences complete in sequence-number order; the
+ * producer publishes each sequence number once its fence has
+ * completed.  A consumer handed a fence together with its slot and
+ * sequence number can then check it with one memory load, and
+ * drmShimFenceTableWait() only waits on the fd (as
+ * drmShimFenceWait() does) if the table does not show it complete.
+ * drmShimFenceTableOpen() creates the file with nslots slots and
+ * mode 0600 if it is new; nslots == 0 opens an existing table.
+ */
+typedef struct _drmShimFenceTable *drmShimFenceTablePtr;
+
+extern drmShimFenceTablePtr drmShimFenceTableOpen(const char *path, unsigned int nslots);
+extern void drmShimFenceTableClose(drmShimFenceTablePtr table);
+extern unsigned int drmShimFenceTableSlots(drmShimFenceTablePtr table);
+extern int drmShimFenceTablePublish(drmShimFenceTablePtr table, unsigned int slot,
+                                    uint64_t seqno);
+extern int drmShimFenceTableSignaled(drmShimFenceTablePtr table, unsigned int slot,
+                                     uint64_t seqno);
+extern int drmShimFenceTableWait(drmShimFenceTablePtr table, unsigned int slot,
+                                 uint64_t seqno, int fd, int timeout);
+
+/*
+ * Syncpoint waits.  The last value read for each syncpoint is
+ * cached, so checks and waits on thresholds that have already
+ * passed make no ioctl.  Timeouts are in milliseconds, with
+ * DRM_TEGRA_NO_TIMEOUT (0xffffffff) for none.  These return 0 or a
+ * negative error code, -ETIMEDOUT if the timeout expires;
+ * drmShimSyncptPassed() returns 1 once the
+ * threshold has passed.  drmShimSyncptExportFd() returns an fd that
+ * polls readable once the threshold passes, for use with poll(),
+ * epoll or the reactor below.
+ */
+#define DRM_SHIM_SYNCPT_WAIT_ANY	0
+#define DRM_SHIM_SYNCPT_WAIT_ALL	(1 << 0)
+
+typedef struct _drmShimSyncptThresh {
+    uint32_t id;
+    uint32_t thresh;
+} drmShimSyncptThresh;
+
+extern int drmShimSyncptRead(int fd, uint32_t id, uint32_t *value);
+extern int drmShimSyncptPassed(int fd, uint32_t id, uint32_t thresh);
+extern int drmShimSyncptWait(int fd, uint32_t id, uint32_t thresh, uint32_t timeout);
+extern int drmShimSyncptWaitMany(int fd, const drmShimSyncptThresh *thresholds,
+                                 unsigned int count, uint32_t timeout, int flags,
+                                 unsigned int *first);
+extern int drmShimSyncptExportFd(int fd, uint32_t id, uint32_t thresh);
+
+/*
+ * Wait policy for drmShimSyncptWait(), drmShimSyncptWaitMany() and
+ * drmShimFenceWait().  DRM_SHIM_WAIT_BLOCK (the default) blocks in
+ * the kernel straight away.  DRM_SHIM_WAIT_SPIN polls for up to
+ * max_spin_us microseconds first.  DRM_SHIM_WAIT_ADAPTIVE spins for
+ * about twice the recent completion time of each syncpoint, up to
+ * max_spin_us, and blocks straight away on syncpoints whose jobs
+ * take longer.  max_spin_us == 0 picks the default of 100.
+ */
+#define DRM_SHIM_WAIT_BLOCK	0
+#define DRM_SHIM_WAIT_SPIN	1
+#define DRM_SHIM_WAIT_ADAPTIVE	2
+
+extern int drmShimSetWaitPolicy(int policy, uint32_t max_spin_us);
+
+/*
+ * Reactor that waits on many fences and DRM event fds with a
+ * single epoll instance, running callbacks on a pool of worker
+ * threads (workers == 0 picks the default of 2).  Fence callbacks
+ * run once, with status 0 when the fence signals, or -ECANCELED if
+ * the reactor is destroyed first.  For a DRM fd, drmHandleEvent()
+ * is called on a worker whenever events are pending, never on two
+ * workers at once.  The reactor works on its own dup of each fd,
+ * so the caller may close theirs once a fence is added.  A reactor
+ * cannot be destroyed from one of its own callbacks.
+ */
+struct _drmEventContext;
+typedef struct _drmShimReactor *drmShimReactorPtr;
+typedef void (*drmShimFenceCallback)(int fd, int status, void *user_data);
+
+extern drmShimReactorPtr drmShimReactorCreate(unsigned int workers);
+extern void drmShimReactorDestroy(drmShimReactorPtr reactor);
+extern int drmShimReactorAddFence(drmShimReactorPtr reactor, int fd,
+                                  drmShimFenceCallback callback, void *user_data);
+extern int drmShimReactorAddDrm(drmShimReactorPtr reactor, int fd,
+                                struct _drmEventContext *evctx);
+extern int drmShimReactorRemoveDrm(drmShimReactorPtr reactor, int fd);
+
+/*
+ * Pool of syncobj handles on one fd.  drmShimSyncobjPoolGet() hands
+ * out an unsignalled syncobj (signalled, if flags includes
+ * DRM_SYNCOBJ_CREATE_SIGNALED), creating one only when the pool is
+ * empty.  drmShimSyncobjPoolPut() gives it back in place of
+ * drmSyncobjDestroy(); returned handles are reset in batches before
+ * they are reused.  Handles that demand no longer needs are
+ * destroyed.  Both return 0 or a negative errno; -EINVAL from
+ * drmShimSyncobjPoolPut() for a handle the pool did not hand out.
+ * Hit rate is hits / gets.
+ */
+typedef struct _drmShimSyncobjPool *drmShimSyncobjPoolPtr;
+
+typedef struct _drmShimSyncobjPoolStats {
+    uint64_t gets;
+    uint64_t hits;              /* gets served without a create */
+    uint64_t puts;
+    uint64_t creates;
+    uint64_t destroys;
+    uint64_t reset_batches;     /* drmSyncobjReset() calls */
+    uint32_t free;
+    uint32_t in_use;
+} drmShimSyncobjPoolStats;
+
+extern drmShimSyncobjPoolPtr drmShimSyncobjPoolCreate(int fd);
+extern void drmShimSyncobjPoolDestroy(drmShimSyncobjPoolPtr pool);
+extern int drmShimSyncobjPoolGet(drmShimSyncobjPoolPtr pool, uint32_t flags, uint32_t *handle);
+extern int drmShimSyncobjPoolPut(drmShimSyncobjPoolPtr pool, uint32_t handle);
+extern void drmShimSyncobjPoolGetStats(drmShimSyncobjPoolPtr pool,
+                                       drmShimSyncobjPoolStats *stats);
+
+/*
+ * Statistics for the GEM object cache, which is enabled by setting
+ * DRM_SHIM_BO_CACHE to the most it may hold, in MiB.  creates counts
+ * DRM_IOCTL_TEGRA_GEM_CREATE calls and hits those served from the
+ * cache; parked counts GEM closes that kept the object, and
+ * evictions parked objects later freed for age or space.
+ */
+typedef struct _drmShimBoCacheStats {
+    uint64_t creates;
+    uint64_t hits;
+    uint64_t parked;
+    uint64_t evictions;
+    uint64_t bytes_held;
+    uint64_t objects_held;
+} drmShimBoCacheStats;
+
+extern void drmShimBoCacheGetStats(drmShimBoCacheStats *stats);
+
+/*
+ * CPU mappings of GEM objects.  drmShimBoMap() returns a reference
+ * to the handle's mapping of at least size bytes, mapping it on
+ * first use, and drmShimBoUnmap() drops the one for the mapping at
+ * ptr.  Both return 0 or a negative errno; -EBUSY if a larger
+ * mapping is asked for while the smaller one is referenced, and
+ * -ENOSYS if the kernel cannot compare open files (no kcmp).  With DRM_SHIM_MMAP_CACHE set to
+ * an address space cap in MiB, unreferenced mappings are kept until
+ * the GEM handle is closed or they are evicted, least recently used
+ * first, to stay under the cap.  A referenced mapping is not
+ * unmapped when its handle is closed, only when its last reference
+ * is dropped.
+ */
+typedef struct _drmShimMmapCacheStats {
+    uint64_t maps;              /* drmShimBoMap() calls */
+    uint64_t hits;              /* maps served by an existing mapping */
+    uint64_t mmaps;
+    uint64_t munmaps;
+    uint64_t offset_hits;       /* GEM_MMAP offsets served from the table */
+    uint64_t evictions;
+    uint64_t bytes_mapped;
+} drmShimMmapCacheStats;
+
+extern int drmShimBoMap(int fd, uint32_t handle, uint64_t size, void **ptr);
+extern int drmShimBoUnmap(int fd, uint32_t handle, void *ptr);
+extern void drmShimMmapCacheGetStats(drmShimMmapCacheStats *stats);
+
+/*
+ * Sub-allocator for small GEM buffers.  drmShimSlabAlloc() carves
+ * allocations of up to 4KiB out of shared GEM objects of slab_size
+ * bytes (0 for the default of 64KiB) and returns the object's handle
+ * and the allocation's offset in it; larger allocations get an
+ * object of their own at offset 0.  Both it and drmShimSlabFree()
+ * return 0 or a negative errno.  In the statistics, used_bytes
+ * counts the chunks holding live allocations and requested_bytes
+ * what was asked for, so 1 - requested_bytes / used_bytes is the
+ * internal fragmentation and 1 - used_bytes / slab_bytes the space
+ * left free in the slabs.
+ */
+typedef struct _drmShimSlab *drmShimSlabPtr;
+
+typedef struct _drmShimSlabStats {
+    uint64_t allocs;
+    uint64_t frees;
+    uint64_t gem_creates;       /* kernel objects created */
+    uint64_t gem_closes;
+    uint64_t slab_bytes;        /* in slabs and large objects */
+    uint64_t used_bytes;
+    uint64_t requested_bytes;
+    uint32_t slabs;
+    uint32_t large_objects;
+} drmShimSlabStats;
+
+extern drmShimSlabPtr drmShimSlabCreate(int fd, uint32_t slab_size, uint32_t flags);
+extern void drmShimSlabDestroy(drmShimSlabPtr alloc);
+extern int drmShimSlabAlloc(drmShimSlabPtr alloc, uint32_t size, uint32_t align,
+                            uint32_t *handle, uint32_t *offset);
+extern int drmShimSlabFree(drmShimSlabPtr alloc, uint32_t handle, uint32_t offset);
+extern void drmShimSlabGetStats(drmShimSlabPtr alloc, drmShimSlabStats *stats);
+
+/*
+ * Copies between linear memory and a tiled surface, given as the
+ * DRM_TEGRA_GEM_TILING_MODE_* and parameter that
+ * DRM_IOCTL_TEGRA_GEM_GET_TILING reports (drmShimSurfaceQuery()
+ * fills them in), with the surface's pitch and height.  TILED
+ * surfaces need a pitch that is a multiple of 16 bytes, and BLOCK
+ * ones a multiple of 64, with value the log2 of the block height in
+ * GOBs.  x and width are in bytes; the rectangle's first byte is at
+ * linear, and its rows linear_pitch bytes apart.  These return 0 or
+ * a negative errno.  drmShimSurfaceSize() gives the bytes the tiled
+ * surface occupies, and drmShimSurfaceKernels() names the copy
+ * kernels in use.
+ */
+typedef struct _drmShimSurface {
+    uint32_t mode;
+    uint32_t value;
+    uint32_t pitch;
+    uint32_t height;
+} drmShimSurface;
+
+extern int drmShimSurfaceQuery(int fd, uint32_t handle, uint32_t pitch, uint32_t height,
+                               drmShimSurface *surf);
+extern size_t drmShimSurfaceSize(const drmShimSurface *surf);
+extern int drmShimSurfaceDetile(const drmShimSurface *surf, const void *tiled,
+                                void *linear, uint32_t linear_pitch,
+                                uint32_t x, uint32_t y, uint32_t width, uint32_t height);
+extern int drmShimSurfaceTile(const drmShimSurface *surf, void *tiled,
+                              const void *linear, uint32_t linear_pitch,
+                              uint32_t x, uint32_t y, uint32_t width, uint32_t height);
+extern const char *drmShimSurfaceKernels(void);
+
+/*
+ * Statistics for the PRIME import cache, which is enabled by setting
+ * DRM_SHIM_PRIME_CACHE to the number of idle handles to keep.  As
+ * with the kernel, one GEM close releases a handle however many
+ * times it was imported; the handle is then kept for reuse, holding
+ * the buffer, until it is evicted or the fd is closed.
+ *
+ * drmShimPrimeImport() imports a dma-buf and takes a reference to
+ * the handle, which drmShimPrimeRelease() drops; the handle is
+ * released once the last reference is dropped, and a GEM close
+ * leaves it open while references are held.  Both return 0 or a
+ * negative errno, -ENOSYS from drmShimPrimeImport() where the
+ * kernel lacks kcmp().  They work with the cache off, when released
+ * handles are closed at once.
+ */
+typedef struct _drmShimPrimeCacheStats {
+    uint64_t imports;           /* imports of dma-buf fds */
+    uint64_t hits;              /* imports served without an ioctl */
+    uint64_t evictions;
+    uint64_t entries;           /* handles tracked */
+    uint64_t idle;              /* handles released and kept */
+} drmShimPrimeCacheStats;
+
+extern int drmShimPrimeImport(int fd, int prime_fd, uint32_t *handle);
+extern int drmShimPrimeRelease(int fd, uint32_t handle);
+extern void drmShimPrimeCacheGetStats(drmShimPrimeCacheStats *stats);
+
+/*
+ * Threaded DRM event dispatcher.  A thread reads the fd's events
+ * in bulk and queues each on its CRTC's queue (CRTC 0 for sequence
+ * events, and for kernels that do not report the CRTC).  Each
+ * queue has a single consumer, which takes events with
+ * drmShimEventNext() (1 if one was taken, 0 if none),
+ * drmShimEventWait(), or drmShimEventDispatch(), which runs the
+ * drmEventContext handlers for everything queued.  The fd from
+ * drmShimEventQueueFd() polls readable while events are queued.
+ * Events arriving at a full queue are dropped and counted.  If
+ * reading the fd fails or hits end of file, every queue's fd polls
+ * readable, and once a queue is empty drmShimEventNext() and
+ * drmShimEventWait() return -EPIPE.
+ */
+typedef struct _drmShimEventDispatcher *drmShimEventDispatcherPtr;
+
+typedef struct _drmShimEvent {
+    uint32_t type;              /* DRM_EVENT_* */
+    uint32_t crtc_id;
+    uint64_t sequence;
+    uint64_t time_ns;
+    uint64_t user_data;
+} drmShimEvent;
+
+extern drmShimEventDispatcherPtr drmShimEventDispatcherCreate(int fd, unsigned int queue_size);
+extern void drmShimEventDispatcherDestroy(drmShimEventDispatcherPtr dispatcher);
+extern int drmShimEventQueueFd(drmShimEventDispatcherPtr dispatcher, uint32_t crtc_id);
+extern int drmShimEventNext(drmShimEventDispatcherPtr dispatcher, uint32_t crtc_id,
+                            drmShimEvent *event);
+extern int drmShimEventWait(drmShimEventDispatcherPtr dispatcher, uint32_t crtc_id,
+                            drmShimEvent *event, int timeout);
+extern int drmShimEventDispatch(drmShimEventDispatcherPtr dispatcher, uint32_t crtc_id,
+                                struct _drmEventContext *evctx);
+extern uint64_t drmShimEventDropped(drmShimEventDispatcherPtr dispatcher, uint32_t crtc_id);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif
@@ -8,227 +8,214 @@
  */
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <stdarg.h>
 #include <errno.h>
 #include <sys/types.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <dlfcn.h>
-#include "xf86drm.h"
-#include "xf86drmMode.h"
+#include <pthread.h>
+#include "shim-funcs.h"
+#include "shim-private.h"
 #include "config.h"
 
+#define FUNCDEF(type__, name__, args__, actargs__, ret__) \
+    [FUNCID_##name__] = #name__,
+const char *const shim_func_names[] = {
+    FUNCDEFS
+};
 #undef FUNCDEF
-#define FUNCDEFS \
-    FUNCDEF(int, drmIoctl, (int fd, unsigned long request, void *arg), (fd, request, arg), return 0) \
-    FUNCDEF(void *, drmGetHashTable, (void), (), return 0) \
-    FUNCDEF(drmHashEntry *, drmGetEntry, (int fd), (fd), return 0) \
-    FUNCDEF(int, drmAvailable, (void), (), return 0) \
-    FUNCDEF(int, drmOpen, (const char *name, const char *busid), (name, busid), return -EINVAL) \
-    FUNCDEF(int, drmOpenWithType, (const char *name, const char *busid, int type), (name, busid, type), return 0) \
-    FUNCDEF(int, drmOpenControl, (int minor), (minor), return 0) \
-    FUNCDEF(int, drmOpenRender, (int minor), (minor), return 0) \
-    FUNCDEF(int, drmClose, (int fd), (fd), return 0) \
-    FUNCDEF(drmVersionPtr, drmGetVersion, (int fd), (fd), return 0) \
-    FUNCDEF(drmVersionPtr, drmGetLibVersion, (int fd), (fd), return 0) \
-    FUNCDEF(int, drmGetCap, (int fd, uint64_t capability, uint64_t *value), (fd, capability, value), return 0) \
-    FUNCDEF(void, drmFreeVersion, (drmVersionPtr v), (v), return) \
-    FUNCDEF(int, drmGetMagic, (int fd, drm_magic_t * magic), (fd,  magic), return 0) \
-    FUNCDEF(char *, drmGetBusid, (int fd), (fd), return 0) \
-    FUNCDEF(int, drmGetInterruptFromBusID, (int fd, int busnum, int devnum, int funcnum), (fd, busnum, devnum, funcnum), return 0) \
-    FUNCDEF(int, drmGetMap, (int fd, int idx, drm_handle_t *offset, drmSize *size, drmMapType *type, drmMapFlags *flags, drm_handle_t *handle, int *mtrr), (fd, idx, offset, size, type, flags, handle, mtrr), return 0) \
-    FUNCDEF(int, drmGetClient, (int fd, int idx, int *auth, int *pid, int *uid, unsigned long *magic, unsigned long *iocs), (fd, idx, auth, pid, uid, magic, iocs), return 0) \
-    FUNCDEF(int, drmGetStats, (int fd, drmStatsT *stats), (fd, stats), return 0) \
-    FUNCDEF(int, drmSetInterfaceVersion, (int fd, drmSetVersion *version), (fd, version), return 0) \
-    FUNCDEF(int, drmCommandNone, (int fd, unsigned long drmCommandIndex), (fd, drmCommandIndex), return 0) \
-    FUNCDEF(int, drmCommandRead, (int fd, unsigned long drmCommandIndex, void *data, unsigned long size), (fd, drmCommandIndex, data, size), return 0) \
-    FUNCDEF(int, drmCommandWrite, (int fd, unsigned long drmCommandIndex, void *data, unsigned long size), (fd, drmCommandIndex, data, size), return 0) \
-    FUNCDEF(int, drmCommandWriteRead, (int fd, unsigned long drmCommandIndex, void *data, unsigned long size), (fd, drmCommandIndex, data, size), return 0) \
-    FUNCDEF(void, drmFreeBusid, (const char *busid), (busid), return) \
-    FUNCDEF(int, drmSetBusid, (int fd, const char *busid), (fd, busid), return 0) \
-    FUNCDEF(int, drmAuthMagic, (int fd, drm_magic_t magic), (fd, magic), return 0) \
-    FUNCDEF(int, drmAddMap, (int fd, drm_handle_t offset, drmSize size, drmMapType type, drmMapFlags flags, drm_handle_t * handle), (fd, offset, size, type, flags,  handle), return 0) \
-    FUNCDEF(int	, drmRmMap, (int fd, drm_handle_t handle), (fd, handle), return 0) \
-    FUNCDEF(int	, drmAddContextPrivateMapping, (int fd, drm_context_t ctx_id, drm_handle_t handle), (fd, ctx_id, handle), return 0) \
-    FUNCDEF(int, drmAddBufs, (int fd, int count, int size, drmBufDescFlags flags, int agp_offset), (fd, count, size, flags, agp_offset), return 0) \
-    FUNCDEF(int, drmMarkBufs, (int fd, double low, double high), (fd, low, high), return 0) \
-    FUNCDEF(int, drmCreateContext, (int fd, drm_context_t * handle), (fd,  handle), return 0) \
-    FUNCDEF(int, drmSetContextFlags, (int fd, drm_context_t context, drm_context_tFlags flags), (fd, context, flags), return 0) \
-    FUNCDEF(int, drmGetContextFlags, (int fd, drm_context_t context, drm_context_tFlagsPtr flags), (fd, context, flags), return 0) \
-    FUNCDEF(int, drmAddContextTag, (int fd, drm_context_t context, void *tag), (fd, context, tag), return 0) \
-    FUNCDEF(int, drmDelContextTag, (int fd, drm_context_t context), (fd, context), return 0) \
-    FUNCDEF(void *, drmGetContextTag, (int fd, drm_context_t context), (fd, context), return 0) \
-    FUNCDEF(void, drmFreeReservedContextList, (drm_context_t *c), (c), return) \
-    FUNCDEF(int, drmSwitchToContext, (int fd, drm_context_t context), (fd, context), return 0) \
-    FUNCDEF(int, drmDestroyContext, (int fd, drm_context_t handle), (fd, handle), return 0) \
-    FUNCDEF(int, drmCreateDrawable, (int fd, drm_drawable_t * handle), (fd,  handle), return 0) \
-    FUNCDEF(int, drmDestroyDrawable, (int fd, drm_drawable_t handle), (fd, handle), return 0) \
-    FUNCDEF(int, drmCtlInstHandler, (int fd, int irq), (fd, irq), return 0) \
-    FUNCDEF(int, drmCtlUninstHandler, (int fd), (fd), return 0) \
-    FUNCDEF(int, drmSetClientCap, (int fd, uint64_t capability, uint64_t value), (fd, capability, value), return 0) \
-    FUNCDEF(int, drmCrtcGetSequence, (int fd, uint32_t crtcId, uint64_t *sequence, uint64_t *ns), (fd, crtcId, sequence, ns), return 0) \
-    FUNCDEF(int, drmCrtcQueueSequence, (int fd, uint32_t crtcId, uint32_t flags, uint64_t sequence, uint64_t *sequence_queued, uint64_t user_data), (fd, crtcId, flags, sequence, sequence_queued, user_data), return 0) \
-    FUNCDEF(int, drmMap, (int fd, drm_handle_t handle, drmSize size, drmAddressPtr address), (fd, handle, size, address), return 0) \
-    FUNCDEF(int, drmUnmap, (drmAddress address, drmSize size), (address, size), return 0) \
-    FUNCDEF(drmBufInfoPtr, drmGetBufInfo, (int fd), (fd), return 0) \
-    FUNCDEF(drmBufMapPtr, drmMapBufs, (int fd), (fd), return 0) \
-    FUNCDEF(int, drmUnmapBufs, (drmBufMapPtr bufs), (bufs), return 0) \
-    FUNCDEF(int, drmDMA, (int fd, drmDMAReqPtr request), (fd, request), return 0) \
-    FUNCDEF(int, drmFreeBufs, (int fd, int count, int *list), (fd, count, list), return 0) \
-    FUNCDEF(int, drmGetLock, (int fd, drm_context_t context, drmLockFlags flags), (fd, context, flags), return 0) \
-    FUNCDEF(int, drmUnlock, (int fd, drm_context_t context), (fd, context), return 0) \
-    FUNCDEF(int, drmFinish, (int fd, int context, drmLockFlags flags), (fd, context, flags), return 0) \
-    FUNCDEF(int, drmAgpAcquire, (int fd), (fd), return 0) \
-    FUNCDEF(int, drmAgpRelease, (int fd), (fd), return 0) \
-    FUNCDEF(int, drmAgpEnable, (int fd, unsigned long mode), (fd, mode), return 0) \
-    FUNCDEF(int, drmAgpAlloc, (int fd, unsigned long size, unsigned long type, unsigned long *address, drm_handle_t *handle), (fd, size, type, address, handle), return 0) \
-    FUNCDEF(int, drmAgpFree, (int fd, drm_handle_t handle), (fd, handle), return 0) \
-    FUNCDEF(int, drmAgpUnbind, (int fd, drm_handle_t handle), (fd, handle), return 0) \
-    FUNCDEF(int, drmAgpVersionMajor, (int fd), (fd), return 0) \
-    FUNCDEF(int, drmAgpVersionMinor, (int fd), (fd), return 0) \
-    FUNCDEF(int, drmScatterGatherAlloc, (int fd, unsigned long size, drm_handle_t *handle), (fd, size, handle), return 0) \
-    FUNCDEF(int, drmScatterGatherFree, (int fd, drm_handle_t handle), (fd, handle), return 0) \
-    FUNCDEF(int, drmWaitVBlank, (int fd, drmVBlankPtr vbl), (fd, vbl), return 0) \
-    FUNCDEF(void, drmSetServerInfo, (drmServerInfoPtr info), (info), return) \
-    FUNCDEF(int, drmError, (int err, const char *label), (err, label), return 0) \
-    FUNCDEF(void *, drmMalloc, (int size), (size), return 0) \
-    FUNCDEF(void, drmFree, (void *pt), (pt), return) \
-    FUNCDEF(void *, drmHashCreate, (void), (), return 0) \
-    FUNCDEF(int, drmHashDestroy, (void *t), (t), return 0) \
-    FUNCDEF(int, drmHashLookup, (void *t, unsigned long key, void **value), (t, key, value), return 0) \
-    FUNCDEF(int, drmHashInsert, (void *t, unsigned long key, void *value), (t, key, value), return 0) \
-    FUNCDEF(int, drmHashDelete, (void *t, unsigned long key), (t, key), return 0) \
-    FUNCDEF(int, drmHashFirst, (void *t, unsigned long *key, void **value), (t, key, value), return 0) \
-    FUNCDEF(int, drmHashNext, (void *t, unsigned long *key, void **value), (t, key, value), return 0) \
-    FUNCDEF(void *, drmRandomCreate, (unsigned long seed), (seed), return 0) \
-    FUNCDEF(int, drmRandomDestroy, (void *state), (state), return 0) \
-    FUNCDEF(double, drmRandomDouble, (void *state), (state), return 0) \
-    FUNCDEF(void *, drmSLCreate, (void), (), return 0) \
-    FUNCDEF(int, drmSLDestroy, (void *l), (l), return 0) \
-    FUNCDEF(int, drmSLLookup, (void *l, unsigned long key, void **value), (l, key, value), return 0) \
-    FUNCDEF(int, drmSLInsert, (void *l, unsigned long key, void *value), (l, key, value), return 0) \
-    FUNCDEF(int, drmSLDelete, (void *l, unsigned long key), (l, key), return 0) \
-    FUNCDEF(int, drmSLNext, (void *l, unsigned long *key, void **value), (l, key, value), return 0) \
-    FUNCDEF(int, drmSLFirst, (void *l, unsigned long *key, void **value), (l, key, value), return 0) \
-    FUNCDEF(void, drmSLDump, (void *l), (l), return) \
-    FUNCDEF(int, drmSLLookupNeighbors, (void *l, unsigned long key, unsigned long *prev_key, void **prev_value, unsigned long *next_key, void **next_value), (l, key, prev_key, prev_value, next_key, next_value), return 0) \
-    FUNCDEF(int, drmOpenOnce, (void *unused, const char *BusID, int *newlyopened), (unused, BusID, newlyopened), return -1) \
-    FUNCDEF(int, drmOpenOnceWithType, (const char *BusID, int *newlyopened, int type), (BusID, newlyopened, type), return 0) \
-    FUNCDEF(void, drmCloseOnce, (int fd), (fd), return) \
-    FUNCDEF(int, drmSetMaster, (int fd), (fd), return 0) \
-    FUNCDEF(int, drmDropMaster, (int fd), (fd), return 0) \
-    FUNCDEF(int, drmIsMaster, (int fd), (fd), return 0) \
-    FUNCDEF(int, drmHandleEvent, (int fd, drmEventContextPtr evctx), (fd, evctx), return 0) \
-    FUNCDEF(char *, drmGetDeviceNameFromFd, (int fd), (fd), return 0) \
-    FUNCDEF(char *, drmGetDeviceNameFromFd2, (int fd), (fd), return 0) \
-    FUNCDEF(int, drmGetNodeTypeFromFd, (int fd), (fd), return 0) \
-    FUNCDEF(int, drmPrimeHandleToFD, (int fd, uint32_t handle, uint32_t flags, int *prime_fd), (fd, handle, flags, prime_fd), return 0) \
-    FUNCDEF(int, drmPrimeFDToHandle, (int fd, int prime_fd, uint32_t *handle), (fd, prime_fd, handle), return 0) \
-    FUNCDEF(char *, drmGetPrimaryDeviceNameFromFd, (int fd), (fd), return 0) \
-    FUNCDEF(char *, drmGetRenderDeviceNameFromFd, (int fd), (fd), return 0) \
-    FUNCDEF(int, drmGetDevice, (int fd, drmDevicePtr *device), (fd, device), return 0) \
-    FUNCDEF(void, drmFreeDevice, (drmDevicePtr *device), (device), return) \
-    FUNCDEF(int, drmGetDevices, (drmDevicePtr devices[], int max_devices), (devices, max_devices), return 0) \
-    FUNCDEF(void, drmFreeDevices, (drmDevicePtr devices[], int count), (devices, count), return) \
-    FUNCDEF(int, drmGetDevice2, (int fd, uint32_t flags, drmDevicePtr *device), (fd, flags, device), return -EINVAL) \
-    FUNCDEF(int, drmGetDevices2, (uint32_t flags, drmDevicePtr devices[], int max_devices), (flags, devices, max_devices), return -EINVAL) \
-    FUNCDEF(int, drmDevicesEqual, (drmDevicePtr a, drmDevicePtr b), (a, b), return 0) \
-    FUNCDEF(int, drmSyncobjCreate, (int fd, uint32_t flags, uint32_t *handle), (fd, flags, handle), return 0) \
-    FUNCDEF(int, drmSyncobjDestroy, (int fd, uint32_t handle), (fd, handle), return 0) \
-    FUNCDEF(int, drmSyncobjHandleToFD, (int fd, uint32_t handle, int *obj_fd), (fd, handle, obj_fd), return 0) \
-    FUNCDEF(int, drmSyncobjFDToHandle, (int fd, int obj_fd, uint32_t *handle), (fd, obj_fd, handle), return 0) \
-    FUNCDEF(int, drmSyncobjImportSyncFile, (int fd, uint32_t handle, int sync_file_fd), (fd, handle, sync_file_fd), return 0) \
-    FUNCDEF(int, drmSyncobjExportSyncFile, (int fd, uint32_t handle, int *sync_file_fd), (fd, handle, sync_file_fd), return 0) \
-    FUNCDEF(int, drmSyncobjWait, (int fd, uint32_t *handles, unsigned num_handles, int64_t timeout_nsec, unsigned flags, uint32_t *first_signaled), (fd, handles, num_handles, timeout_nsec, flags, first_signaled), return 0) \
-    FUNCDEF(int, drmSyncobjReset, (int fd, const uint32_t *handles, uint32_t handle_count), (fd, handles, handle_count), return 0) \
-    FUNCDEF(int, drmSyncobjSignal, (int fd, const uint32_t *handles, uint32_t handle_count), (fd, handles, handle_count), return 0) \
-    FUNCDEF(int, drmSyncobjTimelineSignal, (int fd, const uint32_t *handles, uint64_t *points, uint32_t handle_count), (fd, handles, points, handle_count), return 0) \
-    FUNCDEF(int, drmSyncobjTimelineWait, (int fd, uint32_t *handles, uint64_t *points, unsigned num_handles, int64_t timeout_nsec, unsigned flags, uint32_t *first_signaled), (fd, handles, points, num_handles, timeout_nsec, flags, first_signaled), return 0) \
-    FUNCDEF(int, drmSyncobjQuery, (int fd, uint32_t *handles, uint64_t *points, uint32_t handle_count), (fd, handles, points, handle_count), return 0) \
-    FUNCDEF(int, drmSyncobjTransfer, (int fd, uint32_t dst_handle, uint64_t dst_point, uint32_t src_handle, uint64_t src_point, uint32_t flags), (fd, dst_handle, dst_point, src_handle, src_point, flags), return 0) \
-    FUNCDEF(void, drmModeFreeModeInfo, ( drmModeModeInfoPtr ptr ), (ptr), return) \
-    FUNCDEF(void, drmModeFreeResources, ( drmModeResPtr ptr ), (ptr), return) \
-    FUNCDEF(void, drmModeFreeFB, ( drmModeFBPtr ptr ), (ptr), return) \
-    FUNCDEF(void, drmModeFreeCrtc, ( drmModeCrtcPtr ptr ), (ptr), return) \
-    FUNCDEF(void, drmModeFreeConnector, ( drmModeConnectorPtr ptr ), (ptr), return) \
-    FUNCDEF(void, drmModeFreeEncoder, ( drmModeEncoderPtr ptr ), (ptr), return) \
-    FUNCDEF(void, drmModeFreePlane, ( drmModePlanePtr ptr ), (ptr), return) \
-    FUNCDEF(void, drmModeFreePlaneResources, (drmModePlaneResPtr ptr), (ptr), return) \
-    FUNCDEF(drmModeResPtr, drmModeGetResources, (int fd), (fd), return 0) \
-    FUNCDEF(drmModeFBPtr, drmModeGetFB, (int fd, uint32_t bufferId), (fd, bufferId), return 0) \
-    FUNCDEF(int, drmModeAddFB, (int fd, uint32_t width, uint32_t height, uint8_t depth, uint8_t bpp, uint32_t pitch, uint32_t bo_handle, uint32_t *buf_id), (fd, width, height, depth, bpp, pitch, bo_handle, buf_id), return 0) \
-    FUNCDEF(int, drmModeAddFB2, (int fd, uint32_t width, uint32_t height, uint32_t pixel_format, const uint32_t bo_handles[4], const uint32_t pitches[4], const uint32_t offsets[4], uint32_t *buf_id, uint32_t flags), (fd, width, height, pixel_format, bo_handles, pitches, offsets, buf_id, flags), return 0) \
-    FUNCDEF(int, drmModeAddFB2WithModifiers, (int fd, uint32_t width, uint32_t height, uint32_t pixel_format, const uint32_t bo_handles[4], const uint32_t pitches[4], const uint32_t offsets[4], const uint64_t modifier[4], uint32_t *buf_id, uint32_t flags), (fd, width, height, pixel_format, bo_handles, pitches, offsets, modifier, buf_id, flags), return 0) \
-    FUNCDEF(int, drmModeRmFB, (int fd, uint32_t bufferId), (fd, bufferId), return 0) \
-    FUNCDEF(int, drmModeDirtyFB, (int fd, uint32_t bufferId, drmModeClipPtr clips, uint32_t num_clips), (fd, bufferId, clips, num_clips), return 0) \
-    FUNCDEF(drmModeCrtcPtr, drmModeGetCrtc, (int fd, uint32_t crtcId), (fd, crtcId), return 0) \
-    FUNCDEF(int, drmModeSetCrtc, (int fd, uint32_t crtcId, uint32_t bufferId, uint32_t x, uint32_t y, uint32_t *connectors, int count, drmModeModeInfoPtr mode), (fd, crtcId, bufferId, x, y, connectors, count, mode), return 0) \
-    FUNCDEF(int, drmModeSetCursor, (int fd, uint32_t crtcId, uint32_t bo_handle, uint32_t width, uint32_t height), (fd, crtcId, bo_handle, width, height), return 0) \
-    FUNCDEF(int, drmModeSetCursor2, (int fd, uint32_t crtcId, uint32_t bo_handle, uint32_t width, uint32_t height, int32_t hot_x, int32_t hot_y), (fd, crtcId, bo_handle, width, height, hot_x, hot_y), return 0) \
-    FUNCDEF(int, drmModeMoveCursor, (int fd, uint32_t crtcId, int x, int y), (fd, crtcId, x, y), return 0) \
-    FUNCDEF(drmModeEncoderPtr, drmModeGetEncoder, (int fd, uint32_t encoder_id), (fd, encoder_id), return 0) \
-    FUNCDEF(drmModeConnectorPtr, drmModeGetConnector, (int fd, uint32_t connectorId), (fd, connectorId), return 0) \
-    FUNCDEF(drmModeConnectorPtr, drmModeGetConnectorCurrent, (int fd, uint32_t connector_id), (fd, connector_id), return 0) \
-    FUNCDEF(int, drmModeAttachMode, (int fd, uint32_t connectorId, drmModeModeInfoPtr mode_info), (fd, connectorId, mode_info), return 0) \
-    FUNCDEF(int, drmModeDetachMode, (int fd, uint32_t connectorId, drmModeModeInfoPtr mode_info), (fd, connectorId, mode_info), return 0) \
-    FUNCDEF(drmModePropertyPtr, drmModeGetProperty, (int fd, uint32_t propertyId), (fd, propertyId), return 0) \
-    FUNCDEF(void, drmModeFreeProperty, (drmModePropertyPtr ptr), (ptr), return) \
-    FUNCDEF(drmModePropertyBlobPtr, drmModeGetPropertyBlob, (int fd, uint32_t blob_id), (fd, blob_id), return 0) \
-    FUNCDEF(void, drmModeFreePropertyBlob, (drmModePropertyBlobPtr ptr), (ptr), return) \
-    FUNCDEF(int, drmModeConnectorSetProperty, (int fd, uint32_t connector_id, uint32_t property_id, uint64_t value), (fd, connector_id, property_id, value), return 0) \
-    FUNCDEF(int, drmCheckModesettingSupported, (const char *busid), (busid), return 0) \
-    FUNCDEF(int, drmModeCrtcSetGamma, (int fd, uint32_t crtc_id, uint32_t size, uint16_t *red, uint16_t *green, uint16_t *blue), (fd, crtc_id, size, red, green, blue), return 0) \
-    FUNCDEF(int, drmModeCrtcGetGamma, (int fd, uint32_t crtc_id, uint32_t size, uint16_t *red, uint16_t *green, uint16_t *blue), (fd, crtc_id, size, red, green, blue), return 0) \
-    FUNCDEF(int, drmModePageFlip, (int fd, uint32_t crtc_id, uint32_t fb_id, uint32_t flags, void *user_data), (fd, crtc_id, fb_id, flags, user_data), return 0) \
-    FUNCDEF(int, drmModePageFlipTarget, (int fd, uint32_t crtc_id, uint32_t fb_id, uint32_t flags, void *user_data, uint32_t target_vblank), (fd, crtc_id, fb_id, flags, user_data, target_vblank), return 0) \
-    FUNCDEF(drmModePlaneResPtr, drmModeGetPlaneResources, (int fd), (fd), return 0) \
-    FUNCDEF(drmModePlanePtr, drmModeGetPlane, (int fd, uint32_t plane_id), (fd, plane_id), return 0) \
-    FUNCDEF(int, drmModeSetPlane, (int fd, uint32_t plane_id, uint32_t crtc_id, uint32_t fb_id, uint32_t flags, int32_t crtc_x, int32_t crtc_y, uint32_t crtc_w, uint32_t crtc_h, uint32_t src_x, uint32_t src_y, uint32_t src_w, uint32_t src_h), (fd, plane_id, crtc_id, fb_id, flags, crtc_x, crtc_y, crtc_w, crtc_h, src_x, src_y, src_w, src_h), return 0) \
-    FUNCDEF(drmModeObjectPropertiesPtr, drmModeObjectGetProperties, (int fd, uint32_t object_id, uint32_t object_type), (fd, object_id, object_type), return 0) \
-    FUNCDEF(void, drmModeFreeObjectProperties, (drmModeObjectPropertiesPtr ptr), (ptr), return) \
-    FUNCDEF(int, drmModeObjectSetProperty, (int fd, uint32_t object_id, uint32_t object_type, uint32_t property_id, uint64_t value), (fd, object_id, object_type, property_id, value), return 0) \
-    FUNCDEF(drmModeAtomicReqPtr, drmModeAtomicAlloc, (void), (), return 0) \
-    FUNCDEF(drmModeAtomicReqPtr, drmModeAtomicDuplicate, (drmModeAtomicReqPtr req), (req), return 0) \
-    FUNCDEF(int, drmModeAtomicMerge, (drmModeAtomicReqPtr base, drmModeAtomicReqPtr augment), (base, augment), return 0) \
-    FUNCDEF(void, drmModeAtomicFree, (drmModeAtomicReqPtr req), (req), return) \
-    FUNCDEF(int, drmModeAtomicGetCursor, (drmModeAtomicReqPtr req), (req), return 0) \
-    FUNCDEF(void, drmModeAtomicSetCursor, (drmModeAtomicReqPtr req, int cursor), (req, cursor), return) \
-    FUNCDEF(int, drmModeAtomicAddProperty, (drmModeAtomicReqPtr req, uint32_t object_id, uint32_t property_id, uint64_t value), (req, object_id, property_id, value), return 0) \
-    FUNCDEF(int, drmModeAtomicCommit, (int fd, drmModeAtomicReqPtr req, uint32_t flags, void *user_data), (fd, req, flags, user_data), return 0) \
-    FUNCDEF(int, drmModeCreatePropertyBlob, (int fd, const void *data, size_t size, uint32_t *id), (fd, data, size, id), return 0) \
-    FUNCDEF(int, drmModeDestroyPropertyBlob, (int fd, uint32_t id), (fd, id), return 0) \
-    FUNCDEF(int, drmModeCreateLease, (int fd, const uint32_t *objects, int num_objects, int flags, uint32_t *lessee_id), (fd, objects, num_objects, flags, lessee_id), return 0) \
-    FUNCDEF(drmModeLesseeListPtr, drmModeListLessees, (int fd), (fd), return 0) \
-    FUNCDEF(drmModeObjectListPtr, drmModeGetLease, (int fd), (fd), return 0) \
-    FUNCDEF(int, drmModeRevokeLease, (int fd, uint32_t lessee_id), (fd, lessee_id), return 0)
+const unsigned int shim_func_count = FUNCID_COUNT;
 
 static const char *target_libname = TARGET_LIBPATH "/libdrm.so.2";
 static void *dlptr;
+static int use_fake;
 
+static
+void *sym_lookup (const char *symname)
+{
+    if (use_fake)
+        return shim_fake_lookup(symname);
+    else if (dlptr)
+        return dlsym(dlptr, symname);
+    else
+        return 0;
+}
+
+/*
+ * Every function pointer always points at something callable, so
+ * the wrappers call through it unconditionally.  Functions that
+ * the Tegra libdrm does not provide are bound to a local stub.
+ *
+ * In lazy-binding and deferred-load modes, each pointer starts out
+ * pointing at a resolver that looks up the real symbol on the first
+ * call, patches the pointer, and forwards the call.  Otherwise the
+ * pointers start out at the stubs and are bound at load time.
+ */
+#if defined(LAZY_BINDING) || defined(DEFERRED_LOAD)
+#define USE_RESOLVERS 1
+
+#define FUNCDEF(type__, name__, args__, actargs__, ret__) \
+  static type__ stub_##name__ args__ { ret__; } \
+  static type__ resolve_##name__ args__; \
+  static type__ (*ptr_##name__) args__ = resolve_##name__;
+#else
 #define FUNCDEF(type__, name__, args__, actargs__, ret__) \
-  static type__ (*ptr_##name__) args__;
+  static type__ stub_##name__ args__ { ret__; } \
+  static type__ (*ptr_##name__) args__ = stub_##name__;
+#endif
 FUNCDEFS
 #undef FUNCDEF
 
+#ifdef LAZY_BINDING
+#define DLOPEN_FLAGS (RTLD_LAZY|RTLD_LOCAL)
+#else
+#define DLOPEN_FLAGS (RTLD_NOW|RTLD_LOCAL)
+#endif
+
+/* Whether shim_bind() gives any timeline function the emulation. */
+static int
+timelines_emulated (void)
+{
+    static const char *const names[] = {
+        "drmSyncobjTimelineSignal", "drmSyncobjTimelineWait",
+        "drmSyncobjQuery", "drmSyncobjTransfer",
+    };
+    unsigned int i;
+
+    if (!use_fake && dlptr == NULL)
+        return 0;
+    for (i = 0; i < sizeof(names)/sizeof(names[0]); i++)
+        if (sym_lookup(names[i]) == NULL)
+            return 1;
+    return 0;
+}
+
+/*
+ * Gives the shim's own layers a chance to sit between a wrapper
+ * and the function it forwards to.  Called whenever a dispatch
+ * pointer is bound.
+ */
+static void *
+shim_interpose (unsigned int id, void *fn)
+{
+    if (id == FUNCID_drmIoctl)
+        return shim_ioctl_interpose(fn);
+    if (id == FUNCID_drmSyncobjWait || id == FUNCID_drmSyncobjTimelineWait)
+        return shim_syncobj_interpose(id, fn);
+    if (id == FUNCID_drmSyncobjDestroy)
+        return shim_timeline_interpose(fn);
+    if (id == FUNCID_drmClose)
+        return shim_ioctl_close_interpose(fn, timelines_emulated());
+    if (id == FUNCID_drmPrimeHandleToFD)
+        return shim_bo_interpose(id, fn);
+    if (id == FUNCID_drmPrimeFDToHandle)
+        return shim_prime_interpose(fn);
+    return fn;
+}
+
+/*
+ * Returns what a dispatch pointer should be bound to.  Timeline
+ * syncobj functions the backend lacks get the shim's emulation
+ * (shim-timeline.c) rather than the stub.
+ */
+static void *
+shim_bind (unsigned int id, const char *name, void *stub)
+{
+    void *fn = sym_lookup(name);
+
+    if (fn == NULL && (use_fake || dlptr != NULL) &&
+        (fn = shim_timeline_lookup(name)) != NULL)
+        return fn;
+    return shim_interpose(id, fn ? fn : stub);
+}
+
 #define FUNCDEF(type__, name__, args__, actargs__, ret__) \
-    ptr_##name__ = dlsym(dlptr, #name__);
+  { \
+    type__ (*fn__) args__ = shim_bind(FUNCID_##name__, #name__, stub_##name__); \
+    __atomic_store_n(&ptr_##name__, fn__, __ATOMIC_RELEASE); \
+  }
 
-void __attribute__((constructor))
-shim_init (void)
+/*
+ * DRM_SHIM_BACKEND selects what the shim forwards to: "fake" for
+ * the software backend in shim-fake.c, "stub" to leave everything
+ * stubbed out, "vendor" to load the Tegra libdrm without probing
+ * for the hardware, or unset for the Tegra libdrm when the
+ * hardware is present.
+ */
+static void
+shim_load (void)
 {
     struct stat sbuf;
+    const char *backend = getenv("DRM_SHIM_BACKEND");
 
-    if (stat("/dev/nvhost-nvdec", &sbuf))
-        return;
-    if ((sbuf.st_mode & S_IFMT) != S_IFCHR)
-        return;
-    dlptr = dlopen(target_libname, RTLD_NOW|RTLD_LOCAL);
-    if (dlptr == NULL)
-        return;
+    if (backend != NULL && strcmp(backend, "fake") == 0)
+        use_fake = 1;
+    else {
+        if (backend != NULL && strcmp(backend, "stub") == 0)
+            return;
+        if (backend == NULL || strcmp(backend, "vendor") != 0) {
+            if (stat("/dev/nvhost-nvdec", &sbuf))
+                return;
+            if ((sbuf.st_mode & S_IFMT) != S_IFCHR)
+                return;
+        }
+        dlptr = dlopen(target_libname, DLOPEN_FLAGS);
+        if (dlptr == NULL)
+            return;
+    }
+#ifndef LAZY_BINDING
     FUNCDEFS
+#endif
 }
 #undef FUNCDEF
 
+#ifdef DEFERRED_LOAD
+/*
+ * In deferred-load mode the constructor does nothing; the device
+ * probe and dlopen happen on the first call through any resolver.
+ */
+static pthread_once_t load_once = PTHREAD_ONCE_INIT;
+
+static inline void
+shim_load_once (void)
+{
+    pthread_once(&load_once, shim_load);
+}
+#elif defined(USE_IFUNC)
+/*
+ * Set once the constructor has bound the dispatch pointers; see
+ * the IFUNC resolvers below.
+ */
+static int loaded;
+
+static inline void
+shim_load_once (void)
+{
+}
+
+void __attribute__((constructor))
+shim_init (void)
+{
+    shim_load();
+    __atomic_store_n(&loaded, 1, __ATOMIC_RELEASE);
+}
+#else
+static inline void
+shim_load_once (void)
+{
+}
+
+void __attribute__((constructor))
+shim_init (void)
+{
+    shim_load();
+}
+#endif
+
 void __attribute__((destructor))
 shim_fini (void)
 {
@@ -238,23 +225,112 @@ shim_fini (void)
     }
 }
 
-
-static
-void *sym_lookup (const char *symname)
+/*
+ * libdrm's drmIoctl() restarts on EAGAIN as well as EINTR, but
+ * host1x reports a syncpoint wait that timed out with EAGAIN, so
+ * timed waits are made here instead.  The fake backend's ioctls
+ * are called directly.
+ */
+int
+shim_ioctl_eintr (int fd, unsigned long request, void *arg)
 {
-    if (dlptr)
-        return dlsym(dlptr, symname);
-    else
-        return 0;
+    int (*fake_ioctl)(int fd, unsigned long request, void *arg);
+    int ret;
+
+    shim_load_once();
+    if (use_fake) {
+        fake_ioctl = shim_fake_lookup("ioctl");
+        return fake_ioctl(fd, request, arg);
+    }
+    do
+        ret = ioctl(fd, request, arg);
+    while (ret < 0 && errno == EINTR);
+    return ret;
 }
 
+
+#ifdef USE_RESOLVERS
+/*
+ * Concurrent first calls may both resolve the same symbol; they
+ * store the same value, so the race is harmless.
+ */
+#define FUNCDEF(type__, name__, args__, actargs__, ret__) \
+  static type__ resolve_##name__ args__ { \
+    type__ (*fn__) args__; \
+    shim_load_once(); \
+    fn__ = shim_bind(FUNCID_##name__, #name__, stub_##name__); \
+    __atomic_store_n(&ptr_##name__, fn__, __ATOMIC_RELEASE); \
+    return fn__ actargs__; \
+  }
+
+FUNCDEFS
+#undef FUNCDEF
+#endif
+
+/*
+ * Once bound, a pointer only changes from a resolver to its final
+ * value.  Only deferred loading, where the library is opened by
+ * whichever thread calls first, needs the load to be ordered.
+ */
+#ifdef DEFERRED_LOAD
+#define DISPATCH_ORDER __ATOMIC_ACQUIRE
+#else
+#define DISPATCH_ORDER __ATOMIC_RELAXED
+#endif
+
+#define FUNCDEF(type__, name__, args__, actargs__, ret__) \
+  static inline type__ call_##name__ args__ { \
+    return __atomic_load_n(&ptr_##name__, DISPATCH_ORDER) actargs__; \
+  }
+
+FUNCDEFS
+#undef FUNCDEF
+
+#if defined(USE_IFUNC)
+/*
+ * Each exported function is an IFUNC whose resolver returns the
+ * bound target directly, so once the caller has been relocated its
+ * calls go straight to the Tegra libdrm without passing through
+ * the shim.  Resolvers that run before our constructor (immediate
+ * binding, or LD_BIND_NOW) cannot probe for the library yet, since
+ * libc is not initialized; those callers get a forwarding wrapper.
+ */
+#define FUNCDEF(type__, name__, args__, actargs__, ret__) \
+  static type__ fwd_##name__ args__ { \
+    return call_##name__ actargs__; \
+  } \
+  static void *ifunc_##name__ (void) { \
+    if (!__atomic_load_n(&loaded, __ATOMIC_ACQUIRE)) \
+        return fwd_##name__; \
+    return ptr_##name__; \
+  } \
+  type__ name__ args__ __attribute__((ifunc("ifunc_" #name__)));
+#elif defined(SHIM_INSTRUMENTATION)
+/*
+ * When statistics or recording are enabled at runtime, calls take
+ * an out-of-line path that captures the arguments, times the
+ * forwarded call and records the result.  With instrumentation
+ * off, the only cost is the test of shim_instr_on.
+ */
+#define FUNCDEF(type__, name__, args__, actargs__, ret__) \
+  static __attribute__((noinline)) type__ instr_##name__ args__ { \
+    const uint64_t argv__[] = { 0, SHIM_ARGWORDS actargs__ }; \
+    const uint8_t kinds__[] = { 0, SHIM_ARGKINDS actargs__ }; \
+    struct shim_call call__ = shim_call_begin(FUNCID_##name__, SHIM_NARGS actargs__, \
+                                              argv__ + 1, kinds__ + 1); \
+    return SHIM_CALL_END(call__, call_##name__ actargs__); \
+  } \
+  type__ name__ args__ { \
+    if (__builtin_expect(shim_instr_on, 0)) \
+        return instr_##name__ actargs__; \
+    return call_##name__ actargs__; \
+  }
+#else
 #define FUNCDEF(type__, name__, args__, actargs__, ret__) \
   type__ name__ args__ { \
-    if (ptr_##name__) \
-        return ptr_##name__ actargs__; \
-    else \
-        ret__; \
+    return call_##name__ actargs__; \
   }
+#endif
 
 FUNCDEFS
 #undef FUNCDEF
@@ -31,7 +31,9 @@
 #include <assert.h>
 #include <errno.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <sys/ioctl.h>
 #include <sys/poll.h>
 #include <unistd.h>
@@ -141,6 +143,181 @@ static inline int sync_accumulate(const char *name, int *fd1, int fd2)
 	return 0;
 }
 
+/* flags for sync_wait_many() */
+#define SYNC_WAIT_ANY	0
+#define SYNC_WAIT_ALL	(1 << 0)
+
+/* pollfd arrays up to this size live on the stack */
+#define SYNC_WAIT_STACK_FDS	64
+
+static inline int64_t sync_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* wait on several fences with one poll() per wakeup, rather than one
+ * sync_wait() per fence.  With SYNC_WAIT_ANY, returns as soon as one
+ * fence has signalled and, if first is not NULL, stores its index
+ * there.  With SYNC_WAIT_ALL, returns once every fence has signalled;
+ * fences are dropped from the poll set as they signal.  Negative fds
+ * are treated as already signalled.  timeout is in milliseconds (-1
+ * for none) and covers the whole call, including restarts after
+ * EINTR.  Returns 0, or -1 with errno set to ETIME on timeout or
+ * EINVAL if an fd is not a valid fence.
+ */
+static inline int sync_wait_many(const int *fds, unsigned int count,
+				 int timeout, int flags, unsigned int *first)
+{
+	struct pollfd stackfds[SYNC_WAIT_STACK_FDS];
+	struct pollfd *pfds = stackfds;
+	unsigned int i, pending = 0;
+	int64_t deadline = 0;
+	int ret = 0;
+
+	if (count > SYNC_WAIT_STACK_FDS) {
+		pfds = calloc(count, sizeof(*pfds));
+		if (pfds == NULL) {
+			errno = ENOMEM;
+			return -1;
+		}
+	}
+	for (i = 0; i < count; i++) {
+		pfds[i].fd = fds[i];
+		pfds[i].events = POLLIN;
+		pfds[i].revents = 0;
+		if (fds[i] >= 0)
+			pending++;
+		else if (!(flags & SYNC_WAIT_ALL)) {
+			if (first)
+				*first = i;
+			goto out;
+		}
+	}
+	if (timeout > 0 && pending > 0)
+		deadline = sync_now_ms() + timeout;
+
+	while (pending > 0) {
+		int remaining = timeout;
+
+		if (timeout > 0) {
+			int64_t left = deadline - sync_now_ms();
+			remaining = left > 0 ? (int)left : 0;
+		}
+		ret = poll(pfds, count, remaining);
+		if (ret < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			break;
+		} else if (ret == 0) {
+			errno = ETIME;
+			ret = -1;
+			break;
+		}
+		for (i = 0; i < count; i++) {
+			if (pfds[i].revents == 0)
+				continue;
+			if (pfds[i].revents & (POLLERR | POLLNVAL)) {
+				errno = EINVAL;
+				ret = -1;
+				goto out;
+			}
+			if (!(flags & SYNC_WAIT_ALL)) {
+				if (first)
+					*first = i;
+				ret = 0;
+				goto out;
+			}
+			pfds[i].fd = -1;
+			pfds[i].revents = 0;
+			pending--;
+		}
+		ret = 0;
+	}
+
+out:
+	if (pfds != stackfds)
+		free(pfds);
+	return ret;
+}
+
+/* merge count fences into a single new fence fd, without taking
+ * ownership of the input fds.  Merging pairwise in a balanced tree
+ * makes the same count-1 SYNC_IOC_MERGE calls as a sync_accumulate()
+ * loop, but each fence is copied log2(count) times instead of up to
+ * count times, and intermediate fds are closed as soon as they are
+ * merged.  Negative fds are skipped; returns -1 with errno set to
+ * ENOENT if there is nothing to merge.
+ */
+static inline int sync_merge_many(const char *name, const int *fds,
+				  unsigned int count)
+{
+	int stackfds[SYNC_WAIT_STACK_FDS];
+	int *level = stackfds;
+	unsigned int i, n = 0;
+	int owned = 0, ret;
+
+	if (count > SYNC_WAIT_STACK_FDS) {
+		level = malloc(count * sizeof(*level));
+		if (level == NULL) {
+			errno = ENOMEM;
+			return -1;
+		}
+	}
+	for (i = 0; i < count; i++)
+		if (fds[i] >= 0)
+			level[n++] = fds[i];
+
+	if (n == 0) {
+		errno = ENOENT;
+		ret = -1;
+	} else if (n == 1) {
+		ret = dup(level[0]);
+	} else {
+		/* level[] holds borrowed fds until the first pass, owned ones after */
+		while (n > 1) {
+			unsigned int out = 0;
+
+			for (i = 0; i + 1 < n; i += 2) {
+				ret = sync_merge(name, level[i], level[i + 1]);
+				if (owned) {
+					close(level[i]);
+					close(level[i + 1]);
+				}
+				if (ret < 0) {
+					for (i += 2; owned && i < n; i++)
+						close(level[i]);
+					while (out > 0)
+						close(level[--out]);
+					goto done;
+				}
+				level[out++] = ret;
+			}
+			if (i < n) {
+				/* odd one out moves up a level; take a reference if borrowed */
+				level[out] = owned ? level[i] : dup(level[i]);
+				if (level[out] < 0) {
+					ret = -1;
+					while (out > 0)
+						close(level[--out]);
+					goto done;
+				}
+				out++;
+			}
+			n = out;
+			owned = 1;
+		}
+		ret = level[0];
+	}
+
+done:
+	if (level != stackfds)
+		free(level);
+	return ret;
+}
+
 #if defined(__cplusplus)
 }
 #endif
@@ -0,0 +1,540 @@
+/*
+ * shim-bo.c
+ *
+ * Cache of freed Tegra GEM objects.  With DRM_SHIM_BO_CACHE set,
+ * GEM closes park buffer objects instead of freeing them, and
+ * DRM_IOCTL_TEGRA_GEM_CREATE hands a parked one of the right size
+ * and flags back out, saving the kernel allocation and page
+ * clearing for programs that allocate the same buffers every frame.
+ * An object a submitted job uses is not handed back out until the
+ * job's fence has passed.
+ *
+ * Copyright (c) 2018-2019, Matthew Madison
+ * Distributed under license; see the LICENSE file for details.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "xf86drm.h"
+#include "tegra_drm.h"
+#include "drm-shim.h"
+#include "shim-private.h"
+
+#define BO_PAGE_SIZE		4096ULL
+#define BO_DEFAULT_AGE_MS	1000
+
+/*
+ * Sizes are rounded up to a bucket: whole pages up to 16 pages,
+ * then four buckets per power of two, up to 2^16 pages (256MiB).
+ * New objects are created at the bucket size, so any parked object
+ * in a bucket fits any request that maps to it.  Larger objects
+ * are not cached.
+ */
+#define BO_SMALL_BUCKETS	16
+#define BO_NBUCKETS		(BO_SMALL_BUCKETS + 12 * 4)
+#define BO_CREATE_FLAGS		(DRM_TEGRA_GEM_CREATE_TILED | DRM_TEGRA_GEM_CREATE_BOTTOM_UP)
+#define BO_NLISTS		(BO_NBUCKETS * 4)
+
+/*
+ * Per-handle state for objects the cache created, indexed by
+ * handle: the bucket plus one (0 for objects it does not know),
+ * the create flags, whether the tiling has been changed, and
+ * whether a job has been submitted using it, with that job's
+ * syncpoint and fence.
+ */
+#define BO_INFO_BUCKET		0x7f
+#define BO_INFO_FLAGS_SHIFT	8
+#define BO_INFO_TILING_SET	(1 << 10)
+#define BO_INFO_BUSY		(1 << 11)
+
+struct bo_handle {
+    uint16_t info;
+    uint16_t syncpt;
+    uint32_t fence;
+};
+
+struct bo_list {
+    struct bo_list *next, *prev;
+};
+
+/*
+ * A parked object is on its bucket's list, newest first, so reuse
+ * takes the object most likely to still be in cache, and on the
+ * global age list, newest first, so eviction takes the oldest.
+ */
+struct bo_entry {
+    struct bo_list bucket;
+    struct bo_list age;
+    struct bo_fd *owner;
+    uint64_t parked_ns;
+    uint32_t handle;
+    uint32_t list;
+    int busy;
+    uint32_t syncpt;
+    uint32_t fence;
+};
+
+/*
+ * Per-fd state, for the open file the fd named when it was created
+ * (see shim_file_hold()).  Parked objects are closed through held,
+ * which always names that file.
+ */
+struct bo_fd {
+    struct bo_fd *next;
+    int fd;
+    int held;
+    struct bo_handle *handles;
+    uint32_t nhandles;
+    struct bo_list lists[BO_NLISTS];
+};
+
+static pthread_mutex_t bo_lock = PTHREAD_MUTEX_INITIALIZER;
+static int bo_cache_on;
+static uint64_t bo_max_bytes;
+static uint64_t bo_max_age_ns = BO_DEFAULT_AGE_MS * 1000000ULL;
+static struct bo_fd *bo_fds;
+static struct bo_list bo_age = { &bo_age, &bo_age };
+static drmShimBoCacheStats bo_stats;
+static int (*next_prime_export)(int fd, uint32_t handle, uint32_t flags, int *prime_fd);
+
+static inline void
+list_init (struct bo_list *l)
+{
+    l->next = l->prev = l;
+}
+
+static inline void
+list_add (struct bo_list *head, struct bo_list *l)
+{
+    l->next = head->next;
+    l->prev = head;
+    head->next->prev = l;
+    head->next = l;
+}
+
+static inline void
+list_del (struct bo_list *l)
+{
+    l->prev->next = l->next;
+    l->next->prev = l->prev;
+}
+
+#define list_entry(l__, member__) \
+    ((struct bo_entry *) ((char *) (l__) - __builtin_offsetof(struct bo_entry, member__)))
+
+/*
+ * DRM_SHIM_BO_CACHE is the most the cache may hold, in MiB; unset
+ * or 0 disables it.  DRM_SHIM_BO_CACHE_AGE_MS (default 1000) is
+ * how long an object may stay parked.  Read before the dispatch
+ * pointers are bound, so the ioctl hook can be put in place.
+ */
+static void __attribute__((constructor(101)))
+shim_bo_init (void)
+{
+    const char *env = getenv("DRM_SHIM_BO_CACHE");
+    unsigned long val;
+
+    if (env == NULL || (val = strtoul(env, NULL, 0)) == 0 || !shim_file_tracking())
+        return;
+    bo_max_bytes = (uint64_t) val << 20;
+    env = getenv("DRM_SHIM_BO_CACHE_AGE_MS");
+    if (env != NULL && *env != '\0')
+        bo_max_age_ns = strtoull(env, NULL, 0) * 1000000ULL;
+    bo_cache_on = 1;
+}
+
+int
+shim_bo_enabled (void)
+{
+    return bo_cache_on;
+}
+
+/* Returns the bucket for a size, or -1 if it is too large to cache. */
+static int
+bucket_of (uint64_t size, uint64_t *bucket_size)
+{
+    uint64_t pages = (size + BO_PAGE_SIZE - 1) / BO_PAGE_SIZE;
+    unsigned int shift;
+    uint64_t step;
+
+    if (pages == 0)
+        return -1;
+    if (pages <= BO_SMALL_BUCKETS) {
+        *bucket_size = pages * BO_PAGE_SIZE;
+        return (int) pages - 1;
+    }
+    shift = 63 - __builtin_clzll(pages - 1);
+    if (shift >= 4 + (BO_NBUCKETS - BO_SMALL_BUCKETS) / 4)
+        return -1;
+    step = 1ULL << (shift - 2);
+    pages = (pages + step - 1) & ~(step - 1);
+    *bucket_size = pages * BO_PAGE_SIZE;
+    return BO_SMALL_BUCKETS + (shift - 4) * 4 + (int) (pages / step) - 5;
+}
+
+static uint64_t
+bucket_size (unsigned int bucket)
+{
+    unsigned int shift;
+
+    if (bucket < BO_SMALL_BUCKETS)
+        return (bucket + 1) * BO_PAGE_SIZE;
+    bucket -= BO_SMALL_BUCKETS;
+    shift = 4 + bucket / 4;
+    return ((uint64_t) (bucket % 4 + 5) << (shift - 2)) * BO_PAGE_SIZE;
+}
+
+/* Unparks an entry and frees it.  Called with bo_lock held. */
+static void
+bo_unpark (struct bo_entry *e)
+{
+    list_del(&e->bucket);
+    list_del(&e->age);
+    bo_stats.bytes_held -= bucket_size(e->list / 4);
+    bo_stats.objects_held--;
+    free(e);
+}
+
+/*
+ * Frees an fd's state.  Parked objects need no closing: they go when
+ * the file does, and closing held lets it go if the program has
+ * closed its fd already.  Called with bo_lock held.
+ */
+static void
+bo_fd_free (struct bo_fd **bp)
+{
+    struct bo_fd *bf = *bp;
+    struct bo_entry *e;
+    unsigned int i;
+
+    *bp = bf->next;
+    for (i = 0; i < BO_NLISTS; i++)
+        while (bf->lists[i].next != &bf->lists[i]) {
+            e = list_entry(bf->lists[i].next, bucket);
+            bo_unpark(e);
+        }
+    close(bf->held);
+    free(bf->handles);
+    free(bf);
+}
+
+/*
+ * State whose fd number no longer names the same file is dropped
+ * when found.  Before state for a new fd is made, every fd's is
+ * checked, so files closed with close() are not held open for
+ * long.  Called with bo_lock held.
+ */
+static struct bo_fd *
+bo_fd_find (int fd, int create)
+{
+    struct bo_fd **bp, *bf;
+    unsigned int i;
+
+    for (bp = &bo_fds; (bf = *bp) != NULL; bp = &bf->next)
+        if (bf->fd == fd) {
+            if (shim_file_same(fd, bf->held))
+                return bf;
+            bo_fd_free(bp);
+            break;
+        }
+    if (!create)
+        return NULL;
+    for (bp = &bo_fds; (bf = *bp) != NULL; )
+        if (!shim_file_same(bf->fd, bf->held))
+            bo_fd_free(bp);
+        else
+            bp = &bf->next;
+    if ((bf = calloc(1, sizeof(*bf))) == NULL)
+        return NULL;
+    bf->held = shim_file_hold(fd);
+    if (bf->held < 0) {
+        free(bf);
+        return NULL;
+    }
+    bf->fd = fd;
+    for (i = 0; i < BO_NLISTS; i++)
+        list_init(&bf->lists[i]);
+    bf->next = bo_fds;
+    bo_fds = bf;
+    return bf;
+}
+
+/* Called with bo_lock held. */
+static void
+bo_set_info (struct bo_fd *bf, uint32_t handle, uint16_t info)
+{
+    struct bo_handle *tbl;
+    uint32_t n;
+
+    if (handle >= bf->nhandles) {
+        if (info == 0)
+            return;
+        for (n = bf->nhandles ? bf->nhandles : 256; n <= handle; n *= 2);
+        tbl = realloc(bf->handles, n * sizeof(*tbl));
+        if (tbl == NULL)
+            return;
+        memset(tbl + bf->nhandles, 0, (n - bf->nhandles) * sizeof(*tbl));
+        bf->handles = tbl;
+        bf->nhandles = n;
+    }
+    bf->handles[handle].info = info;
+}
+
+static inline uint16_t
+bo_get_info (struct bo_fd *bf, uint32_t handle)
+{
+    return bf != NULL && handle < bf->nhandles ? bf->handles[handle].info : 0;
+}
+
+/* Called with bo_lock held. */
+static void
+bo_set_busy (struct bo_fd *bf, uint32_t handle, uint32_t syncpt, uint32_t fence)
+{
+    struct bo_handle *h;
+
+    if (handle >= bf->nhandles || bf->handles[handle].info == 0)
+        return;
+    h = &bf->handles[handle];
+    h->info |= BO_INFO_BUSY;
+    h->syncpt = (uint16_t) syncpt;
+    h->fence = fence;
+}
+
+/*
+ * Returns the newest parked object on a list that no job is still
+ * using, or NULL.  Called with bo_lock held.
+ */
+static struct bo_entry *
+bo_idle_entry (int fd, struct bo_list *list)
+{
+    struct bo_entry *e;
+    struct bo_list *l;
+
+    for (l = list->next; l != list; l = l->next) {
+        e = list_entry(l, bucket);
+        if (!e->busy || drmShimSyncptPassed(fd, e->syncpt, e->fence) == 1)
+            return e;
+    }
+    return NULL;
+}
+
+/* Closes the oldest parked objects while over the limits.  Called with bo_lock held. */
+static void
+bo_evict (uint64_t now)
+{
+    struct drm_gem_close args;
+    struct bo_entry *e;
+
+    while (bo_age.prev != &bo_age) {
+        e = list_entry(bo_age.prev, age);
+        if (bo_stats.bytes_held <= bo_max_bytes && now - e->parked_ns < bo_max_age_ns)
+            break;
+        memset(&args, 0, sizeof(args));
+        args.handle = e->handle;
+        shim_ioctl_forward(e->owner->held, DRM_IOCTL_GEM_CLOSE, &args);
+        bo_unpark(e);
+        bo_stats.evictions++;
+    }
+}
+
+int
+shim_bo_create (int fd, void *arg)
+{
+    struct drm_tegra_gem_create *args = arg;
+    struct bo_entry *e;
+    struct bo_fd *bf;
+    uint64_t size, bsize;
+    uint32_t handle;
+    int bucket, list, ret;
+
+    bucket = (args->flags & ~BO_CREATE_FLAGS) ? -1 : bucket_of(args->size, &bsize);
+    pthread_mutex_lock(&bo_lock);
+    bo_stats.creates++;
+    if (bucket < 0) {
+        pthread_mutex_unlock(&bo_lock);
+        return shim_ioctl_forward(fd, DRM_IOCTL_TEGRA_GEM_CREATE, args);
+    }
+    list = bucket * 4 + args->flags;
+    bo_evict(shim_now_ns());
+    bf = bo_fd_find(fd, 0);
+    if (bf != NULL && (e = bo_idle_entry(fd, &bf->lists[list])) != NULL) {
+        handle = e->handle;
+        bo_unpark(e);
+        bo_set_info(bf, handle, (bucket + 1) | (args->flags << BO_INFO_FLAGS_SHIFT));
+        bo_stats.hits++;
+        pthread_mutex_unlock(&bo_lock);
+        args->handle = handle;
+        return 0;
+    }
+    pthread_mutex_unlock(&bo_lock);
+
+    size = args->size;
+    args->size = bsize;
+    ret = shim_ioctl_forward(fd, DRM_IOCTL_TEGRA_GEM_CREATE, args);
+    args->size = size;
+    if (ret == 0) {
+        pthread_mutex_lock(&bo_lock);
+        if ((bf = bo_fd_find(fd, 1)) != NULL)
+            bo_set_info(bf, args->handle, (bucket + 1) | (args->flags << BO_INFO_FLAGS_SHIFT));
+        pthread_mutex_unlock(&bo_lock);
+    }
+    return ret;
+}
+
+/*
+ * Parks an object the cache created, unless its tiling cannot be
+ * put back to what a new object's would be, or it would not fit.
+ */
+int
+shim_bo_close (int fd, void *arg)
+{
+    struct drm_gem_close *args = arg;
+    struct drm_tegra_gem_set_tiling tiling;
+    struct bo_handle h;
+    struct bo_entry *e;
+    struct bo_fd *bf;
+    uint16_t info;
+    uint32_t flags;
+    uint64_t now;
+
+    pthread_mutex_lock(&bo_lock);
+    bf = bo_fd_find(fd, 0);
+    info = bo_get_info(bf, args->handle);
+    if (info == 0) {
+        pthread_mutex_unlock(&bo_lock);
+        return shim_ioctl_forward(fd, DRM_IOCTL_GEM_CLOSE, args);
+    }
+    h = bf->handles[args->handle];
+    bo_set_info(bf, args->handle, 0);
+    flags = (info >> BO_INFO_FLAGS_SHIFT) & BO_CREATE_FLAGS;
+    if (info & BO_INFO_TILING_SET) {
+        memset(&tiling, 0, sizeof(tiling));
+        tiling.handle = args->handle;
+        tiling.mode = (flags & DRM_TEGRA_GEM_CREATE_TILED) ?
+            DRM_TEGRA_GEM_TILING_MODE_TILED : DRM_TEGRA_GEM_TILING_MODE_PITCH;
+        if (shim_ioctl_forward(fd, DRM_IOCTL_TEGRA_GEM_SET_TILING, &tiling) != 0)
+            info = 0;
+    }
+    if (info == 0 || bucket_size((info & BO_INFO_BUCKET) - 1) > bo_max_bytes ||
+        (e = calloc(1, sizeof(*e))) == NULL) {
+        pthread_mutex_unlock(&bo_lock);
+        return shim_ioctl_forward(fd, DRM_IOCTL_GEM_CLOSE, args);
+    }
+    now = shim_now_ns();
+    e->owner = bf;
+    e->handle = args->handle;
+    e->list = ((info & BO_INFO_BUCKET) - 1) * 4 + flags;
+    e->parked_ns = now;
+    e->busy = (info & BO_INFO_BUSY) != 0;
+    e->syncpt = h.syncpt;
+    e->fence = h.fence;
+    list_add(&bf->lists[e->list], &e->bucket);
+    list_add(&bo_age, &e->age);
+    bo_stats.bytes_held += bucket_size(e->list / 4);
+    bo_stats.objects_held++;
+    bo_stats.parked++;
+    bo_evict(now);
+    pthread_mutex_unlock(&bo_lock);
+    return 0;
+}
+
+/*
+ * Notes a change the cache must undo, or cannot undo, before the
+ * object could be reused.  Objects shared with other processes or
+ * devices, or whose flags are changed, are never parked.
+ */
+void
+shim_bo_modified (int fd, uint32_t handle, int tiling_only)
+{
+    struct bo_fd *bf;
+    uint16_t info;
+
+    pthread_mutex_lock(&bo_lock);
+    bf = bo_fd_find(fd, 0);
+    info = bo_get_info(bf, handle);
+    if (info != 0)
+        bo_set_info(bf, handle, tiling_only ? (info | BO_INFO_TILING_SET) : 0);
+    pthread_mutex_unlock(&bo_lock);
+}
+
+/*
+ * Notes the fence of a submitted job on each object it uses, as a
+ * command buffer or relocation target.  Only the job's first
+ * syncpoint is recorded; it is the one the fence is for.
+ */
+int
+shim_bo_submit (int fd, void *arg)
+{
+    struct drm_tegra_submit *args = arg;
+    const struct drm_tegra_syncpt *sp = (const void *) (uintptr_t) args->syncpts;
+    const struct drm_tegra_cmdbuf *cb = (const void *) (uintptr_t) args->cmdbufs;
+    const struct drm_tegra_reloc *rl = (const void *) (uintptr_t) args->relocs;
+    struct bo_fd *bf;
+    uint32_t i;
+    int ret;
+
+    ret = shim_ioctl_forward(fd, DRM_IOCTL_TEGRA_SUBMIT, args);
+    if (ret != 0 || args->num_syncpts == 0)
+        return ret;
+    pthread_mutex_lock(&bo_lock);
+    bf = bo_fd_find(fd, 0);
+    if (bf != NULL) {
+        for (i = 0; i < args->num_cmdbufs; i++)
+            bo_set_busy(bf, cb[i].handle, sp[0].id, args->fence);
+        for (i = 0; i < args->num_relocs; i++) {
+            bo_set_busy(bf, rl[i].cmdbuf.handle, sp[0].id, args->fence);
+            bo_set_busy(bf, rl[i].target.handle, sp[0].id, args->fence);
+        }
+    }
+    pthread_mutex_unlock(&bo_lock);
+    return ret;
+}
+
+/* Objects parked on a closing fd go away with it. */
+void
+shim_bo_forget_fd (int fd)
+{
+    struct bo_fd **bp, *bf;
+
+    if (!bo_cache_on)
+        return;
+    pthread_mutex_lock(&bo_lock);
+    for (bp = &bo_fds; (bf = *bp) != NULL; bp = &bf->next)
+        if (bf->fd == fd) {
+            bo_fd_free(bp);
+            break;
+        }
+    pthread_mutex_unlock(&bo_lock);
+}
+
+static int
+bo_prime_export (int fd, uint32_t handle, uint32_t flags, int *prime_fd)
+{
+    shim_bo_modified(fd, handle, 0);
+    return next_prime_export(fd, handle, flags, prime_fd);
+}
+
+void *
+shim_bo_interpose (unsigned int id, void *fn)
+{
+    if (!bo_cache_on)
+        return fn;
+    if (id == FUNCID_drmPrimeHandleToFD) {
+        next_prime_export = fn;
+        return bo_prime_export;
+    }
+    return fn;
+}
+
+void
+drmShimBoCacheGetStats (drmShimBoCacheStats *stats)
+{
+    if (stats == NULL)
+        return;
+    pthread_mutex_lock(&bo_lock);
+    *stats = bo_stats;
+    pthread_mutex_unlock(&bo_lock);
+}
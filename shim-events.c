@@ -0,0 +1,406 @@
+/*
+ * shim-events.c
+ *
+ * Threaded DRM event dispatcher.  One thread reads a DRM fd's
+ * events in bulk and sorts them into a queue per CRTC, so each head
+ * of a multi-head renderer can consume its own flip completions
+ * and vblanks without contending for the fd.
+ *
+ * Copyright (c) 2018-2019, Matthew Madison
+ * Distributed under license; see the LICENSE file for details.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "xf86drm.h"
+#include "drm-shim.h"
+
+#define EVENTS_MAX_QUEUES	16
+#define EVENTS_DEFAULT_SIZE	256
+#define EVENTS_READ_SIZE	4096
+
+/*
+ * Single-producer, single-consumer ring.  The dispatcher thread
+ * only advances tail and the consumer only advances head, so
+ * neither side takes a lock.  The eventfd is written after each
+ * batch of events the dispatcher adds, so the queue can be polled.
+ */
+struct event_queue {
+    uint32_t crtc_id;
+    int efd;
+    uint32_t mask;
+    uint32_t head;
+    uint32_t tail;
+    uint64_t dropped;
+    drmShimEvent *ring;
+};
+
+/*
+ * Queues are created on first use by either side and never freed
+ * before the dispatcher is; nqueues is published with a release
+ * store after each new queue is filled in, so lookups need no lock.
+ * dead is set, with a release store, if the thread stops reading
+ * the fd before the dispatcher is destroyed.
+ */
+struct _drmShimEventDispatcher {
+    int fd;
+    int stopfd;
+    int dead;
+    pthread_t thread;
+    uint32_t queue_size;
+    pthread_mutex_t lock;
+    unsigned int nqueues;
+    struct event_queue queues[EVENTS_MAX_QUEUES];
+};
+
+static struct event_queue *
+queue_find (drmShimEventDispatcherPtr d, uint32_t crtc_id)
+{
+    unsigned int i, n = __atomic_load_n(&d->nqueues, __ATOMIC_ACQUIRE);
+
+    for (i = 0; i < n; i++)
+        if (d->queues[i].crtc_id == crtc_id)
+            return &d->queues[i];
+    return NULL;
+}
+
+static struct event_queue *
+queue_get (drmShimEventDispatcherPtr d, uint32_t crtc_id)
+{
+    struct event_queue *q = queue_find(d, crtc_id);
+
+    if (q != NULL)
+        return q;
+    pthread_mutex_lock(&d->lock);
+    q = queue_find(d, crtc_id);
+    if (q == NULL && d->nqueues < EVENTS_MAX_QUEUES) {
+        q = &d->queues[d->nqueues];
+        q->ring = calloc(d->queue_size, sizeof(*q->ring));
+        q->efd = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+        if (q->ring == NULL || q->efd < 0) {
+            free(q->ring);
+            if (q->efd >= 0)
+                close(q->efd);
+            q = NULL;
+        } else {
+            q->crtc_id = crtc_id;
+            q->mask = d->queue_size - 1;
+            if (__atomic_load_n(&d->dead, __ATOMIC_ACQUIRE))
+                eventfd_write(q->efd, 1);
+            __atomic_store_n(&d->nqueues, d->nqueues + 1, __ATOMIC_RELEASE);
+        }
+    }
+    pthread_mutex_unlock(&d->lock);
+    return q;
+}
+
+/* Returns 1 if the event was queued, 0 if the queue was full */
+static int
+queue_push (struct event_queue *q, const drmShimEvent *ev)
+{
+    uint32_t tail = q->tail;
+
+    if (tail - __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) > q->mask) {
+        __atomic_fetch_add(&q->dropped, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    q->ring[tail & q->mask] = *ev;
+    __atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+static int
+queue_pop (struct event_queue *q, drmShimEvent *ev)
+{
+    uint32_t head = q->head;
+
+    if (head == __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE))
+        return 0;
+    *ev = q->ring[head & q->mask];
+    __atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/*
+ * Converts one kernel event.  Sequence events carry no CRTC id,
+ * and kernels before 4.12 leave crtc_id zero in vblank and flip
+ * events; both go to the queue for CRTC 0.
+ */
+static int
+event_parse (const struct drm_event *e, drmShimEvent *ev)
+{
+    const struct drm_event_vblank *vb;
+    const struct drm_event_crtc_sequence *seq;
+
+    switch (e->type) {
+    case DRM_EVENT_VBLANK:
+    case DRM_EVENT_FLIP_COMPLETE:
+        if (e->length < sizeof(*vb))
+            return 0;
+        vb = (const void *) e;
+        ev->type = e->type;
+        ev->crtc_id = vb->crtc_id;
+        ev->sequence = vb->sequence;
+        ev->time_ns = (uint64_t) vb->tv_sec * 1000000000ULL + (uint64_t) vb->tv_usec * 1000ULL;
+        ev->user_data = vb->user_data;
+        return 1;
+    case DRM_EVENT_CRTC_SEQUENCE:
+        if (e->length < sizeof(*seq))
+            return 0;
+        seq = (const void *) e;
+        ev->type = e->type;
+        ev->crtc_id = 0;
+        ev->sequence = seq->sequence;
+        ev->time_ns = (uint64_t) seq->time_ns;
+        ev->user_data = seq->user_data;
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+/*
+ * Each read() returns as many whole events as fit in the buffer.
+ * The queues that received events are woken once per read rather
+ * than once per event.  If the fd fails or reaches end of file, the
+ * dispatcher is marked dead and every queue is woken, so consumers
+ * waiting on one find out.
+ */
+static void *
+dispatcher_thread (void *arg)
+{
+    drmShimEventDispatcherPtr d = arg;
+    struct pollfd pfd[2] = { { d->fd, POLLIN, 0 }, { d->stopfd, POLLIN, 0 } };
+    uint64_t buf[EVENTS_READ_SIZE / sizeof(uint64_t)];
+    struct event_queue *woken[EVENTS_MAX_QUEUES];
+    struct event_queue *q;
+    const struct drm_event *e;
+    drmShimEvent ev;
+    unsigned int i, nwoken;
+    ssize_t len, pos;
+    uint64_t one = 1;
+
+    for (;;) {
+        if (poll(pfd, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (pfd[1].revents)
+            return NULL;
+        if (pfd[0].revents & (POLLERR | POLLNVAL))
+            break;
+        len = read(d->fd, buf, sizeof(buf));
+        if (len < 0 && (errno == EINTR || errno == EAGAIN))
+            continue;
+        if (len <= 0)
+            break;
+        nwoken = 0;
+        for (pos = 0; pos + (ssize_t) sizeof(*e) <= len; pos += e->length) {
+            e = (const void *) ((const char *) buf + pos);
+            if (e->length < sizeof(*e) || pos + (ssize_t) e->length > len)
+                break;
+            if (!event_parse(e, &ev))
+                continue;
+            q = queue_get(d, ev.crtc_id);
+            if (q == NULL || !queue_push(q, &ev))
+                continue;
+            for (i = 0; i < nwoken && woken[i] != q; i++);
+            if (i == nwoken)
+                woken[nwoken++] = q;
+        }
+        for (i = 0; i < nwoken; i++) {
+            len = write(woken[i]->efd, &one, sizeof(one));
+            (void) len;
+        }
+    }
+    pthread_mutex_lock(&d->lock);
+    __atomic_store_n(&d->dead, 1, __ATOMIC_RELEASE);
+    for (i = 0; i < d->nqueues; i++)
+        eventfd_write(d->queues[i].efd, 1);
+    pthread_mutex_unlock(&d->lock);
+    return NULL;
+}
+
+/*
+ * Starts a dispatcher thread reading fd, with queue_size events per
+ * CRTC queue (rounded up to a power of two; 0 for the default).
+ * The caller must not read fd or call drmHandleEvent() on it while
+ * the dispatcher exists.
+ */
+drmShimEventDispatcherPtr
+drmShimEventDispatcherCreate (int fd, unsigned int queue_size)
+{
+    drmShimEventDispatcherPtr d;
+    int err;
+
+    if (fd < 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    d = calloc(1, sizeof(*d));
+    if (d == NULL)
+        return NULL;
+    if (queue_size == 0)
+        queue_size = EVENTS_DEFAULT_SIZE;
+    for (d->queue_size = 2; d->queue_size < queue_size && d->queue_size < (1U << 20); d->queue_size <<= 1);
+    d->fd = fd;
+    pthread_mutex_init(&d->lock, NULL);
+    d->stopfd = eventfd(0, EFD_CLOEXEC);
+    if (d->stopfd < 0)
+        goto fail;
+    err = pthread_create(&d->thread, NULL, dispatcher_thread, d);
+    if (err != 0) {
+        close(d->stopfd);
+        errno = err;
+        goto fail;
+    }
+    return d;
+
+  fail:
+    err = errno;
+    pthread_mutex_destroy(&d->lock);
+    free(d);
+    errno = err;
+    return NULL;
+}
+
+void
+drmShimEventDispatcherDestroy (drmShimEventDispatcherPtr d)
+{
+    uint64_t one = 1;
+    unsigned int i;
+    ssize_t n;
+
+    if (d == NULL)
+        return;
+    n = write(d->stopfd, &one, sizeof(one));
+    (void) n;
+    pthread_join(d->thread, NULL);
+    for (i = 0; i < d->nqueues; i++) {
+        close(d->queues[i].efd);
+        free(d->queues[i].ring);
+    }
+    close(d->stopfd);
+    pthread_mutex_destroy(&d->lock);
+    free(d);
+}
+
+int
+drmShimEventQueueFd (drmShimEventDispatcherPtr d, uint32_t crtc_id)
+{
+    struct event_queue *q;
+
+    if (d == NULL)
+        return -EINVAL;
+    q = queue_get(d, crtc_id);
+    return q == NULL ? -ENOSPC : q->efd;
+}
+
+/*
+ * The queue's fd is cleared only after the queue is seen empty, and
+ * the queue is checked again afterwards, so an event added between
+ * the two is not left behind an unreadable fd.  Once the dispatcher
+ * is dead and the queue empty, the fd is left readable and -EPIPE
+ * is returned.
+ */
+int
+drmShimEventNext (drmShimEventDispatcherPtr d, uint32_t crtc_id, drmShimEvent *ev)
+{
+    struct event_queue *q;
+    uint64_t count;
+    ssize_t n;
+
+    if (d == NULL || ev == NULL)
+        return -EINVAL;
+    q = queue_find(d, crtc_id);
+    if (q == NULL)
+        return __atomic_load_n(&d->dead, __ATOMIC_ACQUIRE) ? -EPIPE : 0;
+    if (queue_pop(q, ev))
+        return 1;
+    if (__atomic_load_n(&d->dead, __ATOMIC_ACQUIRE))
+        return queue_pop(q, ev) ? 1 : -EPIPE;
+    n = read(q->efd, &count, sizeof(count));
+    (void) n;
+    return queue_pop(q, ev);
+}
+
+int
+drmShimEventWait (drmShimEventDispatcherPtr d, uint32_t crtc_id,
+                  drmShimEvent *ev, int timeout)
+{
+    struct pollfd pfd;
+    int ret;
+
+    if (d == NULL || ev == NULL)
+        return -EINVAL;
+    pfd.fd = drmShimEventQueueFd(d, crtc_id);
+    if (pfd.fd < 0)
+        return pfd.fd;
+    pfd.events = POLLIN;
+    for (;;) {
+        ret = drmShimEventNext(d, crtc_id, ev);
+        if (ret != 0)
+            return ret < 0 ? ret : 0;
+        ret = poll(&pfd, 1, timeout);
+        if (ret < 0 && errno != EINTR)
+            return -errno;
+        if (ret == 0)
+            return -ETIMEDOUT;
+    }
+}
+
+/*
+ * Runs the evctx handlers for every event queued for the CRTC,
+ * on the caller's thread, the way drmHandleEvent() would have.
+ * Returns the number of events handled.
+ */
+int
+drmShimEventDispatch (drmShimEventDispatcherPtr d, uint32_t crtc_id,
+                      struct _drmEventContext *evctx)
+{
+    drmShimEvent ev;
+    unsigned int sec, usec;
+    int count = 0;
+
+    if (d == NULL || evctx == NULL)
+        return -EINVAL;
+    while (drmShimEventNext(d, crtc_id, &ev) > 0) {
+        count++;
+        sec = (unsigned int) (ev.time_ns / 1000000000ULL);
+        usec = (unsigned int) (ev.time_ns % 1000000000ULL / 1000);
+        switch (ev.type) {
+        case DRM_EVENT_VBLANK:
+            if (evctx->version >= 1 && evctx->vblank_handler != NULL)
+                evctx->vblank_handler(d->fd, (unsigned int) ev.sequence, sec, usec,
+                                      (void *) (uintptr_t) ev.user_data);
+            break;
+        case DRM_EVENT_FLIP_COMPLETE:
+            if (evctx->version >= 3 && evctx->page_flip_handler2 != NULL)
+                evctx->page_flip_handler2(d->fd, (unsigned int) ev.sequence, sec, usec,
+                                          ev.crtc_id, (void *) (uintptr_t) ev.user_data);
+            else if (evctx->version >= 2 && evctx->page_flip_handler != NULL)
+                evctx->page_flip_handler(d->fd, (unsigned int) ev.sequence, sec, usec,
+                                         (void *) (uintptr_t) ev.user_data);
+            break;
+        case DRM_EVENT_CRTC_SEQUENCE:
+            if (evctx->version >= 4 && evctx->sequence_handler != NULL)
+                evctx->sequence_handler(d->fd, ev.sequence, ev.time_ns, ev.user_data);
+            break;
+        }
+    }
+    return count;
+}
+
+uint64_t
+drmShimEventDropped (drmShimEventDispatcherPtr d, uint32_t crtc_id)
+{
+    struct event_queue *q = d == NULL ? NULL : queue_find(d, crtc_id);
+
+    return q == NULL ? 0 : __atomic_load_n(&q->dropped, __ATOMIC_RELAXED);
+}
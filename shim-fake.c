@@ -0,0 +1,1046 @@
+/*
+ * shim-fake.c
+ *
+ * Software stand-in for the Tegra libdrm, for exercising and
+ * load-testing libdrm clients on machines without Tegra hardware
+ * (CI hosts, QEMU).  Selected at runtime with DRM_SHIM_BACKEND=fake.
+ *
+ * The fake provides:
+ *   - a device fd backed by a memfd, with GEM objects allocated
+ *     out of it, so GEM_MMAP offsets can be mmap()ed on the fd
+ *   - syncpoint counters, and SUBMIT that completes immediately,
+ *     or DRM_SHIM_FAKE_JOB_NS nanoseconds later if that is set
+ *   - binary syncobjs, with eventfds standing in for their
+ *     exported sync_file fences
+ *   - PRIME export/import, with one placeholder fd per object
+ *     (the fd identifies the object, but does not map its memory)
+ *   - a fixed KMS topology: one plane, CRTC, encoder and HDMI
+ *     connector with a 1920x1080 mode
+ *
+ * Functions it does not provide fall through to the shim's stubs.
+ *
+ * Copyright (c) 2018-2019, Matthew Madison
+ * Distributed under license; see the LICENSE file for details.
+ */
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "xf86drm.h"
+#include "xf86drmMode.h"
+#include "tegra_drm.h"
+#include "shim-private.h"
+#include "config.h"
+
+#define FAKE_NUM_SYNCPTS	32
+#define FAKE_MAX_SYNCOBJS	4096
+#define FAKE_PAGE_SIZE		4096UL
+
+#define FAKE_PLANE_ID		30
+#define FAKE_CRTC_ID		31
+#define FAKE_ENCODER_ID		32
+#define FAKE_CONNECTOR_ID	33
+
+struct fake_bo {
+    uint64_t size;
+    uint64_t offset;		/* location in the device memfd */
+    uint32_t flags;
+    uint32_t tiling_mode;
+    uint32_t tiling_value;
+    int      in_use;
+    int      prime_fd;
+    ino_t    prime_ino;
+};
+
+static pthread_mutex_t fake_lock = PTHREAD_MUTEX_INITIALIZER;
+static int device_fd = -1;
+static uint64_t device_size;
+static struct fake_bo *bos;
+static uint32_t nbos;
+static uint32_t max_bos;
+static uint64_t next_context = 1;
+static uint32_t next_fb_id = 100;
+static uint32_t crtc_fb_id;
+static uint32_t syncpts[FAKE_NUM_SYNCPTS];
+
+/*
+ * Simulated job latency.  Each syncpoint tracks only the value its
+ * most recent submit will reach and when, so jobs queued behind one
+ * another on a syncpoint all complete when the last one is due.
+ */
+struct fake_job {
+    uint32_t target;
+    int pending;
+    uint64_t due;
+};
+
+static pthread_once_t job_once = PTHREAD_ONCE_INIT;
+static uint64_t job_ns;
+static struct fake_job jobs[FAKE_NUM_SYNCPTS];
+
+static const drmModeModeInfo fake_mode = {
+    .clock = 148500,
+    .hdisplay = 1920, .hsync_start = 2008, .hsync_end = 2052, .htotal = 2200,
+    .vdisplay = 1080, .vsync_start = 1084, .vsync_end = 1089, .vtotal = 1125,
+    .vrefresh = 60,
+    .flags = 5,			/* +hsync +vsync */
+    .type = 0x48,		/* preferred | driver */
+    .name = "1920x1080",
+};
+
+static int
+fake_device (void)
+{
+    if (device_fd < 0)
+        device_fd = memfd_create("drm-shim-fake", MFD_CLOEXEC);
+    return device_fd;
+}
+
+/* Caller holds fake_lock. */
+static struct fake_bo *
+bo_lookup (uint32_t handle)
+{
+    if (handle == 0 || handle > nbos || !bos[handle-1].in_use)
+        return NULL;
+    return &bos[handle-1];
+}
+
+static int
+bo_create (uint64_t size, uint32_t flags, uint32_t *handle)
+{
+    struct fake_bo *bo = NULL;
+    uint32_t i;
+
+    if (size == 0)
+        return -EINVAL;
+    size = (size + FAKE_PAGE_SIZE - 1) & ~(FAKE_PAGE_SIZE - 1);
+    pthread_mutex_lock(&fake_lock);
+    if (fake_device() < 0 || ftruncate(device_fd, device_size + size) < 0) {
+        pthread_mutex_unlock(&fake_lock);
+        return -ENOMEM;
+    }
+    for (i = 0; i < nbos; i++)
+        if (!bos[i].in_use)
+            break;
+    if (i == max_bos) {
+        uint32_t newmax = max_bos ? max_bos * 2 : 64;
+        struct fake_bo *newbos = realloc(bos, newmax * sizeof(*bos));
+        if (newbos == NULL) {
+            pthread_mutex_unlock(&fake_lock);
+            return -ENOMEM;
+        }
+        bos = newbos;
+        max_bos = newmax;
+    }
+    if (i == nbos)
+        nbos++;
+    bo = &bos[i];
+    memset(bo, 0, sizeof(*bo));
+    bo->size = size;
+    bo->offset = device_size;
+    bo->flags = flags;
+    bo->prime_fd = -1;
+    bo->in_use = 1;
+    if (flags & DRM_TEGRA_GEM_CREATE_TILED)
+        bo->tiling_mode = DRM_TEGRA_GEM_TILING_MODE_TILED;
+    device_size += size;
+    *handle = i + 1;
+    pthread_mutex_unlock(&fake_lock);
+    return 0;
+}
+
+static int
+bo_close (uint32_t handle)
+{
+    struct fake_bo *bo;
+
+    pthread_mutex_lock(&fake_lock);
+    bo = bo_lookup(handle);
+    if (bo == NULL) {
+        pthread_mutex_unlock(&fake_lock);
+        return -EINVAL;
+    }
+    /* Offsets are not reused, but the pages are given back. */
+    fallocate(device_fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE, bo->offset, bo->size);
+    if (bo->prime_fd >= 0)
+        close(bo->prime_fd);
+    bo->in_use = 0;
+    pthread_mutex_unlock(&fake_lock);
+    return 0;
+}
+
+static int
+prime_export (uint32_t handle, uint32_t flags, int *prime_fd)
+{
+    struct fake_bo *bo;
+    struct stat st;
+    int ret = 0;
+
+    pthread_mutex_lock(&fake_lock);
+    bo = bo_lookup(handle);
+    if (bo == NULL)
+        ret = -ENOENT;
+    else if (bo->prime_fd < 0) {
+        bo->prime_fd = memfd_create("drm-shim-fake-prime", MFD_CLOEXEC);
+        if (bo->prime_fd < 0 || fstat(bo->prime_fd, &st) < 0)
+            ret = -errno;
+        else {
+            if (ftruncate(bo->prime_fd, bo->size) < 0)
+                ret = -errno;
+            bo->prime_ino = st.st_ino;
+        }
+    }
+    if (ret == 0) {
+        *prime_fd = fcntl(bo->prime_fd, (flags & DRM_CLOEXEC) ? F_DUPFD_CLOEXEC : F_DUPFD, 0);
+        if (*prime_fd < 0)
+            ret = -errno;
+    }
+    pthread_mutex_unlock(&fake_lock);
+    return ret;
+}
+
+static int
+prime_import (int prime_fd, uint32_t *handle)
+{
+    struct stat st;
+    uint32_t i;
+    int ret;
+
+    if (fstat(prime_fd, &st) < 0)
+        return -errno;
+    pthread_mutex_lock(&fake_lock);
+    for (i = 0; i < nbos; i++) {
+        if (bos[i].in_use && bos[i].prime_fd >= 0 && bos[i].prime_ino == st.st_ino) {
+            *handle = i + 1;
+            pthread_mutex_unlock(&fake_lock);
+            return 0;
+        }
+    }
+    pthread_mutex_unlock(&fake_lock);
+    /* Foreign buffer: make an object of the same size that owns a reference to it. */
+    ret = bo_create(st.st_size ? st.st_size : FAKE_PAGE_SIZE, 0, handle);
+    if (ret == 0) {
+        pthread_mutex_lock(&fake_lock);
+        bos[*handle-1].prime_fd = fcntl(prime_fd, F_DUPFD_CLOEXEC, 0);
+        bos[*handle-1].prime_ino = st.st_ino;
+        pthread_mutex_unlock(&fake_lock);
+    }
+    return ret;
+}
+
+static void
+job_init (void)
+{
+    const char *env = getenv("DRM_SHIM_FAKE_JOB_NS");
+
+    if (env != NULL)
+        job_ns = strtoull(env, NULL, 0);
+}
+
+/* Reads a syncpoint, first completing any job that is due. */
+static uint32_t
+syncpt_value (uint32_t id)
+{
+    if (__atomic_load_n(&jobs[id].pending, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_lock(&fake_lock);
+        if (jobs[id].pending && shim_now_ns() >= jobs[id].due) {
+            __atomic_store_n(&syncpts[id], jobs[id].target, __ATOMIC_RELEASE);
+            __atomic_store_n(&jobs[id].pending, 0, __ATOMIC_RELEASE);
+        }
+        pthread_mutex_unlock(&fake_lock);
+    }
+    return __atomic_load_n(&syncpts[id], __ATOMIC_ACQUIRE);
+}
+
+static int
+syncpt_wait (struct drm_tegra_syncpt_wait *args)
+{
+    uint64_t deadline;
+    struct timespec ts = { 0, 50000 };
+
+    if (args->id >= FAKE_NUM_SYNCPTS)
+        return -EINVAL;
+    deadline = shim_now_ns() + (uint64_t) args->timeout * 1000000ULL;
+    for (;;) {
+        uint32_t value = syncpt_value(args->id);
+        if ((int32_t) (value - args->thresh) >= 0) {
+            args->value = value;
+            return 0;
+        }
+        if (args->timeout != DRM_TEGRA_NO_TIMEOUT && shim_now_ns() >= deadline)
+            return -EAGAIN;     /* as host1x reports it */
+        nanosleep(&ts, NULL);
+    }
+}
+
+static int
+submit (struct drm_tegra_submit *args)
+{
+    const struct drm_tegra_syncpt *sp = (const void *) (uintptr_t) args->syncpts;
+    const struct drm_tegra_cmdbuf *cb = (const void *) (uintptr_t) args->cmdbufs;
+    uint32_t i;
+
+    if (args->context == 0 || args->num_syncpts == 0)
+        return -EINVAL;
+    pthread_mutex_lock(&fake_lock);
+    for (i = 0; i < args->num_cmdbufs; i++) {
+        if (bo_lookup(cb[i].handle) == NULL) {
+            pthread_mutex_unlock(&fake_lock);
+            return -ENOENT;
+        }
+    }
+    pthread_mutex_unlock(&fake_lock);
+    pthread_once(&job_once, job_init);
+    for (i = 0; i < args->num_syncpts; i++) {
+        struct fake_job *job;
+        uint32_t value;
+        if (sp[i].id >= FAKE_NUM_SYNCPTS)
+            return -EINVAL;
+        if (job_ns == 0) {
+            value = __atomic_add_fetch(&syncpts[sp[i].id], sp[i].incrs, __ATOMIC_RELEASE);
+        } else {
+            job = &jobs[sp[i].id];
+            pthread_mutex_lock(&fake_lock);
+            value = (job->pending ? job->target : syncpts[sp[i].id]) + sp[i].incrs;
+            job->target = value;
+            job->due = shim_now_ns() + job_ns;
+            __atomic_store_n(&job->pending, 1, __ATOMIC_RELEASE);
+            pthread_mutex_unlock(&fake_lock);
+        }
+        if (i == 0)
+            args->fence = value;
+    }
+    return 0;
+}
+
+static int
+tegra_ioctl (unsigned long request, void *arg)
+{
+    struct fake_bo *bo;
+    int ret = 0;
+
+    switch (request) {
+    case DRM_IOCTL_TEGRA_GEM_CREATE: {
+        struct drm_tegra_gem_create *args = arg;
+        return bo_create(args->size, args->flags, &args->handle);
+    }
+    case DRM_IOCTL_TEGRA_GEM_MMAP: {
+        struct drm_tegra_gem_mmap *args = arg;
+        pthread_mutex_lock(&fake_lock);
+        bo = bo_lookup(args->handle);
+        if (bo == NULL)
+            ret = -EINVAL;
+        else
+            args->offset = bo->offset;
+        pthread_mutex_unlock(&fake_lock);
+        return ret;
+    }
+    case DRM_IOCTL_TEGRA_SYNCPT_READ: {
+        struct drm_tegra_syncpt_read *args = arg;
+        if (args->id >= FAKE_NUM_SYNCPTS)
+            return -EINVAL;
+        args->value = syncpt_value(args->id);
+        return 0;
+    }
+    case DRM_IOCTL_TEGRA_SYNCPT_INCR: {
+        struct drm_tegra_syncpt_incr *args = arg;
+        if (args->id >= FAKE_NUM_SYNCPTS)
+            return -EINVAL;
+        pthread_mutex_lock(&fake_lock);
+        __atomic_add_fetch(&syncpts[args->id], 1, __ATOMIC_RELEASE);
+        if (jobs[args->id].pending)
+            jobs[args->id].target++;
+        pthread_mutex_unlock(&fake_lock);
+        return 0;
+    }
+    case DRM_IOCTL_TEGRA_SYNCPT_WAIT:
+        return syncpt_wait(arg);
+    case DRM_IOCTL_TEGRA_OPEN_CHANNEL: {
+        struct drm_tegra_open_channel *args = arg;
+        args->context = __atomic_fetch_add(&next_context, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    case DRM_IOCTL_TEGRA_CLOSE_CHANNEL:
+        return 0;
+    case DRM_IOCTL_TEGRA_GET_SYNCPT: {
+        struct drm_tegra_get_syncpt *args = arg;
+        if (args->index != 0)
+            return -EINVAL;
+        /* syncpoint 0 is reserved, as on the real hardware */
+        args->id = 1 + (args->context % (FAKE_NUM_SYNCPTS - 1));
+        return 0;
+    }
+    case DRM_IOCTL_TEGRA_GET_SYNCPT_BASE: {
+        struct drm_tegra_get_syncpt_base *args = arg;
+        args->id = 0;
+        return 0;
+    }
+    case DRM_IOCTL_TEGRA_SUBMIT:
+        return submit(arg);
+    case DRM_IOCTL_TEGRA_GEM_SET_TILING:
+    case DRM_IOCTL_TEGRA_GEM_GET_TILING: {
+        struct drm_tegra_gem_set_tiling *args = arg;
+        pthread_mutex_lock(&fake_lock);
+        bo = bo_lookup(args->handle);
+        if (bo == NULL)
+            ret = -ENOENT;
+        else if (request == DRM_IOCTL_TEGRA_GEM_SET_TILING) {
+            if (args->mode > DRM_TEGRA_GEM_TILING_MODE_BLOCK)
+                ret = -EINVAL;
+            else {
+                bo->tiling_mode = args->mode;
+                bo->tiling_value = args->value;
+            }
+        } else {
+            args->mode = bo->tiling_mode;
+            args->value = bo->tiling_value;
+        }
+        pthread_mutex_unlock(&fake_lock);
+        return ret;
+    }
+    case DRM_IOCTL_TEGRA_GEM_SET_FLAGS:
+    case DRM_IOCTL_TEGRA_GEM_GET_FLAGS: {
+        struct drm_tegra_gem_set_flags *args = arg;
+        pthread_mutex_lock(&fake_lock);
+        bo = bo_lookup(args->handle);
+        if (bo == NULL)
+            ret = -ENOENT;
+        else if (request == DRM_IOCTL_TEGRA_GEM_SET_FLAGS) {
+            if (args->flags & ~DRM_TEGRA_GEM_FLAGS)
+                ret = -EINVAL;
+            else
+                bo->flags = args->flags;
+        } else
+            args->flags = bo->flags;
+        pthread_mutex_unlock(&fake_lock);
+        return ret;
+    }
+    case DRM_IOCTL_GEM_CLOSE: {
+        struct drm_gem_close *args = arg;
+        return bo_close(args->handle);
+    }
+    case DRM_IOCTL_PRIME_HANDLE_TO_FD: {
+        struct drm_prime_handle *args = arg;
+        return prime_export(args->handle, args->flags, &args->fd);
+    }
+    case DRM_IOCTL_PRIME_FD_TO_HANDLE: {
+        struct drm_prime_handle *args = arg;
+        return prime_import(args->fd, &args->handle);
+    }
+    default:
+        return -ENOTTY;
+    }
+}
+
+/* The ioctl itself, as shim_ioctl_eintr() makes it. */
+static int
+fake_ioctl (int fd, unsigned long request, void *arg)
+{
+    int ret = tegra_ioctl(request, arg);
+
+    if (ret < 0) {
+        errno = -ret;
+        return -1;
+    }
+    return ret;
+}
+
+/* Restarts on EINTR and EAGAIN, as libdrm's does. */
+static int
+fake_drmIoctl (int fd, unsigned long request, void *arg)
+{
+    int ret;
+
+    do
+        ret = tegra_ioctl(request, arg);
+    while (ret == -EINTR || ret == -EAGAIN);
+
+    if (ret < 0) {
+        errno = -ret;
+        return -1;
+    }
+    return ret;
+}
+
+static int
+fake_drmAvailable (void)
+{
+    return 1;
+}
+
+static int
+fake_drmOpen (const char *name, const char *busid)
+{
+    int fd;
+
+    pthread_mutex_lock(&fake_lock);
+    fd = fake_device();
+    pthread_mutex_unlock(&fake_lock);
+    if (fd < 0)
+        return -errno;
+    return fcntl(fd, F_DUPFD_CLOEXEC, 0);
+}
+
+static int
+fake_drmOpenWithType (const char *name, const char *busid, int type)
+{
+    return fake_drmOpen(name, busid);
+}
+
+static int
+fake_drmOpenRender (int minor)
+{
+    return fake_drmOpen(NULL, NULL);
+}
+
+static int
+fake_drmClose (int fd)
+{
+    return close(fd);
+}
+
+static drmVersionPtr
+fake_drmGetVersion (int fd)
+{
+    static const char name[] = "tegra", date[] = "20120330", desc[] = "NVIDIA Tegra (drm-shim fake)";
+    drmVersionPtr v = calloc(1, sizeof(*v) + sizeof(name) + sizeof(date) + sizeof(desc));
+
+    if (v == NULL)
+        return NULL;
+    v->version_major = 1;
+    v->name = memcpy((char *) (v + 1), name, sizeof(name));
+    v->name_len = sizeof(name) - 1;
+    v->date = memcpy(v->name + sizeof(name), date, sizeof(date));
+    v->date_len = sizeof(date) - 1;
+    v->desc = memcpy(v->date + sizeof(date), desc, sizeof(desc));
+    v->desc_len = sizeof(desc) - 1;
+    return v;
+}
+
+static void
+fake_drmFreeVersion (drmVersionPtr v)
+{
+    free(v);
+}
+
+static int
+fake_drmGetCap (int fd, uint64_t capability, uint64_t *value)
+{
+    switch (capability) {
+    case DRM_CAP_PRIME:
+        *value = DRM_PRIME_CAP_IMPORT | DRM_PRIME_CAP_EXPORT;
+        return 0;
+    case DRM_CAP_TIMESTAMP_MONOTONIC:
+    case DRM_CAP_SYNCOBJ:
+        *value = 1;
+        return 0;
+    default:
+        *value = 0;
+        return -EINVAL;
+    }
+}
+
+static int
+fake_drmSetClientCap (int fd, uint64_t capability, uint64_t value)
+{
+    return 0;
+}
+
+static int
+fake_drmPrimeHandleToFD (int fd, uint32_t handle, uint32_t flags, int *prime_fd)
+{
+    struct drm_prime_handle args = { .handle = handle, .flags = flags, .fd = -1 };
+    int ret = fake_drmIoctl(fd, DRM_IOCTL_PRIME_HANDLE_TO_FD, &args);
+
+    if (ret == 0)
+        *prime_fd = args.fd;
+    return ret;
+}
+
+static int
+fake_drmPrimeFDToHandle (int fd, int prime_fd, uint32_t *handle)
+{
+    struct drm_prime_handle args = { .fd = prime_fd };
+    int ret = fake_drmIoctl(fd, DRM_IOCTL_PRIME_FD_TO_HANDLE, &args);
+
+    if (ret == 0)
+        *handle = args.handle;
+    return ret;
+}
+
+/*
+ * KMS objects are returned as single allocations, with their
+ * arrays following the structure, so the Free functions are
+ * just free().
+ */
+static drmModeResPtr
+fake_drmModeGetResources (int fd)
+{
+    drmModeResPtr res = calloc(1, sizeof(*res) + 3 * sizeof(uint32_t));
+    uint32_t *ids;
+
+    if (res == NULL)
+        return NULL;
+    ids = (uint32_t *) (res + 1);
+    ids[0] = FAKE_CRTC_ID;
+    ids[1] = FAKE_CONNECTOR_ID;
+    ids[2] = FAKE_ENCODER_ID;
+    res->count_crtcs = 1;
+    res->crtcs = &ids[0];
+    res->count_connectors = 1;
+    res->connectors = &ids[1];
+    res->count_encoders = 1;
+    res->encoders = &ids[2];
+    res->max_width = 4096;
+    res->max_height = 4096;
+    return res;
+}
+
+static drmModeCrtcPtr
+fake_drmModeGetCrtc (int fd, uint32_t crtc_id)
+{
+    drmModeCrtcPtr crtc;
+
+    if (crtc_id != FAKE_CRTC_ID)
+        return NULL;
+    crtc = calloc(1, sizeof(*crtc));
+    if (crtc == NULL)
+        return NULL;
+    crtc->crtc_id = crtc_id;
+    crtc->buffer_id = __atomic_load_n(&crtc_fb_id, __ATOMIC_RELAXED);
+    crtc->width = fake_mode.hdisplay;
+    crtc->height = fake_mode.vdisplay;
+    crtc->mode_valid = 1;
+    crtc->mode = fake_mode;
+    crtc->gamma_size = 256;
+    return crtc;
+}
+
+static drmModeEncoderPtr
+fake_drmModeGetEncoder (int fd, uint32_t encoder_id)
+{
+    drmModeEncoderPtr enc;
+
+    if (encoder_id != FAKE_ENCODER_ID)
+        return NULL;
+    enc = calloc(1, sizeof(*enc));
+    if (enc == NULL)
+        return NULL;
+    enc->encoder_id = encoder_id;
+    enc->encoder_type = DRM_MODE_ENCODER_TMDS;
+    enc->crtc_id = FAKE_CRTC_ID;
+    enc->possible_crtcs = 1;
+    return enc;
+}
+
+static drmModeConnectorPtr
+fake_drmModeGetConnector (int fd, uint32_t connector_id)
+{
+    drmModeConnectorPtr conn;
+
+    if (connector_id != FAKE_CONNECTOR_ID)
+        return NULL;
+    conn = calloc(1, sizeof(*conn) + sizeof(drmModeModeInfo) + sizeof(uint32_t));
+    if (conn == NULL)
+        return NULL;
+    conn->connector_id = connector_id;
+    conn->encoder_id = FAKE_ENCODER_ID;
+    conn->connector_type = DRM_MODE_CONNECTOR_HDMIA;
+    conn->connector_type_id = 1;
+    conn->connection = DRM_MODE_CONNECTED;
+    conn->mmWidth = 510;
+    conn->mmHeight = 290;
+    conn->count_modes = 1;
+    conn->modes = (drmModeModeInfoPtr) (conn + 1);
+    conn->modes[0] = fake_mode;
+    conn->count_encoders = 1;
+    conn->encoders = (uint32_t *) (conn->modes + 1);
+    conn->encoders[0] = FAKE_ENCODER_ID;
+    return conn;
+}
+
+static drmModePlaneResPtr
+fake_drmModeGetPlaneResources (int fd)
+{
+    drmModePlaneResPtr res = calloc(1, sizeof(*res) + sizeof(uint32_t));
+
+    if (res == NULL)
+        return NULL;
+    res->count_planes = 1;
+    res->planes = (uint32_t *) (res + 1);
+    res->planes[0] = FAKE_PLANE_ID;
+    return res;
+}
+
+static drmModePlanePtr
+fake_drmModeGetPlane (int fd, uint32_t plane_id)
+{
+    drmModePlanePtr plane;
+
+    if (plane_id != FAKE_PLANE_ID)
+        return NULL;
+    plane = calloc(1, sizeof(*plane) + sizeof(uint32_t));
+    if (plane == NULL)
+        return NULL;
+    plane->plane_id = plane_id;
+    plane->count_formats = 1;
+    plane->formats = (uint32_t *) (plane + 1);
+    plane->formats[0] = 0x34325258;	/* XR24 */
+    plane->crtc_id = FAKE_CRTC_ID;
+    plane->fb_id = __atomic_load_n(&crtc_fb_id, __ATOMIC_RELAXED);
+    plane->possible_crtcs = 1;
+    return plane;
+}
+
+static void
+fake_drmModeFree (void *ptr)
+{
+    free(ptr);
+}
+
+static int
+fake_drmModeAddFB (int fd, uint32_t width, uint32_t height, uint8_t depth,
+                   uint8_t bpp, uint32_t pitch, uint32_t bo_handle, uint32_t *buf_id)
+{
+    *buf_id = __atomic_fetch_add(&next_fb_id, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static int
+fake_drmModeAddFB2 (int fd, uint32_t width, uint32_t height, uint32_t pixel_format,
+                    const uint32_t bo_handles[4], const uint32_t pitches[4],
+                    const uint32_t offsets[4], uint32_t *buf_id, uint32_t flags)
+{
+    *buf_id = __atomic_fetch_add(&next_fb_id, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static int
+fake_drmModeRmFB (int fd, uint32_t buffer_id)
+{
+    return 0;
+}
+
+static int
+fake_drmModeSetCrtc (int fd, uint32_t crtc_id, uint32_t buffer_id, uint32_t x, uint32_t y,
+                     uint32_t *connectors, int count, drmModeModeInfoPtr mode)
+{
+    if (crtc_id != FAKE_CRTC_ID)
+        return -EINVAL;
+    __atomic_store_n(&crtc_fb_id, buffer_id, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static int
+fake_drmModePageFlip (int fd, uint32_t crtc_id, uint32_t fb_id, uint32_t flags, void *user_data)
+{
+    return fake_drmModeSetCrtc(fd, crtc_id, fb_id, 0, 0, NULL, 0, NULL);
+}
+
+/*
+ * Binary syncobjs.  There is no separate submitted state: a syncobj
+ * is either signalled or not, and a wait on one that is not blocks
+ * as if DRM_SYNCOBJ_WAIT_FLAGS_WAIT_FOR_SUBMIT were set.  Handles
+ * are shared by every fd.
+ *
+ * Exported fences are eventfds, which poll readable once written,
+ * as a sync_file does once it signals; they cannot be merged.  An
+ * unsignalled syncobj that has been exported holds the eventfd it
+ * will write when signalled.  One that has been imported into holds
+ * the imported fd, and becomes signalled when that fd does.
+ */
+enum {
+    SYNCOBJ_FREE,
+    SYNCOBJ_UNSIGNALED,
+    SYNCOBJ_SIGNALED,
+};
+
+static pthread_mutex_t syncobj_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t syncobj_once = PTHREAD_ONCE_INIT;
+static pthread_cond_t syncobj_cond;
+static uint8_t syncobjs[FAKE_MAX_SYNCOBJS];
+static int syncobj_fences[FAKE_MAX_SYNCOBJS];
+static uint8_t syncobj_imported[FAKE_MAX_SYNCOBJS];
+
+static void
+syncobj_init (void)
+{
+    pthread_condattr_t attr;
+    unsigned int i;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&syncobj_cond, &attr);
+    pthread_condattr_destroy(&attr);
+    for (i = 0; i < FAKE_MAX_SYNCOBJS; i++)
+        syncobj_fences[i] = -1;
+}
+
+/* Caller holds syncobj_lock. */
+static int
+syncobj_valid (const uint32_t *handles, uint32_t count)
+{
+    uint32_t i;
+
+    for (i = 0; i < count; i++)
+        if (handles[i] == 0 || handles[i] > FAKE_MAX_SYNCOBJS ||
+            syncobjs[handles[i] - 1] == SYNCOBJ_FREE)
+            return 0;
+    return 1;
+}
+
+/* Caller holds syncobj_lock. */
+static void
+syncobj_set_one (uint32_t idx, uint8_t state)
+{
+    if (syncobj_fences[idx] >= 0) {
+        if (state == SYNCOBJ_SIGNALED && !syncobj_imported[idx])
+            eventfd_write(syncobj_fences[idx], 1);
+        close(syncobj_fences[idx]);
+        syncobj_fences[idx] = -1;
+    }
+    syncobjs[idx] = state;
+}
+
+/*
+ * Caller holds syncobj_lock.  Also notices when an imported fence
+ * has signalled.
+ */
+static int
+syncobj_signaled (uint32_t idx)
+{
+    struct pollfd pfd;
+
+    if (syncobjs[idx] == SYNCOBJ_UNSIGNALED && syncobj_imported[idx] &&
+        syncobj_fences[idx] >= 0) {
+        pfd.fd = syncobj_fences[idx];
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, 0) > 0)
+            syncobj_set_one(idx, SYNCOBJ_SIGNALED);
+    }
+    return syncobjs[idx] == SYNCOBJ_SIGNALED;
+}
+
+static int
+fake_drmSyncobjCreate (int fd, uint32_t flags, uint32_t *handle)
+{
+    uint32_t i;
+
+    pthread_once(&syncobj_once, syncobj_init);
+    pthread_mutex_lock(&syncobj_lock);
+    for (i = 0; i < FAKE_MAX_SYNCOBJS && syncobjs[i] != SYNCOBJ_FREE; i++);
+    if (i == FAKE_MAX_SYNCOBJS) {
+        pthread_mutex_unlock(&syncobj_lock);
+        return -ENOMEM;
+    }
+    syncobjs[i] = (flags & DRM_SYNCOBJ_CREATE_SIGNALED) ? SYNCOBJ_SIGNALED : SYNCOBJ_UNSIGNALED;
+    pthread_mutex_unlock(&syncobj_lock);
+    *handle = i + 1;
+    return 0;
+}
+
+static int
+syncobj_set (const uint32_t *handles, uint32_t count, uint8_t state)
+{
+    uint32_t i;
+
+    pthread_once(&syncobj_once, syncobj_init);
+    pthread_mutex_lock(&syncobj_lock);
+    if (!syncobj_valid(handles, count)) {
+        pthread_mutex_unlock(&syncobj_lock);
+        return -ENOENT;
+    }
+    for (i = 0; i < count; i++)
+        syncobj_set_one(handles[i] - 1, state);
+    pthread_cond_broadcast(&syncobj_cond);
+    pthread_mutex_unlock(&syncobj_lock);
+    return 0;
+}
+
+static int
+fake_drmSyncobjDestroy (int fd, uint32_t handle)
+{
+    return syncobj_set(&handle, 1, SYNCOBJ_FREE);
+}
+
+static int
+fake_drmSyncobjSignal (int fd, const uint32_t *handles, uint32_t handle_count)
+{
+    return syncobj_set(handles, handle_count, SYNCOBJ_SIGNALED);
+}
+
+static int
+fake_drmSyncobjReset (int fd, const uint32_t *handles, uint32_t handle_count)
+{
+    return syncobj_set(handles, handle_count, SYNCOBJ_UNSIGNALED);
+}
+
+static int
+fake_drmSyncobjExportSyncFile (int fd, uint32_t handle, int *sync_file_fd)
+{
+    uint32_t idx = handle - 1;
+    int ret = 0;
+
+    pthread_once(&syncobj_once, syncobj_init);
+    pthread_mutex_lock(&syncobj_lock);
+    if (!syncobj_valid(&handle, 1))
+        ret = -ENOENT;
+    else if (syncobj_signaled(idx))
+        *sync_file_fd = eventfd(1, EFD_CLOEXEC);
+    else {
+        if (syncobj_fences[idx] < 0) {
+            syncobj_fences[idx] = eventfd(0, EFD_CLOEXEC);
+            syncobj_imported[idx] = 0;
+        }
+        *sync_file_fd = syncobj_fences[idx] < 0 ? -1 :
+            fcntl(syncobj_fences[idx], F_DUPFD_CLOEXEC, 0);
+    }
+    if (ret == 0 && *sync_file_fd < 0)
+        ret = -errno;
+    pthread_mutex_unlock(&syncobj_lock);
+    return ret;
+}
+
+static int
+fake_drmSyncobjImportSyncFile (int fd, uint32_t handle, int sync_file_fd)
+{
+    struct pollfd pfd = { .fd = sync_file_fd, .events = POLLIN };
+    uint32_t idx = handle - 1;
+    int fence, ret = 0;
+
+    pthread_once(&syncobj_once, syncobj_init);
+    pthread_mutex_lock(&syncobj_lock);
+    if (!syncobj_valid(&handle, 1))
+        ret = -ENOENT;
+    else if (poll(&pfd, 1, 0) > 0)
+        syncobj_set_one(idx, SYNCOBJ_SIGNALED);
+    else if ((fence = fcntl(sync_file_fd, F_DUPFD_CLOEXEC, 0)) < 0)
+        ret = -errno;
+    else {
+        syncobj_set_one(idx, SYNCOBJ_UNSIGNALED);
+        syncobj_fences[idx] = fence;
+        syncobj_imported[idx] = 1;
+    }
+    pthread_cond_broadcast(&syncobj_cond);
+    pthread_mutex_unlock(&syncobj_lock);
+    return ret;
+}
+
+/*
+ * The timeout is an absolute CLOCK_MONOTONIC time, as in the kernel.
+ * Imported fences cannot wake the condition variable, so while any
+ * is being waited on the wait rechecks every millisecond.
+ */
+static int
+fake_drmSyncobjWait (int fd, uint32_t *handles, unsigned num_handles,
+                     int64_t timeout_nsec, unsigned flags, uint32_t *first_signaled)
+{
+    struct timespec ts;
+    int64_t until;
+    unsigned int i, nsignaled, polling;
+    int first, ret = 0;
+
+    if (num_handles == 0)
+        return -EINVAL;
+    if (timeout_nsec < 0)
+        timeout_nsec = 0;
+    pthread_once(&syncobj_once, syncobj_init);
+    pthread_mutex_lock(&syncobj_lock);
+    for (;;) {
+        if (!syncobj_valid(handles, num_handles)) {
+            ret = -ENOENT;
+            break;
+        }
+        first = -1;
+        for (i = nsignaled = polling = 0; i < num_handles; i++) {
+            if (!syncobj_signaled(handles[i] - 1)) {
+                polling |= syncobj_imported[handles[i] - 1] && syncobj_fences[handles[i] - 1] >= 0;
+                continue;
+            }
+            nsignaled++;
+            if (first < 0)
+                first = i;
+        }
+        if ((flags & DRM_SYNCOBJ_WAIT_FLAGS_WAIT_ALL) ? nsignaled == num_handles : nsignaled > 0) {
+            if (first_signaled != NULL)
+                *first_signaled = first;
+            break;
+        }
+        until = timeout_nsec;
+        if (polling && (int64_t) shim_now_ns() + 1000000 < until)
+            until = (int64_t) shim_now_ns() + 1000000;
+        ts.tv_sec = until / 1000000000LL;
+        ts.tv_nsec = until % 1000000000LL;
+        if (pthread_cond_timedwait(&syncobj_cond, &syncobj_lock, &ts) == ETIMEDOUT &&
+            until == timeout_nsec) {
+            ret = -ETIME;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&syncobj_lock);
+    return ret;
+}
+
+static const struct {
+    const char *name;
+    void *fn;
+} fake_funcs[] = {
+    { "drmIoctl", fake_drmIoctl },
+    { "ioctl", fake_ioctl },
+    { "drmAvailable", fake_drmAvailable },
+    { "drmOpen", fake_drmOpen },
+    { "drmOpenWithType", fake_drmOpenWithType },
+    { "drmOpenRender", fake_drmOpenRender },
+    { "drmClose", fake_drmClose },
+    { "drmGetVersion", fake_drmGetVersion },
+    { "drmFreeVersion", fake_drmFreeVersion },
+    { "drmGetCap", fake_drmGetCap },
+    { "drmSetClientCap", fake_drmSetClientCap },
+    { "drmPrimeHandleToFD", fake_drmPrimeHandleToFD },
+    { "drmPrimeFDToHandle", fake_drmPrimeFDToHandle },
+    { "drmModeGetResources", fake_drmModeGetResources },
+    { "drmModeFreeResources", fake_drmModeFree },
+    { "drmModeGetCrtc", fake_drmModeGetCrtc },
+    { "drmModeFreeCrtc", fake_drmModeFree },
+    { "drmModeGetEncoder", fake_drmModeGetEncoder },
+    { "drmModeFreeEncoder", fake_drmModeFree },
+    { "drmModeGetConnector", fake_drmModeGetConnector },
+    { "drmModeFreeConnector", fake_drmModeFree },
+    { "drmModeGetPlaneResources", fake_drmModeGetPlaneResources },
+    { "drmModeFreePlaneResources", fake_drmModeFree },
+    { "drmModeGetPlane", fake_drmModeGetPlane },
+    { "drmModeFreePlane", fake_drmModeFree },
+    { "drmModeAddFB", fake_drmModeAddFB },
+    { "drmModeAddFB2", fake_drmModeAddFB2 },
+    { "drmModeRmFB", fake_drmModeRmFB },
+    { "drmModeSetCrtc", fake_drmModeSetCrtc },
+    { "drmModePageFlip", fake_drmModePageFlip },
+    { "drmSyncobjCreate", fake_drmSyncobjCreate },
+    { "drmSyncobjDestroy", fake_drmSyncobjDestroy },
+    { "drmSyncobjSignal", fake_drmSyncobjSignal },
+    { "drmSyncobjReset", fake_drmSyncobjReset },
+    { "drmSyncobjWait", fake_drmSyncobjWait },
+    { "drmSyncobjExportSyncFile", fake_drmSyncobjExportSyncFile },
+    { "drmSyncobjImportSyncFile", fake_drmSyncobjImportSyncFile },
+};
+
+void *
+shim_fake_lookup (const char *name)
+{
+    unsigned int i;
+
+    for (i = 0; i < sizeof(fake_funcs)/sizeof(fake_funcs[0]); i++)
+        if (strcmp(fake_funcs[i].name, name) == 0)
+            return fake_funcs[i].fn;
+    return NULL;
+}
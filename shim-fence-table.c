@@ -0,0 +1,184 @@
+/*
+ * shim-fence-table.c
+ *
+ * Fence completion table in shared memory.  Producers publish the
+ * sequence number of each fence as it completes, and consumers in
+ * other processes check it with an atomic load before polling the
+ * sync_file they were passed.
+ *
+ * Copyright (c) 2018-2019, Matthew Madison
+ * Distributed under license; see the LICENSE file for details.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "drm-shim.h"
+
+#define FENCE_TABLE_MAGIC	0x46534d44U	/* "DMSF" */
+#define FENCE_TABLE_VERSION	1
+
+/*
+ * The file is a header followed by one slot per producer timeline.
+ * Each slot has a cache line to itself, so producers publishing on
+ * different slots do not contend.
+ */
+struct fence_table_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t nslots;
+    uint32_t reserved[13];
+};
+
+struct fence_table_slot {
+    uint64_t seqno;
+    uint64_t reserved[7];
+};
+
+struct _drmShimFenceTable {
+    struct fence_table_header *header;
+    struct fence_table_slot *slots;
+    unsigned int nslots;
+    size_t size;
+};
+
+/*
+ * The first process to open the file sizes and initializes it,
+ * under an flock() so that concurrent openers wait for that.  Later
+ * opens take the slot count from the file; nslots may then be 0.
+ * A new file is readable and writable by its owner only.
+ */
+drmShimFenceTablePtr
+drmShimFenceTableOpen (const char *path, unsigned int nslots)
+{
+    struct fence_table_header hdr;
+    drmShimFenceTablePtr table;
+    struct stat st;
+    void *map;
+    size_t size;
+    int fd, err;
+
+    if (path == NULL) {
+        errno = EINVAL;
+        return NULL;
+    }
+    fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0)
+        return NULL;
+    if (flock(fd, LOCK_EX) < 0 || fstat(fd, &st) < 0)
+        goto fail;
+    if (st.st_size == 0) {
+        if (nslots == 0) {
+            errno = ENOENT;
+            goto fail;
+        }
+        size = sizeof(hdr) + (size_t) nslots * sizeof(struct fence_table_slot);
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.magic = FENCE_TABLE_MAGIC;
+        hdr.version = FENCE_TABLE_VERSION;
+        hdr.nslots = nslots;
+        if (ftruncate(fd, size) < 0 || pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+            goto fail;
+    } else {
+        if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+            hdr.magic != FENCE_TABLE_MAGIC || hdr.version != FENCE_TABLE_VERSION ||
+            hdr.nslots == 0 || hdr.nslots < nslots) {
+            errno = EINVAL;
+            goto fail;
+        }
+        size = sizeof(hdr) + (size_t) hdr.nslots * sizeof(struct fence_table_slot);
+        if ((size_t) st.st_size < size) {
+            errno = EINVAL;
+            goto fail;
+        }
+    }
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+        goto fail;
+    /* initialized, so the lock can go; the mapping outlives the fd */
+    flock(fd, LOCK_UN);
+    close(fd);
+    table = calloc(1, sizeof(*table));
+    if (table == NULL) {
+        munmap(map, size);
+        errno = ENOMEM;
+        return NULL;
+    }
+    table->header = map;
+    table->slots = (struct fence_table_slot *) (table->header + 1);
+    table->nslots = hdr.nslots;
+    table->size = size;
+    return table;
+
+  fail:
+    err = errno;
+    close(fd);
+    errno = err;
+    return NULL;
+}
+
+void
+drmShimFenceTableClose (drmShimFenceTablePtr table)
+{
+    if (table == NULL)
+        return;
+    munmap(table->header, table->size);
+    free(table);
+}
+
+unsigned int
+drmShimFenceTableSlots (drmShimFenceTablePtr table)
+{
+    return table != NULL ? table->nslots : 0;
+}
+
+/*
+ * Sequence numbers on a slot must complete in order; publishing a
+ * number lower than the one already there changes nothing.
+ */
+int
+drmShimFenceTablePublish (drmShimFenceTablePtr table, unsigned int slot, uint64_t seqno)
+{
+    uint64_t cur;
+
+    if (table == NULL || slot >= table->nslots) {
+        errno = EINVAL;
+        return -1;
+    }
+    cur = __atomic_load_n(&table->slots[slot].seqno, __ATOMIC_RELAXED);
+    while (cur < seqno &&
+           !__atomic_compare_exchange_n(&table->slots[slot].seqno, &cur, seqno, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    return 0;
+}
+
+int
+drmShimFenceTableSignaled (drmShimFenceTablePtr table, unsigned int slot, uint64_t seqno)
+{
+    if (table == NULL || slot >= table->nslots)
+        return 0;
+    return __atomic_load_n(&table->slots[slot].seqno, __ATOMIC_ACQUIRE) >= seqno;
+}
+
+/*
+ * Falls back to drmShimFenceWait() on the fence fd, and publishes
+ * the sequence number if that shows it has completed, so other
+ * consumers need not poll for it either.
+ */
+int
+drmShimFenceTableWait (drmShimFenceTablePtr table, unsigned int slot, uint64_t seqno,
+                       int fd, int timeout)
+{
+    if (drmShimFenceTableSignaled(table, slot, seqno))
+        return 0;
+    if (drmShimFenceWait(fd, timeout) < 0)
+        return -1;
+    if (table != NULL && slot < table->nslots)
+        drmShimFenceTablePublish(table, slot, seqno);
+    return 0;
+}
@@ -0,0 +1,327 @@
+/*
+ * shim-fence.c
+ *
+ * Fence helpers layered on libsync.h that avoid syscalls for
+ * fences already known to be signalled, and avoid merges that
+ * would not change the result.
+ *
+ * Copyright (c) 2018-2019, Matthew Madison
+ * Distributed under license; see the LICENSE file for details.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include "libsync.h"
+#include "drm-shim.h"
+#include "shim-private.h"
+
+/*
+ * A signalled fence stays signalled, so once a wait or poll has
+ * seen one signal, the answer can be remembered until the fd is
+ * closed.  Each thread keeps a small direct-mapped cache of fds it
+ * has seen signalled.  Since fd numbers are reused, every cache
+ * entry also records a generation from a global table that
+ * drmShimFenceClose() and drmShimFenceForget() bump, so a close on
+ * any thread invalidates every thread's entry for that fd.  Fds
+ * that hash to the same generation slot only cause extra misses.
+ */
+#define FENCE_CACHE_SIZE	64
+#define FENCE_GEN_SIZE		1024
+
+/* key is fd + 1, so a zeroed entry is empty */
+struct fence_entry {
+    int key;
+    uint32_t gen;
+};
+
+struct fence_cache {
+    struct fence_entry entries[FENCE_CACHE_SIZE];
+};
+
+static uint32_t fence_gen[FENCE_GEN_SIZE];
+static struct shim_wait_est fence_est;
+static __thread struct fence_cache thread_cache;
+
+/*
+ * Taken once per call, since each access to a __thread variable
+ * in a shared library can cost a call to __tls_get_addr.  Kept out
+ * of line so the compiler cannot turn the pointer back into
+ * per-access TLS lookups in the helpers.
+ */
+static __attribute__((noinline)) struct fence_cache *
+my_cache (void)
+{
+    return &thread_cache;
+}
+
+static inline uint32_t
+gen_of (int fd)
+{
+    return __atomic_load_n(&fence_gen[(unsigned int) fd % FENCE_GEN_SIZE], __ATOMIC_ACQUIRE);
+}
+
+static inline int
+cache_lookup (struct fence_cache *fc, int fd)
+{
+    struct fence_entry *e = &fc->entries[(unsigned int) fd % FENCE_CACHE_SIZE];
+
+    return e->key == fd + 1 && e->gen == gen_of(fd);
+}
+
+/*
+ * The generation is read before the fence is polled.
+ * drmShimFenceClose() bumps it both before and after close(), as a
+ * seqlock writer would, so a poll that overlaps the close in any way,
+ * even one that reads the first bump and then polls the fd's next
+ * file, is stored under a generation that is already stale.
+ */
+static inline void
+cache_insert (struct fence_cache *fc, int fd, uint32_t gen)
+{
+    struct fence_entry *e = &fc->entries[(unsigned int) fd % FENCE_CACHE_SIZE];
+
+    e->key = fd + 1;
+    e->gen = gen;
+}
+
+int
+drmShimFenceSignaled (int fd)
+{
+    struct fence_cache *fc = my_cache();
+    struct pollfd pfd;
+    uint32_t gen;
+    int ret;
+
+    if (fd < 0 || cache_lookup(fc, fd))
+        return 1;
+    gen = gen_of(fd);
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    do {
+        ret = poll(&pfd, 1, 0);
+    } while (ret < 0 && (errno == EINTR || errno == EAGAIN));
+    if (ret < 0)
+        return -errno;
+    if (ret == 0)
+        return 0;
+    if (pfd.revents & (POLLERR | POLLNVAL))
+        return -EINVAL;
+    cache_insert(fc, fd, gen);
+    return 1;
+}
+
+static int
+check_fence (void *arg)
+{
+    return drmShimFenceSignaled(*(int *) arg);
+}
+
+/*
+ * Fences have no identity beyond their fd, so all fence waits
+ * share one completion-time estimate for the wait policy.
+ */
+int
+drmShimFenceWait (int fd, int timeout)
+{
+    struct fence_cache *fc = my_cache();
+    uint64_t start, budget;
+    uint32_t gen;
+    int ret;
+
+    if (fd < 0 || cache_lookup(fc, fd))
+        return 0;
+    start = shim_now_ns();
+    budget = timeout == 0 ? 0 : shim_wait_budget(&fence_est);
+    if (timeout > 0 && budget > (uint64_t) timeout * 1000000ULL)
+        budget = (uint64_t) timeout * 1000000ULL;
+    if (budget != 0) {
+        ret = shim_wait_spin(budget, check_fence, &fd);
+        if (ret < 0) {
+            errno = -ret;
+            return -1;
+        }
+        if (ret > 0) {
+            shim_wait_observe(&fence_est, shim_now_ns() - start);
+            return 0;
+        }
+        if (timeout > 0) {
+            uint64_t spun = (shim_now_ns() - start) / 1000000ULL;
+            timeout = spun >= (uint64_t) timeout ? 0 : timeout - (int) spun;
+        }
+    }
+    gen = gen_of(fd);
+    if (sync_wait(fd, timeout) < 0)
+        return -1;
+    cache_insert(fc, fd, gen);
+    shim_wait_observe(&fence_est, shim_now_ns() - start);
+    return 0;
+}
+
+/*
+ * Compacts fds[] into out[], dropping negative fds, fds known to be
+ * signalled, and duplicates.  Returns the number kept; *signalled
+ * is set to one of the dropped signalled fds, or -1.
+ */
+static unsigned int
+fence_filter (struct fence_cache *fc, const int *fds, unsigned int count, int *out, int *signalled)
+{
+    unsigned int i, j, n = 0;
+
+    *signalled = -1;
+    for (i = 0; i < count; i++) {
+        if (fds[i] < 0)
+            continue;
+        if (cache_lookup(fc, fds[i])) {
+            *signalled = fds[i];
+            continue;
+        }
+        for (j = 0; j < n && out[j] != fds[i]; j++);
+        if (j == n)
+            out[n++] = fds[i];
+    }
+    return n;
+}
+
+int
+drmShimFenceWaitMany (const int *fds, unsigned int count, int timeout,
+                      int flags, unsigned int *first)
+{
+    struct fence_cache *fc = my_cache();
+    int stackfds[SYNC_WAIT_STACK_FDS];
+    uint32_t stackgens[SYNC_WAIT_STACK_FDS];
+    int *pending = stackfds;
+    uint32_t *gens = stackgens;
+    unsigned int i, n, which = count;
+    int signalled, ret;
+
+    if (!(flags & SYNC_WAIT_ALL)) {
+        for (i = 0; i < count; i++) {
+            if (fds[i] < 0 || cache_lookup(fc, fds[i])) {
+                if (first != NULL)
+                    *first = i;
+                return 0;
+            }
+        }
+    }
+    if (count > SYNC_WAIT_STACK_FDS) {
+        pending = malloc(count * (sizeof(*pending) + sizeof(*gens)));
+        if (pending == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        gens = (uint32_t *) (pending + count);
+    }
+    if (flags & SYNC_WAIT_ALL) {
+        n = fence_filter(fc, fds, count, pending, &signalled);
+    } else {
+        memcpy(pending, fds, count * sizeof(*pending));
+        n = count;
+    }
+    for (i = 0; i < n; i++)
+        gens[i] = gen_of(pending[i]);
+
+    ret = sync_wait_many(pending, n, timeout, flags, &which);
+    if (ret == 0 && (flags & SYNC_WAIT_ALL)) {
+        for (i = 0; i < n; i++)
+            cache_insert(fc, pending[i], gens[i]);
+    } else if (ret == 0 && which < n) {
+        cache_insert(fc, pending[which], gens[which]);
+        if (first != NULL)
+            *first = which;
+    }
+    if (pending != stackfds)
+        free(pending);
+    return ret;
+}
+
+/*
+ * Fences known to be signalled add nothing to a merge, so they
+ * and any duplicates are dropped first.  If that leaves one fence
+ * it is simply dup()ed; if it leaves none, one of the signalled
+ * inputs is.
+ */
+int
+drmShimFenceMerge (const char *name, const int *fds, unsigned int count)
+{
+    struct fence_cache *fc = my_cache();
+    int stackfds[SYNC_WAIT_STACK_FDS];
+    int *keep = stackfds;
+    unsigned int n;
+    int signalled, ret;
+
+    if (count > SYNC_WAIT_STACK_FDS) {
+        keep = malloc(count * sizeof(*keep));
+        if (keep == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+    n = fence_filter(fc, fds, count, keep, &signalled);
+    if (n == 0 && signalled >= 0)
+        ret = dup(signalled);
+    else
+        ret = sync_merge_many(name, keep, n);
+    if (keep != stackfds)
+        free(keep);
+    return ret;
+}
+
+/*
+ * Like sync_accumulate(), but skips the merge when fd2 is already
+ * in *fd1 or is known to be signalled, and replaces *fd1 instead of
+ * merging when *fd1 is known to be signalled.
+ */
+int
+drmShimFenceAccumulate (const char *name, int *fd1, int fd2)
+{
+    struct fence_cache *fc = my_cache();
+    int ret;
+
+    if (fd2 < 0 || fd2 == *fd1 || (*fd1 >= 0 && cache_lookup(fc, fd2)))
+        return 0;
+    if (*fd1 >= 0 && cache_lookup(fc, *fd1)) {
+        ret = dup(fd2);
+        if (ret < 0)
+            return ret;
+        drmShimFenceClose(*fd1);
+        *fd1 = ret;
+        return 0;
+    }
+    if (*fd1 < 0) {
+        ret = dup(fd2);
+        if (ret < 0)
+            return ret;
+        *fd1 = ret;
+        return 0;
+    }
+    ret = sync_merge(name, *fd1, fd2);
+    if (ret < 0)
+        return ret;
+    drmShimFenceClose(*fd1);
+    *fd1 = ret;
+    return 0;
+}
+
+void
+drmShimFenceForget (int fd)
+{
+    if (fd >= 0)
+        __atomic_fetch_add(&fence_gen[(unsigned int) fd % FENCE_GEN_SIZE], 1, __ATOMIC_RELEASE);
+}
+
+int
+drmShimFenceClose (int fd)
+{
+    int ret;
+
+    if (fd < 0)
+        return 0;
+    drmShimFenceForget(fd);
+    ret = close(fd);
+    drmShimFenceForget(fd);
+    return ret;
+}
@@ -0,0 +1,329 @@
+/*
+ * shim-ioctl.c
+ *
+ * Shim-side processing of drmIoctl calls.  When any of the
+ * features here are enabled, the drmIoctl dispatch pointer is
+ * routed through shim_ioctl(), which calls on to the function
+ * that would otherwise have been used.
+ *
+ * Copyright (c) 2018-2019, Matthew Madison
+ * Distributed under license; see the LICENSE file for details.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "xf86drm.h"
+#include "tegra_drm.h"
+#include "shim-private.h"
+#include "config.h"
+
+#ifndef KCMP_FILE
+#define KCMP_FILE 0
+#endif
+
+static int (*next_ioctl)(int fd, unsigned long request, void *arg);
+
+#ifdef SHIM_INSTRUMENTATION
+/*
+ * ioctl tracer.  Enabled by setting DRM_SHIM_IOCTL_TRACE to the
+ * path of a trace file, which must not already exist ("%p" in the
+ * path is replaced by the process ID).  It is mapped shared and
+ * holds:
+ *
+ *   - a header
+ *   - one summary slot per ioctl number (DRM_IOCTL_NR), with
+ *     count, total and maximum time
+ *   - a ring of the most recent calls
+ *
+ * The file is updated in place with atomic operations, so it can
+ * be decoded with tools/ioctl-trace-decode.py after the process
+ * exits, or while it is still running.  The ring size is set with
+ * DRM_SHIM_IOCTL_TRACE_EVENTS (rounded up to a power of two).
+ */
+#define TRACE_MAGIC		"DRMIOTR1"
+#define TRACE_VERSION		1
+#define TRACE_SLOTS		256
+#define TRACE_DEFAULT_EVENTS	65536
+
+struct trace_header {
+    char     magic[8];
+    uint32_t version;
+    uint32_t nslots;
+    uint32_t nevents;
+    uint32_t pad;
+    uint64_t start_ns;
+    uint64_t event_head;
+};
+
+struct trace_slot {
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint32_t request;
+    uint32_t errors;
+};
+
+/*
+ * seq is written last, as the event's index plus one, so that a
+ * reader can tell a complete entry from one being overwritten.
+ */
+struct trace_event {
+    uint64_t seq;
+    uint64_t start_ns;
+    uint32_t duration_ns;
+    uint32_t request;
+    int32_t  result;
+    uint32_t tid;
+};
+
+static struct trace_header *trace_hdr;
+static struct trace_slot *trace_slots;
+static struct trace_event *trace_ring;
+static uint32_t trace_mask;
+static __thread uint32_t trace_tid;
+
+static void
+ioctl_trace_record (unsigned long request, uint64_t start, uint64_t elapsed, int result)
+{
+    struct trace_slot *slot = &trace_slots[DRM_IOCTL_NR(request)];
+    struct trace_event *ev;
+    uint64_t max, idx;
+
+    __atomic_fetch_add(&slot->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&slot->total_ns, elapsed, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->request, (uint32_t) request, __ATOMIC_RELAXED);
+    if (result < 0)
+        __atomic_fetch_add(&slot->errors, 1, __ATOMIC_RELAXED);
+    max = __atomic_load_n(&slot->max_ns, __ATOMIC_RELAXED);
+    while (elapsed > max &&
+           !__atomic_compare_exchange_n(&slot->max_ns, &max, elapsed, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    if (trace_tid == 0)
+        trace_tid = (uint32_t) syscall(SYS_gettid);
+    idx = __atomic_fetch_add(&trace_hdr->event_head, 1, __ATOMIC_RELAXED);
+    ev = &trace_ring[idx & trace_mask];
+    __atomic_store_n(&ev->seq, 0, __ATOMIC_RELAXED);
+    ev->start_ns = start - trace_hdr->start_ns;
+    ev->duration_ns = elapsed > UINT32_MAX ? UINT32_MAX : (uint32_t) elapsed;
+    ev->request = (uint32_t) request;
+    ev->result = result;
+    ev->tid = trace_tid;
+    __atomic_store_n(&ev->seq, idx + 1, __ATOMIC_RELEASE);
+}
+
+int
+shim_trace_open (const char *path, int flags)
+{
+    char buf[PATH_MAX];
+    size_t len = 0;
+    int n;
+
+    for (; *path != '\0'; path++) {
+        if (path[0] == '%' && path[1] == 'p') {
+            n = snprintf(buf + len, sizeof(buf) - len, "%ld", (long) getpid());
+            if (n < 0 || (size_t) n >= sizeof(buf) - len)
+                return -1;
+            len += (size_t) n;
+            path++;
+        } else {
+            if (len + 1 >= sizeof(buf))
+                return -1;
+            buf[len++] = *path;
+        }
+    }
+    buf[len] = '\0';
+    return open(buf, flags|O_CLOEXEC, 0644);
+}
+
+static void __attribute__((constructor(101)))
+ioctl_trace_init (void)
+{
+    const char *path = getenv("DRM_SHIM_IOCTL_TRACE");
+    const char *env;
+    uint32_t nevents = TRACE_DEFAULT_EVENTS;
+    size_t size;
+    void *map;
+    int fd;
+
+    if (path == NULL || *path == '\0')
+        return;
+    env = getenv("DRM_SHIM_IOCTL_TRACE_EVENTS");
+    if (env != NULL) {
+        unsigned long val = strtoul(env, NULL, 0);
+        if (val > 0 && val <= (1UL << 24)) {
+            nevents = 1;
+            while (nevents < val)
+                nevents <<= 1;
+        }
+    }
+    size = sizeof(struct trace_header) + TRACE_SLOTS * sizeof(struct trace_slot) +
+        nevents * sizeof(struct trace_event);
+    fd = shim_trace_open(path, O_RDWR|O_CREAT|O_EXCL);
+    if (fd < 0)
+        return;
+    if (ftruncate(fd, size) < 0) {
+        close(fd);
+        return;
+    }
+    map = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return;
+    trace_hdr = map;
+    trace_slots = (struct trace_slot *) (trace_hdr + 1);
+    trace_ring = (struct trace_event *) (trace_slots + TRACE_SLOTS);
+    trace_mask = nevents - 1;
+    memcpy(trace_hdr->magic, TRACE_MAGIC, sizeof(trace_hdr->magic));
+    trace_hdr->version = TRACE_VERSION;
+    trace_hdr->nslots = TRACE_SLOTS;
+    trace_hdr->nevents = nevents;
+    trace_hdr->start_ns = shim_now_ns();
+}
+#endif /* SHIM_INSTRUMENTATION */
+
+/* Passes a call on, traced if tracing is on. */
+int
+shim_ioctl_forward (int fd, unsigned long request, void *arg)
+{
+#ifdef SHIM_INSTRUMENTATION
+    if (trace_hdr != NULL) {
+        uint64_t start = shim_now_ns();
+        int ret = next_ioctl(fd, request, arg);
+        int saved_errno = errno;
+        ioctl_trace_record(request, start, shim_now_ns() - start,
+                           ret < 0 ? -saved_errno : ret);
+        errno = saved_errno;
+        return ret;
+    }
+#endif
+    return next_ioctl(fd, request, arg);
+}
+
+/*
+ * Requests the PRIME import cache (shim-prime.c), mapping cache
+ * (shim-mmap.c) or BO cache (shim-bo.c) handle, or need to see, are
+ * routed to them; everything else goes straight on.  A GEM close
+ * the import cache keeps goes no further; otherwise it drops the
+ * mapping before the BO cache gets to park or free the object.
+ */
+static int
+shim_ioctl (int fd, unsigned long request, void *arg)
+{
+    if (shim_prime_tracking()) {
+        if (request == DRM_IOCTL_PRIME_FD_TO_HANDLE && shim_prime_enabled())
+            return shim_prime_import(fd, arg);
+        if (request == DRM_IOCTL_GEM_CLOSE &&
+            shim_prime_close(fd, ((struct drm_gem_close *) arg)->handle))
+            return 0;
+    }
+    if (shim_mmap_tracking()) {
+        if (request == DRM_IOCTL_TEGRA_GEM_MMAP && shim_mmap_enabled())
+            return shim_mmap_offset(fd, arg);
+        if (request == DRM_IOCTL_GEM_CLOSE)
+            shim_mmap_forget(fd, ((struct drm_gem_close *) arg)->handle);
+    }
+    if (shim_bo_enabled()) {
+        switch (request) {
+        case DRM_IOCTL_TEGRA_GEM_CREATE:
+            return shim_bo_create(fd, arg);
+        case DRM_IOCTL_GEM_CLOSE:
+            return shim_bo_close(fd, arg);
+        case DRM_IOCTL_TEGRA_SUBMIT:
+            return shim_bo_submit(fd, arg);
+        case DRM_IOCTL_TEGRA_GEM_SET_TILING:
+            shim_bo_modified(fd, ((struct drm_tegra_gem_set_tiling *) arg)->handle, 1);
+            break;
+        case DRM_IOCTL_TEGRA_GEM_SET_FLAGS:
+            shim_bo_modified(fd, ((struct drm_tegra_gem_set_flags *) arg)->handle, 0);
+            break;
+        case DRM_IOCTL_GEM_FLINK:
+            shim_bo_modified(fd, ((struct drm_gem_flink *) arg)->handle, 0);
+            break;
+        case DRM_IOCTL_PRIME_HANDLE_TO_FD:
+            shim_bo_modified(fd, ((struct drm_prime_handle *) arg)->handle, 0);
+            break;
+        }
+    }
+    return shim_ioctl_forward(fd, request, arg);
+}
+
+void *
+shim_ioctl_interpose (void *fn)
+{
+    int active = shim_bo_enabled() || shim_mmap_tracking() || shim_prime_tracking();
+
+#ifdef SHIM_INSTRUMENTATION
+    active |= (trace_hdr != NULL);
+#endif
+    if (fn == NULL || !active)
+        return fn;
+    next_ioctl = fn;
+    return shim_ioctl;
+}
+
+static int (*next_close)(int fd);
+
+static int
+shim_close (int fd)
+{
+    shim_prime_forget_fd(fd);
+    shim_mmap_forget_fd(fd);
+    shim_bo_forget_fd(fd);
+    shim_syncobj_forget_fd(fd);
+    shim_timeline_forget_fd(fd);
+    return next_close(fd);
+}
+
+void *
+shim_ioctl_close_interpose (void *fn, int timelines)
+{
+    if (fn == NULL || !(shim_bo_enabled() || shim_mmap_tracking() || shim_prime_tracking() ||
+                        shim_syncobj_enabled() || timelines))
+        return fn;
+    next_close = fn;
+    return shim_close;
+}
+
+static int file_tracking = -1;
+
+/* kcmp() on two bad fds fails with EBADF if it is there at all. */
+int
+shim_file_tracking (void)
+{
+    int on = __atomic_load_n(&file_tracking, __ATOMIC_RELAXED);
+    int saved_errno;
+
+    if (on < 0) {
+        saved_errno = errno;
+        on = !(syscall(SYS_kcmp, getpid(), getpid(), KCMP_FILE, -1, -1) < 0 &&
+               (errno == ENOSYS || errno == EPERM));
+        errno = saved_errno;
+        __atomic_store_n(&file_tracking, on, __ATOMIC_RELAXED);
+    }
+    return on;
+}
+
+int
+shim_file_hold (int fd)
+{
+    return fcntl(fd, F_DUPFD_CLOEXEC, 0);
+}
+
+int
+shim_file_same (int fd, int held)
+{
+    pid_t pid;
+
+    if (!shim_file_tracking())
+        return 1;
+    pid = getpid();
+    return syscall(SYS_kcmp, pid, pid, KCMP_FILE, fd, held) == 0;
+}
@@ -0,0 +1,447 @@
+/*
+ * shim-mmap.c
+ *
+ * Cache of CPU mappings of Tegra GEM objects.  drmShimBoMap() hands
+ * out a reference to a handle's mapping, creating it on first use,
+ * and drmShimBoUnmap() drops the reference.  The GEM close and
+ * drmClose() hooks are in place whenever files can be tracked, so
+ * the table follows its handles with the cache on or off.  With
+ * DRM_SHIM_MMAP_CACHE
+ * set, unreferenced mappings are kept until the handle is closed or
+ * they are evicted to keep the mapped address space under the cap,
+ * and DRM_IOCTL_TEGRA_GEM_MMAP offsets are answered from the table.
+ *
+ * Copyright (c) 2018-2019, Matthew Madison
+ * Distributed under license; see the LICENSE file for details.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "xf86drm.h"
+#include "tegra_drm.h"
+#include "drm-shim.h"
+#include "shim-private.h"
+
+#define MM_PAGE_SIZE	4096ULL
+
+/*
+ * Unreferenced mappings are on the LRU list, most recently released
+ * first, so eviction takes the one least recently used.  A mapping
+ * still referenced when its handle or fd is closed is taken out of
+ * the table and put on the orphan list, found again by its address,
+ * until its last reference is dropped.
+ */
+struct mm_entry {
+    struct mm_entry *lru_next, *lru_prev;
+    struct mm_fd *owner;
+    uint32_t handle;
+    int has_offset;
+    uint64_t offset;
+    void *ptr;
+    uint64_t size;
+    unsigned int refs;
+};
+
+/* Per-fd state, for the open file held names (see shim_file_hold()). */
+struct mm_fd {
+    struct mm_fd *next;
+    int fd;
+    int held;
+    struct mm_entry **entries;
+    uint32_t nentries;
+};
+
+static pthread_mutex_t mm_lock = PTHREAD_MUTEX_INITIALIZER;
+static int mm_cache_on;
+static uint64_t mm_max_bytes;
+static struct mm_fd *mm_fds;
+static struct mm_entry mm_lru = { &mm_lru, &mm_lru };
+static struct mm_entry mm_orphans = { &mm_orphans, &mm_orphans };
+static drmShimMmapCacheStats mm_stats;
+
+/*
+ * DRM_SHIM_MMAP_CACHE is the most address space, in MiB, the cache
+ * may keep mapped; unset or 0 disables it.  Read before the dispatch
+ * pointers are bound, so the ioctl hook can be put in place.
+ */
+static void __attribute__((constructor(101)))
+shim_mmap_init (void)
+{
+    const char *env = getenv("DRM_SHIM_MMAP_CACHE");
+    unsigned long val;
+
+    if (env == NULL || (val = strtoul(env, NULL, 0)) == 0 || !shim_file_tracking())
+        return;
+    mm_max_bytes = (uint64_t) val << 20;
+    mm_cache_on = 1;
+}
+
+int
+shim_mmap_enabled (void)
+{
+    return mm_cache_on;
+}
+
+int
+shim_mmap_tracking (void)
+{
+    return shim_file_tracking();
+}
+
+static inline void
+lru_add (struct mm_entry *e)
+{
+    e->lru_next = mm_lru.lru_next;
+    e->lru_prev = &mm_lru;
+    mm_lru.lru_next->lru_prev = e;
+    mm_lru.lru_next = e;
+}
+
+static inline void
+lru_del (struct mm_entry *e)
+{
+    e->lru_prev->lru_next = e->lru_next;
+    e->lru_next->lru_prev = e->lru_prev;
+}
+
+static void mm_detach(struct mm_entry *e);
+
+/* Called with mm_lock held. */
+static void
+mm_fd_free (struct mm_fd **mp)
+{
+    struct mm_fd *mf = *mp;
+    uint32_t i;
+
+    *mp = mf->next;
+    for (i = 0; i < mf->nentries; i++)
+        if (mf->entries[i] != NULL)
+            mm_detach(mf->entries[i]);
+    close(mf->held);
+    free(mf->entries);
+    free(mf);
+}
+
+/*
+ * As for the BO cache, state whose fd number has been reused for
+ * another file is dropped when found, and all of it is checked
+ * before state for a new fd is made.  Called with mm_lock held.
+ */
+static struct mm_fd *
+mm_fd_find (int fd, int create)
+{
+    struct mm_fd **mp, *mf;
+
+    for (mp = &mm_fds; (mf = *mp) != NULL; mp = &mf->next)
+        if (mf->fd == fd) {
+            if (shim_file_same(fd, mf->held))
+                return mf;
+            mm_fd_free(mp);
+            break;
+        }
+    if (!create)
+        return NULL;
+    for (mp = &mm_fds; (mf = *mp) != NULL; )
+        if (!shim_file_same(mf->fd, mf->held))
+            mm_fd_free(mp);
+        else
+            mp = &mf->next;
+    if ((mf = calloc(1, sizeof(*mf))) == NULL)
+        return NULL;
+    mf->held = shim_file_hold(fd);
+    if (mf->held < 0) {
+        free(mf);
+        return NULL;
+    }
+    mf->fd = fd;
+    mf->next = mm_fds;
+    mm_fds = mf;
+    return mf;
+}
+
+/* Called with mm_lock held. */
+static struct mm_entry *
+mm_find (int fd, uint32_t handle, int create)
+{
+    struct mm_entry **tbl, *e;
+    struct mm_fd *mf;
+    uint32_t n;
+
+    mf = mm_fd_find(fd, create);
+    if (mf == NULL)
+        return NULL;
+    if (handle < mf->nentries && mf->entries[handle] != NULL)
+        return mf->entries[handle];
+    if (!create)
+        return NULL;
+    if (handle >= mf->nentries) {
+        for (n = mf->nentries ? mf->nentries : 256; n <= handle; n *= 2);
+        tbl = realloc(mf->entries, n * sizeof(*tbl));
+        if (tbl == NULL)
+            return NULL;
+        memset(tbl + mf->nentries, 0, (n - mf->nentries) * sizeof(*tbl));
+        mf->entries = tbl;
+        mf->nentries = n;
+    }
+    e = calloc(1, sizeof(*e));
+    if (e == NULL)
+        return NULL;
+    e->owner = mf;
+    e->handle = handle;
+    mf->entries[handle] = e;
+    return e;
+}
+
+/* Unmaps an entry's mapping, if it has one.  Called with mm_lock held. */
+static void
+mm_unmap (struct mm_entry *e)
+{
+    if (e->ptr == NULL)
+        return;
+    if (e->refs == 0 && mm_cache_on)
+        lru_del(e);
+    munmap(e->ptr, e->size);
+    mm_stats.munmaps++;
+    mm_stats.bytes_mapped -= e->size;
+    e->ptr = NULL;
+    e->size = 0;
+    e->refs = 0;
+}
+
+/* Called with mm_lock held. */
+static void
+mm_free (struct mm_entry *e)
+{
+    mm_unmap(e);
+    e->owner->entries[e->handle] = NULL;
+    free(e);
+}
+
+/*
+ * Takes an entry out of the table when its handle or fd goes away.
+ * A referenced mapping stays mapped, as an orphan, for the last
+ * drmShimBoUnmap() to unmap.  Called with mm_lock held.
+ */
+static void
+mm_detach (struct mm_entry *e)
+{
+    if (e->ptr == NULL || e->refs == 0) {
+        mm_free(e);
+        return;
+    }
+    e->owner->entries[e->handle] = NULL;
+    e->owner = NULL;
+    e->lru_next = &mm_orphans;
+    e->lru_prev = mm_orphans.lru_prev;
+    mm_orphans.lru_prev->lru_next = e;
+    mm_orphans.lru_prev = e;
+}
+
+/* Unmaps the least recently used mappings while over the cap.  Called with mm_lock held. */
+static void
+mm_evict (void)
+{
+    while (mm_stats.bytes_mapped > mm_max_bytes && mm_lru.lru_prev != &mm_lru) {
+        mm_unmap(mm_lru.lru_prev);
+        mm_stats.evictions++;
+    }
+}
+
+/*
+ * With the cache on, the offset comes from the table, or from the
+ * driver without going back through the ioctl hook.  Called with
+ * mm_lock held.
+ */
+static int
+mm_get_offset (int fd, struct mm_entry *e)
+{
+    struct drm_tegra_gem_mmap args;
+    int ret;
+
+    if (e->has_offset) {
+        mm_stats.offset_hits++;
+        return 0;
+    }
+    memset(&args, 0, sizeof(args));
+    args.handle = e->handle;
+    if (mm_cache_on)
+        ret = shim_ioctl_forward(fd, DRM_IOCTL_TEGRA_GEM_MMAP, &args);
+    else
+        ret = drmIoctl(fd, DRM_IOCTL_TEGRA_GEM_MMAP, &args);
+    if (ret < 0)
+        return -errno;
+    e->offset = args.offset;
+    e->has_offset = 1;
+    return 0;
+}
+
+int
+shim_mmap_offset (int fd, void *arg)
+{
+    struct drm_tegra_gem_mmap *args = arg;
+    struct mm_entry *e;
+    int ret;
+
+    pthread_mutex_lock(&mm_lock);
+    e = mm_find(fd, args->handle, 1);
+    if (e == NULL) {
+        pthread_mutex_unlock(&mm_lock);
+        return shim_ioctl_forward(fd, DRM_IOCTL_TEGRA_GEM_MMAP, args);
+    }
+    ret = mm_get_offset(fd, e);
+    if (ret == 0)
+        args->offset = e->offset;
+    pthread_mutex_unlock(&mm_lock);
+    if (ret < 0) {
+        errno = -ret;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * The handle is going away, so its offset is no longer valid.  An
+ * unreferenced mapping of it is unmapped; a referenced one is kept
+ * until its last reference is dropped.
+ */
+void
+shim_mmap_forget (int fd, uint32_t handle)
+{
+    struct mm_entry *e;
+
+    pthread_mutex_lock(&mm_lock);
+    e = mm_find(fd, handle, 0);
+    if (e != NULL)
+        mm_detach(e);
+    pthread_mutex_unlock(&mm_lock);
+}
+
+void
+shim_mmap_forget_fd (int fd)
+{
+    struct mm_fd **mp, *mf;
+
+    pthread_mutex_lock(&mm_lock);
+    for (mp = &mm_fds; (mf = *mp) != NULL; mp = &mf->next)
+        if (mf->fd == fd) {
+            mm_fd_free(mp);
+            break;
+        }
+    pthread_mutex_unlock(&mm_lock);
+}
+
+/*
+ * A mapping smaller than the size asked for is replaced, if no one
+ * holds a reference to it.
+ */
+int
+drmShimBoMap (int fd, uint32_t handle, uint64_t size, void **ptr)
+{
+    struct mm_entry *e;
+    void *map;
+    int ret;
+
+    if (ptr == NULL || size == 0)
+        return -EINVAL;
+    if (!shim_mmap_tracking())
+        return -ENOSYS;
+    size = (size + MM_PAGE_SIZE - 1) & ~(MM_PAGE_SIZE - 1);
+    pthread_mutex_lock(&mm_lock);
+    mm_stats.maps++;
+    e = mm_find(fd, handle, 1);
+    if (e == NULL) {
+        ret = -ENOMEM;
+        goto out;
+    }
+    if (e->ptr != NULL && e->size >= size) {
+        if (e->refs++ == 0)
+            lru_del(e);
+        mm_stats.hits++;
+        *ptr = e->ptr;
+        ret = 0;
+        goto out;
+    }
+    if (e->refs > 0) {
+        ret = -EBUSY;
+        goto out;
+    }
+    mm_unmap(e);
+    ret = mm_get_offset(fd, e);
+    if (ret < 0)
+        goto out;
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, (off_t) e->offset);
+    if (map == MAP_FAILED) {
+        ret = -errno;
+        goto out;
+    }
+    mm_stats.mmaps++;
+    mm_stats.bytes_mapped += size;
+    e->ptr = map;
+    e->size = size;
+    e->refs = 1;
+    *ptr = map;
+    if (mm_cache_on)
+        mm_evict();
+  out:
+    if (ret < 0 && e != NULL && e->ptr == NULL && !(mm_cache_on && e->has_offset))
+        mm_free(e);
+    pthread_mutex_unlock(&mm_lock);
+    return ret;
+}
+
+/*
+ * With the cache off, the mapping goes when the last reference
+ * does.  A pointer that is not the handle's current mapping is
+ * looked for among the orphans, which the handle number may no
+ * longer name.
+ */
+int
+drmShimBoUnmap (int fd, uint32_t handle, void *ptr)
+{
+    struct mm_entry *e;
+    int ret = 0;
+
+    if (ptr == NULL)
+        return -EINVAL;
+    pthread_mutex_lock(&mm_lock);
+    e = mm_find(fd, handle, 0);
+    if (e == NULL || e->ptr != ptr) {
+        for (e = mm_orphans.lru_next; e != &mm_orphans; e = e->lru_next)
+            if (e->ptr == ptr) {
+                if (--e->refs == 0) {
+                    lru_del(e);
+                    munmap(e->ptr, e->size);
+                    mm_stats.munmaps++;
+                    mm_stats.bytes_mapped -= e->size;
+                    free(e);
+                }
+                pthread_mutex_unlock(&mm_lock);
+                return 0;
+            }
+        ret = -EINVAL;
+    } else if (e->refs == 0)
+        ret = -EINVAL;
+    else if (--e->refs == 0) {
+        if (mm_cache_on) {
+            lru_add(e);
+            mm_evict();
+        } else
+            mm_free(e);
+    }
+    pthread_mutex_unlock(&mm_lock);
+    return ret;
+}
+
+void
+drmShimMmapCacheGetStats (drmShimMmapCacheStats *stats)
+{
+    if (stats == NULL)
+        return;
+    pthread_mutex_lock(&mm_lock);
+    *stats = mm_stats;
+    pthread_mutex_unlock(&mm_lock);
+}
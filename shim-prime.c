@@ -0,0 +1,496 @@
+/*
+ * shim-prime.c
+ *
+ * Cache of PRIME imports.  With DRM_SHIM_PRIME_CACHE set, importing
+ * a dma-buf that is already imported on the same DRM fd returns the
+ * existing GEM handle without an ioctl.  As with the kernel, one GEM
+ * close releases the handle however many times it was imported;
+ * released handles are kept, up to the configured number, for the
+ * next import of the same buffer.  drmShimPrimeImport() and
+ * drmShimPrimeRelease() count references instead, for callers that
+ * share imports; the GEM close and drmClose() hooks are in place
+ * for them whenever files can be tracked, with the cache on or off.
+ *
+ * Copyright (c) 2018-2019, Matthew Madison
+ * Distributed under license; see the LICENSE file for details.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "xf86drm.h"
+#include "drm-shim.h"
+#include "shim-private.h"
+
+#define PRIME_HASH_SIZE	256
+
+/* Per-fd state, for the open file held names (see shim_file_hold()). */
+struct prime_fd {
+    struct prime_fd *next;
+    int fd;
+    int held;
+};
+
+/*
+ * Entries are hashed both by the dma-buf's device and inode, for
+ * imports, and by handle, for closes.  An entry is open from an
+ * import until the GEM close, and holds a reference for each
+ * drmShimPrimeImport() not yet released.  An idle entry (neither)
+ * is on the idle list, most recently closed first; its handle keeps
+ * the dma-buf alive, so its inode cannot be reused.
+ */
+struct prime_entry {
+    struct prime_entry *key_next;
+    struct prime_entry *handle_next;
+    struct prime_entry *idle_next, *idle_prev;
+    struct prime_fd *owner;
+    dev_t dev;
+    ino_t ino;
+    uint32_t handle;
+    int open;
+    unsigned int refs;
+};
+
+static pthread_mutex_t prime_lock = PTHREAD_MUTEX_INITIALIZER;
+static int prime_cache_on;
+static unsigned int prime_max_idle;
+static struct prime_fd *prime_fds;
+static struct prime_entry *by_key[PRIME_HASH_SIZE];
+static struct prime_entry *by_handle[PRIME_HASH_SIZE];
+static struct prime_entry prime_idle = { .idle_next = &prime_idle, .idle_prev = &prime_idle };
+static drmShimPrimeCacheStats prime_stats;
+static int (*next_fd_to_handle)(int fd, int prime_fd, uint32_t *handle);
+static __thread int prime_nested;
+
+/*
+ * DRM_SHIM_PRIME_CACHE is the number of idle handles to keep; unset
+ * or 0 disables the cache.  Read before the dispatch pointers are
+ * bound, so the hooks can be put in place.
+ */
+static void __attribute__((constructor(101)))
+shim_prime_init (void)
+{
+    const char *env = getenv("DRM_SHIM_PRIME_CACHE");
+    unsigned long val;
+
+    if (env == NULL || (val = strtoul(env, NULL, 0)) == 0 || !shim_file_tracking())
+        return;
+    prime_max_idle = (unsigned int) val;
+    prime_cache_on = 1;
+}
+
+int
+shim_prime_enabled (void)
+{
+    return prime_cache_on;
+}
+
+int
+shim_prime_tracking (void)
+{
+    return shim_file_tracking();
+}
+
+static inline unsigned int
+key_hash (int fd, dev_t dev, ino_t ino)
+{
+    uint64_t key = (uint64_t) ino ^ ((uint64_t) dev << 32) ^ (uint64_t) fd;
+
+    return (unsigned int) ((key * 0x9e3779b97f4a7c15ULL) >> 56) % PRIME_HASH_SIZE;
+}
+
+static inline unsigned int
+handle_hash (int fd, uint32_t handle)
+{
+    return (handle * 31U + (unsigned int) fd) % PRIME_HASH_SIZE;
+}
+
+/* Called with prime_lock held. */
+static struct prime_entry *
+find_key (struct prime_fd *pf, dev_t dev, ino_t ino)
+{
+    struct prime_entry *e;
+
+    for (e = by_key[key_hash(pf->fd, dev, ino)]; e != NULL; e = e->key_next)
+        if (e->owner == pf && e->dev == dev && e->ino == ino)
+            return e;
+    return NULL;
+}
+
+/* Called with prime_lock held. */
+static struct prime_entry *
+find_handle (struct prime_fd *pf, uint32_t handle)
+{
+    struct prime_entry *e;
+
+    for (e = by_handle[handle_hash(pf->fd, handle)]; e != NULL; e = e->handle_next)
+        if (e->owner == pf && e->handle == handle)
+            return e;
+    return NULL;
+}
+
+static inline void
+idle_add (struct prime_entry *e)
+{
+    e->idle_next = prime_idle.idle_next;
+    e->idle_prev = &prime_idle;
+    prime_idle.idle_next->idle_prev = e;
+    prime_idle.idle_next = e;
+    prime_stats.idle++;
+}
+
+static inline void
+idle_del (struct prime_entry *e)
+{
+    e->idle_prev->idle_next = e->idle_next;
+    e->idle_next->idle_prev = e->idle_prev;
+    prime_stats.idle--;
+}
+
+/* Unlinks an entry and frees it.  Called with prime_lock held. */
+static void
+prime_remove (struct prime_entry *e)
+{
+    struct prime_entry **ep;
+
+    for (ep = &by_key[key_hash(e->owner->fd, e->dev, e->ino)]; *ep != e; ep = &(*ep)->key_next);
+    *ep = e->key_next;
+    for (ep = &by_handle[handle_hash(e->owner->fd, e->handle)]; *ep != e; ep = &(*ep)->handle_next);
+    *ep = e->handle_next;
+    if (!e->open && e->refs == 0)
+        idle_del(e);
+    prime_stats.entries--;
+    free(e);
+}
+
+/*
+ * Drops an fd's entries.  The kernel closes their handles with the
+ * file, which closing held lets go.  Called with prime_lock held.
+ */
+static void
+prime_fd_free (struct prime_fd **pp)
+{
+    struct prime_fd *pf = *pp;
+    struct prime_entry *e, *next;
+    unsigned int i;
+
+    *pp = pf->next;
+    for (i = 0; i < PRIME_HASH_SIZE; i++)
+        for (e = by_key[i]; e != NULL; e = next) {
+            next = e->key_next;
+            if (e->owner == pf)
+                prime_remove(e);
+        }
+    close(pf->held);
+    free(pf);
+}
+
+/*
+ * As for the BO cache, state whose fd number has been reused for
+ * another file is dropped when found, and all of it is checked
+ * before state for a new fd is made.  Called with prime_lock held.
+ */
+static struct prime_fd *
+prime_fd_find (int fd, int create)
+{
+    struct prime_fd **pp, *pf;
+
+    for (pp = &prime_fds; (pf = *pp) != NULL; pp = &pf->next)
+        if (pf->fd == fd) {
+            if (shim_file_same(fd, pf->held))
+                return pf;
+            prime_fd_free(pp);
+            break;
+        }
+    if (!create)
+        return NULL;
+    for (pp = &prime_fds; (pf = *pp) != NULL; )
+        if (!shim_file_same(pf->fd, pf->held))
+            prime_fd_free(pp);
+        else
+            pp = &pf->next;
+    if ((pf = calloc(1, sizeof(*pf))) == NULL)
+        return NULL;
+    pf->held = shim_file_hold(fd);
+    if (pf->held < 0) {
+        free(pf);
+        return NULL;
+    }
+    pf->fd = fd;
+    pf->next = prime_fds;
+    prime_fds = pf;
+    return pf;
+}
+
+/* Marks an entry in use.  Called with prime_lock held. */
+static void
+prime_use (struct prime_entry *e, int counted)
+{
+    if (!e->open && e->refs == 0)
+        idle_del(e);
+    if (counted)
+        e->refs++;
+    else
+        e->open = 1;
+}
+
+/*
+ * Closes the least recently used idle handles while over the limit,
+ * the way the drmIoctl hook would have.  If the fd number now names
+ * another file, only the handle is closed, through held.  Called
+ * with prime_lock held.
+ */
+static void
+prime_evict (void)
+{
+    struct drm_gem_close args;
+    struct prime_entry *e;
+    struct prime_fd *pf;
+    int same;
+
+    while (prime_stats.idle > prime_max_idle) {
+        e = prime_idle.idle_prev;
+        pf = e->owner;
+        same = shim_file_same(pf->fd, pf->held);
+        memset(&args, 0, sizeof(args));
+        args.handle = e->handle;
+        if (shim_mmap_tracking() && same)
+            shim_mmap_forget(pf->fd, e->handle);
+        if (shim_bo_enabled() && same)
+            shim_bo_close(pf->fd, &args);
+        else
+            shim_ioctl_forward(pf->held, DRM_IOCTL_GEM_CLOSE, &args);
+        prime_remove(e);
+        prime_stats.evictions++;
+    }
+}
+
+/*
+ * Looks the dma-buf up, and imports it with import() if it is not
+ * in the cache.  A counted import takes a reference.  Returns 0, or
+ * the value import() failed with; a counted import that cannot be
+ * tracked fails with -ENOMEM.
+ */
+static int
+prime_import (int fd, int prime_fd, uint32_t *handle, int counted,
+              int (*import)(int fd, int prime_fd, uint32_t *handle))
+{
+    struct prime_entry *e, *stale;
+    struct drm_gem_close args;
+    struct prime_fd *pf;
+    struct stat st;
+    int ret;
+
+    if (fstat(prime_fd, &st) < 0)
+        return counted ? -errno : import(fd, prime_fd, handle);
+    pthread_mutex_lock(&prime_lock);
+    prime_stats.imports++;
+    pf = prime_fd_find(fd, 1);
+    e = (pf == NULL ? NULL : find_key(pf, st.st_dev, st.st_ino));
+    if (e != NULL) {
+        prime_use(e, counted);
+        prime_stats.hits++;
+        *handle = e->handle;
+        pthread_mutex_unlock(&prime_lock);
+        return 0;
+    }
+    pthread_mutex_unlock(&prime_lock);
+
+    ret = import(fd, prime_fd, handle);
+    if (ret != 0)
+        return ret;
+
+    pthread_mutex_lock(&prime_lock);
+    pf = prime_fd_find(fd, 1);
+    if (pf == NULL)
+        goto fail;
+    e = find_key(pf, st.st_dev, st.st_ino);
+    if (e != NULL) {
+        /* imported by another thread in the meantime */
+        prime_use(e, counted);
+        goto out;
+    }
+    /* an entry for the handle under another key is out of date */
+    stale = find_handle(pf, *handle);
+    if (stale != NULL)
+        prime_remove(stale);
+    e = calloc(1, sizeof(*e));
+    if (e == NULL)
+        goto fail;
+    e->owner = pf;
+    e->dev = st.st_dev;
+    e->ino = st.st_ino;
+    e->handle = *handle;
+    e->open = !counted;
+    e->refs = (counted ? 1 : 0);
+    e->key_next = by_key[key_hash(fd, e->dev, e->ino)];
+    by_key[key_hash(fd, e->dev, e->ino)] = e;
+    e->handle_next = by_handle[handle_hash(fd, e->handle)];
+    by_handle[handle_hash(fd, e->handle)] = e;
+    prime_stats.entries++;
+  out:
+    pthread_mutex_unlock(&prime_lock);
+    return 0;
+  fail:
+    pthread_mutex_unlock(&prime_lock);
+    if (!counted)
+        return 0;
+    memset(&args, 0, sizeof(args));
+    args.handle = *handle;
+    drmIoctl(fd, DRM_IOCTL_GEM_CLOSE, &args);
+    return -ENOMEM;
+}
+
+static int
+ioctl_import (int fd, int prime_fd, uint32_t *handle)
+{
+    struct drm_prime_handle args;
+
+    memset(&args, 0, sizeof(args));
+    args.fd = prime_fd;
+    if (shim_ioctl_forward(fd, DRM_IOCTL_PRIME_FD_TO_HANDLE, &args) != 0)
+        return -1;
+    *handle = args.handle;
+    return 0;
+}
+
+/*
+ * A backend's drmPrimeFDToHandle may make its ioctl through the
+ * shim's drmIoctl, which must not count the import a second time.
+ */
+int
+shim_prime_import (int fd, void *arg)
+{
+    struct drm_prime_handle *args = arg;
+
+    if (prime_nested)
+        return shim_ioctl_forward(fd, DRM_IOCTL_PRIME_FD_TO_HANDLE, args);
+    return prime_import(fd, args->fd, &args->handle, 0, ioctl_import);
+}
+
+static int
+next_import (int fd, int prime_fd, uint32_t *handle)
+{
+    int ret;
+
+    prime_nested = 1;
+    ret = next_fd_to_handle(fd, prime_fd, handle);
+    prime_nested = 0;
+    return ret;
+}
+
+static int
+prime_fd_to_handle (int fd, int prime_fd, uint32_t *handle)
+{
+    return prime_import(fd, prime_fd, handle, 0, next_import);
+}
+
+/*
+ * Returns 1 if the close has been dealt with: the handle has been
+ * kept for reuse, or for the drmShimPrimeImport() references still
+ * held.  A close of an idle handle, from whoever else holds it,
+ * goes through.
+ */
+int
+shim_prime_close (int fd, uint32_t handle)
+{
+    struct prime_entry *e = NULL;
+    struct prime_fd *pf;
+    int ret = 1;
+
+    pthread_mutex_lock(&prime_lock);
+    pf = prime_fd_find(fd, 0);
+    if (pf != NULL)
+        e = find_handle(pf, handle);
+    if (e == NULL || (!e->open && e->refs == 0)) {
+        if (e != NULL)
+            prime_remove(e);
+        ret = 0;
+    } else if (e->open) {
+        e->open = 0;
+        if (e->refs == 0) {
+            idle_add(e);
+            prime_evict();
+        }
+    }
+    pthread_mutex_unlock(&prime_lock);
+    return ret;
+}
+
+/* The kernel closes the fd's handles itself. */
+void
+shim_prime_forget_fd (int fd)
+{
+    struct prime_fd **pp, *pf;
+
+    pthread_mutex_lock(&prime_lock);
+    for (pp = &prime_fds; (pf = *pp) != NULL; pp = &pf->next)
+        if (pf->fd == fd) {
+            prime_fd_free(pp);
+            break;
+        }
+    pthread_mutex_unlock(&prime_lock);
+}
+
+/*
+ * Without kcmp() a reused fd number cannot be told from the file
+ * it used to name, so the references could not be trusted.
+ */
+int
+drmShimPrimeImport (int fd, int prime_fd, uint32_t *handle)
+{
+    int ret;
+
+    if (handle == NULL)
+        return -EINVAL;
+    if (!shim_prime_tracking())
+        return -ENOSYS;
+    ret = prime_import(fd, prime_fd, handle, 1,
+                       next_fd_to_handle != NULL ? next_import : drmPrimeFDToHandle);
+    if (ret == -1)
+        return -errno;
+    return ret;
+}
+
+int
+drmShimPrimeRelease (int fd, uint32_t handle)
+{
+    struct prime_entry *e = NULL;
+    struct prime_fd *pf;
+    int ret = 0;
+
+    pthread_mutex_lock(&prime_lock);
+    pf = prime_fd_find(fd, 0);
+    if (pf != NULL)
+        e = find_handle(pf, handle);
+    if (e == NULL || e->refs == 0)
+        ret = -EINVAL;
+    else if (--e->refs == 0 && !e->open) {
+        idle_add(e);
+        prime_evict();
+    }
+    pthread_mutex_unlock(&prime_lock);
+    return ret;
+}
+
+void *
+shim_prime_interpose (void *fn)
+{
+    if (fn == NULL || !prime_cache_on)
+        return fn;
+    next_fd_to_handle = fn;
+    return prime_fd_to_handle;
+}
+
+void
+drmShimPrimeCacheGetStats (drmShimPrimeCacheStats *stats)
+{
+    if (stats == NULL)
+        return;
+    pthread_mutex_lock(&prime_lock);
+    *stats = prime_stats;
+    pthread_mutex_unlock(&prime_lock);
+}
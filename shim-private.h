@@ -0,0 +1,281 @@
+/*
+ * shim-private.h
+ *
+ * Internal declarations shared between the shim's source files.
+ *
+ * Copyright (c) 2018-2019, Matthew Madison
+ * Distributed under license; see the LICENSE file for details.
+ */
+#ifndef SHIM_PRIVATE_H_
+#define SHIM_PRIVATE_H_
+
+#include <stdint.h>
+#include <time.h>
+#include "shim-funcs.h"
+
+#define SHIM_INTERNAL __attribute__((visibility("hidden")))
+
+/*
+ * Function table, indexed by the FUNCID_ values generated
+ * from FUNCDEFS.
+ */
+#define FUNCDEF(type__, name__, args__, actargs__, ret__) \
+    FUNCID_##name__,
+enum {
+    FUNCDEFS
+    FUNCID_COUNT
+};
+#undef FUNCDEF
+
+extern const char *const shim_func_names[] SHIM_INTERNAL;
+extern const unsigned int shim_func_count SHIM_INTERNAL;
+
+static inline uint64_t
+shim_now_ns (void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+static inline void
+shim_cpu_relax (void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+    __asm__ __volatile__("yield" ::: "memory");
+#else
+    __asm__ __volatile__("" ::: "memory");
+#endif
+}
+
+/*
+ * Per-call instrumentation.  The wrappers test shim_instr_on and
+ * take an out-of-line path only when some form of instrumentation
+ * (statistics in shim-stats.c, recording in shim-record.c) is on.
+ */
+#define SHIM_INSTR_STATS	(1 << 0)
+#define SHIM_INSTR_RECORD	(1 << 1)
+
+extern int shim_instr_on SHIM_INTERNAL;
+
+/*
+ * Argument-list helpers, applied to the actual-argument lists
+ * from FUNCDEFS.  SHIM_NARGS counts the arguments and SHIM_MAP
+ * applies a macro to each one.
+ */
+#define SHIM_MAX_ARGS 16
+#define SHIM_NARGS(...) SHIM_NARGS_(0, ##__VA_ARGS__, 16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0)
+#define SHIM_NARGS_(_0, _1, _2, _3, _4, _5, _6, _7, _8, _9, _10, _11, _12, _13, _14, _15, _16, n__, ...) n__
+#define SHIM_CAT(a__, b__) SHIM_CAT_(a__, b__)
+#define SHIM_CAT_(a__, b__) a__##b__
+#define SHIM_MAP(f__, ...) SHIM_CAT(SHIM_MAP_, SHIM_NARGS(__VA_ARGS__))(f__, ##__VA_ARGS__)
+#define SHIM_MAP_0(f__)
+#define SHIM_MAP_1(f__, a__) f__(a__)
+#define SHIM_MAP_2(f__, a__, ...) f__(a__), SHIM_MAP_1(f__, __VA_ARGS__)
+#define SHIM_MAP_3(f__, a__, ...) f__(a__), SHIM_MAP_2(f__, __VA_ARGS__)
+#define SHIM_MAP_4(f__, a__, ...) f__(a__), SHIM_MAP_3(f__, __VA_ARGS__)
+#define SHIM_MAP_5(f__, a__, ...) f__(a__), SHIM_MAP_4(f__, __VA_ARGS__)
+#define SHIM_MAP_6(f__, a__, ...) f__(a__), SHIM_MAP_5(f__, __VA_ARGS__)
+#define SHIM_MAP_7(f__, a__, ...) f__(a__), SHIM_MAP_6(f__, __VA_ARGS__)
+#define SHIM_MAP_8(f__, a__, ...) f__(a__), SHIM_MAP_7(f__, __VA_ARGS__)
+#define SHIM_MAP_9(f__, a__, ...) f__(a__), SHIM_MAP_8(f__, __VA_ARGS__)
+#define SHIM_MAP_10(f__, a__, ...) f__(a__), SHIM_MAP_9(f__, __VA_ARGS__)
+#define SHIM_MAP_11(f__, a__, ...) f__(a__), SHIM_MAP_10(f__, __VA_ARGS__)
+#define SHIM_MAP_12(f__, a__, ...) f__(a__), SHIM_MAP_11(f__, __VA_ARGS__)
+#define SHIM_MAP_13(f__, a__, ...) f__(a__), SHIM_MAP_12(f__, __VA_ARGS__)
+#define SHIM_MAP_14(f__, a__, ...) f__(a__), SHIM_MAP_13(f__, __VA_ARGS__)
+#define SHIM_MAP_15(f__, a__, ...) f__(a__), SHIM_MAP_14(f__, __VA_ARGS__)
+#define SHIM_MAP_16(f__, a__, ...) f__(a__), SHIM_MAP_15(f__, __VA_ARGS__)
+
+/* Raw bits of an argument or return value of any scalar type */
+#define SHIM_WORD(x__) ({ \
+    __typeof__(x__) v__ = (x__); \
+    uint64_t w__ = 0; \
+    __builtin_memcpy(&w__, &v__, sizeof(v__) < sizeof(w__) ? sizeof(v__) : sizeof(w__)); \
+    w__; })
+#define SHIM_IS_POINTER(x__) (__builtin_classify_type(x__) == 5)
+
+#define SHIM_ARGWORDS(...) SHIM_MAP(SHIM_WORD, ##__VA_ARGS__)
+#define SHIM_ARGKINDS(...) SHIM_MAP(SHIM_IS_POINTER, ##__VA_ARGS__)
+
+struct shim_call {
+    unsigned int id;
+    uint64_t start;
+    void *rec;
+};
+
+void shim_stats_add(unsigned int id, uint64_t elapsed) SHIM_INTERNAL;
+void *shim_record_begin(unsigned int id, unsigned int nargs,
+                        const uint64_t *argv, const uint8_t *kinds) SHIM_INTERNAL;
+void shim_record_end(void *rec, uint64_t start, uint64_t elapsed, uint64_t ret) SHIM_INTERNAL;
+
+/*
+ * Opens an instrumentation output file (shim-ioctl.c).  "%p" in the
+ * path is replaced by the process ID.  Traces and recordings pass
+ * O_EXCL, so that another process inheriting the environment does
+ * not truncate one that is still being written or about to be read;
+ * statistics are appended instead.
+ */
+int shim_trace_open(const char *path, int flags) SHIM_INTERNAL;
+
+static inline struct shim_call
+shim_call_begin (unsigned int id, unsigned int nargs,
+                 const uint64_t *argv, const uint8_t *kinds)
+{
+    struct shim_call call = { id, 0, NULL };
+
+    if (shim_instr_on & SHIM_INSTR_RECORD)
+        call.rec = shim_record_begin(id, nargs, argv, kinds);
+    call.start = shim_now_ns();
+    return call;
+}
+
+static inline void
+shim_call_end (struct shim_call *call, uint64_t ret)
+{
+    uint64_t elapsed = shim_now_ns() - call->start;
+
+    if (shim_instr_on & SHIM_INSTR_STATS)
+        shim_stats_add(call->id, elapsed);
+    if (call->rec != NULL)
+        shim_record_end(call->rec, call->start, elapsed, ret);
+}
+
+/*
+ * Evaluates a forwarded call, passes its result to shim_call_end
+ * and yields the result.  Void calls are handled by substituting
+ * a dummy int, which is cast back to void.
+ */
+#define SHIM_IS_VOID(x__) __builtin_types_compatible_p(__typeof__(x__), void)
+#define SHIM_CALL_END(call__, x__) ({ \
+    __typeof__(__builtin_choose_expr(SHIM_IS_VOID(x__), 0, (x__))) r__ = \
+        __builtin_choose_expr(SHIM_IS_VOID(x__), ((x__), 0), (x__)); \
+    shim_call_end(&(call__), SHIM_WORD(r__)); \
+    (__typeof__(x__)) r__; })
+
+/*
+ * drmIoctl processing (shim-ioctl.c).  Returns the function the
+ * drmIoctl dispatch pointer should use in place of fn.
+ */
+void *shim_ioctl_interpose(void *fn) SHIM_INTERNAL;
+int shim_ioctl_forward(int fd, unsigned long request, void *arg) SHIM_INTERNAL;
+
+/*
+ * drmClose processing (shim-ioctl.c), which tells the caches, wait
+ * groups and emulated timelines below about the fd going away.
+ * Returns the function the drmClose dispatch pointer should use in
+ * place of fn; timelines is nonzero if the timeline emulation is in
+ * use.
+ */
+void *shim_ioctl_close_interpose(void *fn, int timelines) SHIM_INTERNAL;
+
+/*
+ * Open-file identity for the caches' per-fd state (shim-ioctl.c).
+ * A program may close a DRM fd with close(), which the shim never
+ * sees, and get the same number back for another file.  So a cache
+ * keeps a duplicate of each fd it holds state for, from
+ * shim_file_hold(), and checks with shim_file_same() that the
+ * number still names the same open file before using that state.
+ * Work a cache does on its own account goes through the duplicate.
+ * shim_file_tracking() is 0 if the kernel cannot compare files
+ * (no kcmp), in which case shim_file_same() always says yes.
+ */
+int shim_file_tracking(void) SHIM_INTERNAL;
+int shim_file_hold(int fd) SHIM_INTERNAL;
+int shim_file_same(int fd, int held) SHIM_INTERNAL;
+
+/*
+ * GEM object cache (shim-bo.c), called from the drmIoctl hook for
+ * the requests it handles or needs to see.  shim_bo_interpose()
+ * returns the function the drmPrimeHandleToFD dispatch pointer
+ * should use in place of fn.
+ */
+int shim_bo_enabled(void) SHIM_INTERNAL;
+int shim_bo_create(int fd, void *arg) SHIM_INTERNAL;
+int shim_bo_close(int fd, void *arg) SHIM_INTERNAL;
+int shim_bo_submit(int fd, void *arg) SHIM_INTERNAL;
+void shim_bo_modified(int fd, uint32_t handle, int tiling_only) SHIM_INTERNAL;
+void shim_bo_forget_fd(int fd) SHIM_INTERNAL;
+void *shim_bo_interpose(unsigned int id, void *fn) SHIM_INTERNAL;
+
+/*
+ * GEM mapping cache (shim-mmap.c).  shim_mmap_offset() answers
+ * DRM_IOCTL_TEGRA_GEM_MMAP with the cache on, and shim_mmap_forget()
+ * drops a handle's offset and mapping when it is closed.  Mappings
+ * can be made with the cache off, so shim_mmap_tracking() says
+ * whether GEM closes and drmClose() must be seen regardless.
+ */
+int shim_mmap_enabled(void) SHIM_INTERNAL;
+int shim_mmap_tracking(void) SHIM_INTERNAL;
+int shim_mmap_offset(int fd, void *arg) SHIM_INTERNAL;
+void shim_mmap_forget(int fd, uint32_t handle) SHIM_INTERNAL;
+void shim_mmap_forget_fd(int fd) SHIM_INTERNAL;
+
+/*
+ * PRIME import cache (shim-prime.c).  shim_prime_import() answers
+ * DRM_IOCTL_PRIME_FD_TO_HANDLE with the cache on, and
+ * shim_prime_close() returns nonzero for a GEM close it has taken
+ * care of.  Counted imports can be made with the cache off, so
+ * shim_prime_tracking() says whether GEM closes and drmClose() must
+ * be seen regardless.
+ * shim_prime_interpose() returns the function the drmPrimeFDToHandle
+ * dispatch pointer should use in place of fn.
+ */
+int shim_prime_enabled(void) SHIM_INTERNAL;
+int shim_prime_tracking(void) SHIM_INTERNAL;
+int shim_prime_import(int fd, void *arg) SHIM_INTERNAL;
+int shim_prime_close(int fd, uint32_t handle) SHIM_INTERNAL;
+void shim_prime_forget_fd(int fd) SHIM_INTERNAL;
+void *shim_prime_interpose(void *fn) SHIM_INTERNAL;
+
+/*
+ * Syncobj wait coalescing (shim-syncobj.c).  Returns the function
+ * the drmSyncobjWait or drmSyncobjTimelineWait dispatch pointer
+ * should use in place of fn.
+ */
+int shim_syncobj_enabled(void) SHIM_INTERNAL;
+void shim_syncobj_forget_fd(int fd) SHIM_INTERNAL;
+void *shim_syncobj_interpose(unsigned int id, void *fn) SHIM_INTERNAL;
+
+/*
+ * Timeline syncobj emulation (shim-timeline.c).  The lookup returns
+ * the emulation of the named function, or NULL; the interpose hook
+ * is for drmSyncobjDestroy, and returns the function to use in
+ * place of fn.
+ */
+void *shim_timeline_lookup(const char *name) SHIM_INTERNAL;
+void shim_timeline_forget_fd(int fd) SHIM_INTERNAL;
+void *shim_timeline_interpose(void *fn) SHIM_INTERNAL;
+
+/*
+ * Spin-then-block wait policy (shim-wait.c).  Each wait source
+ * (a syncpoint, or fences as a whole) keeps an estimate of how long
+ * its waits take.  shim_wait_budget() gives the time to spin before
+ * blocking, shim_wait_observe() records a completed wait, and
+ * shim_wait_spin() polls check() within the budget.
+ */
+struct shim_wait_est {
+    uint32_t avg_ns;
+    uint32_t probe;
+};
+
+uint64_t shim_wait_budget(struct shim_wait_est *est) SHIM_INTERNAL;
+void shim_wait_observe(struct shim_wait_est *est, uint64_t elapsed_ns) SHIM_INTERNAL;
+int shim_wait_spin(uint64_t budget_ns, int (*check)(void *arg), void *arg) SHIM_INTERNAL;
+
+/*
+ * An ioctl restarted only on EINTR (libdrm-shim.c), for waits whose
+ * timeout shows up as EAGAIN.
+ */
+int shim_ioctl_eintr(int fd, unsigned long request, void *arg) SHIM_INTERNAL;
+
+/*
+ * Software fake backend (shim-fake.c).  Returns the fake's
+ * implementation of the named function, or NULL.
+ */
+void *shim_fake_lookup(const char *name) SHIM_INTERNAL;
+
+#endif /* SHIM_PRIVATE_H_ */
@@ -0,0 +1,399 @@
+/*
+ * shim-reactor.c
+ *
+ * Reactor that waits on many sync_file fences and DRM event fds
+ * with one epoll instance, and runs their completion callbacks
+ * and drmHandleEvent() on a small pool of worker threads.
+ *
+ * Copyright (c) 2018-2019, Matthew Madison
+ * Distributed under license; see the LICENSE file for details.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "xf86drm.h"
+#include "drm-shim.h"
+
+#define REACTOR_DEFAULT_WORKERS	2
+#define REACTOR_MAX_WORKERS	64
+
+enum item_kind {
+    ITEM_FENCE,
+    ITEM_DRM,
+};
+
+struct reactor_item {
+    enum item_kind kind;
+    int fd;                     /* our own dup of the caller's fd */
+    int caller_fd;
+    uint32_t gen;
+    int busy;                   /* a worker is running the handler */
+    int removed;
+    pthread_t owner;
+    union {
+        struct {
+            drmShimFenceCallback callback;
+            void *user_data;
+        } fence;
+        drmEventContextPtr evctx;
+    } u;
+};
+
+/*
+ * Every worker waits in epoll_wait() on the same epoll fd.  Items
+ * are registered EPOLLONESHOT, so each readiness event goes to
+ * exactly one worker and the item stays disarmed until that worker
+ * re-arms it; a DRM fd's events are therefore never handled by two
+ * workers at once.  The epoll data is a slot index plus generation
+ * rather than a pointer, so an event that races with removal finds
+ * the slot empty or reused and is ignored.
+ */
+struct _drmShimReactor {
+    int epfd;
+    int wakefd;
+    int stopping;
+    unsigned int nworkers;
+    pthread_t workers[REACTOR_MAX_WORKERS];
+    pthread_mutex_t lock;
+    pthread_cond_t idle;
+    struct reactor_item **slots;
+    uint32_t next_gen;
+    unsigned int nslots;
+    unsigned int nfree;
+    unsigned int *freelist;
+};
+
+#define WAKE_ID UINT64_MAX
+
+static inline uint64_t
+item_id (unsigned int slot, uint32_t gen)
+{
+    return ((uint64_t) gen << 32) | slot;
+}
+
+static struct reactor_item *
+item_lookup (drmShimReactorPtr r, uint64_t id)
+{
+    unsigned int slot = (uint32_t) id;
+    struct reactor_item *item;
+
+    if (slot >= r->nslots)
+        return NULL;
+    item = r->slots[slot];
+    if (item == NULL || item->gen != (uint32_t) (id >> 32))
+        return NULL;
+    return item;
+}
+
+/* Called with the lock held; returns the slot, or -1 */
+static int
+slot_alloc (drmShimReactorPtr r, struct reactor_item *item)
+{
+    unsigned int slot, n, i;
+
+    if (r->nfree == 0) {
+        struct reactor_item **slots;
+        unsigned int *freelist;
+
+        n = r->nslots ? r->nslots * 2 : 64;
+        slots = realloc(r->slots, n * sizeof(*slots));
+        if (slots == NULL)
+            return -1;
+        r->slots = slots;
+        freelist = realloc(r->freelist, n * sizeof(*freelist));
+        if (freelist == NULL)
+            return -1;
+        r->freelist = freelist;
+        for (i = n; i > r->nslots; i--) {
+            slots[i - 1] = NULL;
+            freelist[r->nfree++] = i - 1;
+        }
+        r->nslots = n;
+    }
+    slot = r->freelist[--r->nfree];
+    item->gen = ++r->next_gen;
+    r->slots[slot] = item;
+    return (int) slot;
+}
+
+static void
+slot_free (drmShimReactorPtr r, unsigned int slot)
+{
+    r->slots[slot] = NULL;
+    r->freelist[r->nfree++] = slot;
+}
+
+static void
+item_release (drmShimReactorPtr r, unsigned int slot, struct reactor_item *item)
+{
+    slot_free(r, slot);
+    close(item->fd);
+    free(item);
+}
+
+static void
+handle_event (drmShimReactorPtr r, uint64_t id, uint32_t events)
+{
+    struct reactor_item *item;
+    struct epoll_event ev;
+    unsigned int slot = (uint32_t) id;
+    int status;
+
+    pthread_mutex_lock(&r->lock);
+    item = item_lookup(r, id);
+    if (item == NULL || item->removed) {
+        pthread_mutex_unlock(&r->lock);
+        return;
+    }
+    item->busy = 1;
+    item->owner = pthread_self();
+    pthread_mutex_unlock(&r->lock);
+
+    if (item->kind == ITEM_FENCE) {
+        status = (events & (EPOLLERR | EPOLLHUP)) && !(events & EPOLLIN) ? -EINVAL : 0;
+        epoll_ctl(r->epfd, EPOLL_CTL_DEL, item->fd, NULL);
+        item->u.fence.callback(item->caller_fd, status, item->u.fence.user_data);
+        pthread_mutex_lock(&r->lock);
+        item_release(r, slot, item);
+        pthread_cond_broadcast(&r->idle);
+        pthread_mutex_unlock(&r->lock);
+        return;
+    }
+
+    drmHandleEvent(item->fd, item->u.evctx);
+    pthread_mutex_lock(&r->lock);
+    item->busy = 0;
+    if (item->removed) {
+        epoll_ctl(r->epfd, EPOLL_CTL_DEL, item->fd, NULL);
+        item_release(r, slot, item);
+        pthread_cond_broadcast(&r->idle);
+    } else {
+        ev.events = EPOLLIN | EPOLLONESHOT;
+        ev.data.u64 = id;
+        epoll_ctl(r->epfd, EPOLL_CTL_MOD, item->fd, &ev);
+    }
+    pthread_mutex_unlock(&r->lock);
+}
+
+static void *
+reactor_worker (void *arg)
+{
+    drmShimReactorPtr r = arg;
+    struct epoll_event ev;
+    int n;
+
+    for (;;) {
+        n = epoll_wait(r->epfd, &ev, 1, -1);
+        if (n < 0 && errno != EINTR)
+            break;
+        if (n <= 0)
+            continue;
+        if (ev.data.u64 == WAKE_ID) {
+            if (__atomic_load_n(&r->stopping, __ATOMIC_ACQUIRE))
+                break;
+            continue;
+        }
+        handle_event(r, ev.data.u64, ev.events);
+    }
+    return NULL;
+}
+
+drmShimReactorPtr
+drmShimReactorCreate (unsigned int workers)
+{
+    drmShimReactorPtr r;
+    struct epoll_event ev;
+    int err;
+
+    if (workers == 0)
+        workers = REACTOR_DEFAULT_WORKERS;
+    if (workers > REACTOR_MAX_WORKERS)
+        workers = REACTOR_MAX_WORKERS;
+    r = calloc(1, sizeof(*r));
+    if (r == NULL)
+        return NULL;
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->idle, NULL);
+    r->epfd = epoll_create1(EPOLL_CLOEXEC);
+    r->wakefd = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+    if (r->epfd < 0 || r->wakefd < 0)
+        goto fail;
+    /* level-triggered, so every worker sees the stop request */
+    ev.events = EPOLLIN;
+    ev.data.u64 = WAKE_ID;
+    if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->wakefd, &ev) < 0)
+        goto fail;
+    for (r->nworkers = 0; r->nworkers < workers; r->nworkers++) {
+        err = pthread_create(&r->workers[r->nworkers], NULL, reactor_worker, r);
+        if (err != 0) {
+            if (r->nworkers > 0)
+                break;
+            errno = err;
+            goto fail;
+        }
+    }
+    return r;
+
+  fail:
+    err = errno;
+    if (r->epfd >= 0)
+        close(r->epfd);
+    if (r->wakefd >= 0)
+        close(r->wakefd);
+    free(r);
+    errno = err;
+    return NULL;
+}
+
+/*
+ * Fences still pending are cancelled: their callbacks are run
+ * here, with status -ECANCELED, after the workers have exited.
+ * A callback cannot destroy its own reactor, since its worker
+ * would have to join itself; such a call sets errno to EDEADLK and
+ * does nothing.
+ */
+void
+drmShimReactorDestroy (drmShimReactorPtr r)
+{
+    pthread_t self = pthread_self();
+    uint64_t one = 1;
+    unsigned int i;
+    ssize_t n;
+
+    if (r == NULL)
+        return;
+    for (i = 0; i < r->nworkers; i++)
+        if (pthread_equal(self, r->workers[i])) {
+            errno = EDEADLK;
+            return;
+        }
+    __atomic_store_n(&r->stopping, 1, __ATOMIC_RELEASE);
+    n = write(r->wakefd, &one, sizeof(one));
+    (void) n;
+    for (i = 0; i < r->nworkers; i++)
+        pthread_join(r->workers[i], NULL);
+    for (i = 0; i < r->nslots; i++) {
+        struct reactor_item *item = r->slots[i];
+        if (item == NULL)
+            continue;
+        if (item->kind == ITEM_FENCE)
+            item->u.fence.callback(item->caller_fd, -ECANCELED, item->u.fence.user_data);
+        item_release(r, i, item);
+    }
+    close(r->wakefd);
+    close(r->epfd);
+    free(r->slots);
+    free(r->freelist);
+    pthread_cond_destroy(&r->idle);
+    pthread_mutex_destroy(&r->lock);
+    free(r);
+}
+
+static int
+reactor_add (drmShimReactorPtr r, struct reactor_item *item, int fd)
+{
+    struct epoll_event ev;
+    int slot, err;
+
+    item->caller_fd = fd;
+    item->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (item->fd < 0) {
+        err = -errno;
+        free(item);
+        return err;
+    }
+    pthread_mutex_lock(&r->lock);
+    slot = slot_alloc(r, item);
+    if (slot < 0) {
+        pthread_mutex_unlock(&r->lock);
+        close(item->fd);
+        free(item);
+        return -ENOMEM;
+    }
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.u64 = item_id(slot, item->gen);
+    if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, item->fd, &ev) < 0) {
+        err = -errno;
+        item_release(r, slot, item);
+        pthread_mutex_unlock(&r->lock);
+        return err;
+    }
+    pthread_mutex_unlock(&r->lock);
+    return 0;
+}
+
+int
+drmShimReactorAddFence (drmShimReactorPtr r, int fd,
+                        drmShimFenceCallback callback, void *user_data)
+{
+    struct reactor_item *item;
+
+    if (r == NULL || fd < 0 || callback == NULL)
+        return -EINVAL;
+    item = calloc(1, sizeof(*item));
+    if (item == NULL)
+        return -ENOMEM;
+    item->kind = ITEM_FENCE;
+    item->u.fence.callback = callback;
+    item->u.fence.user_data = user_data;
+    return reactor_add(r, item, fd);
+}
+
+int
+drmShimReactorAddDrm (drmShimReactorPtr r, int fd, struct _drmEventContext *evctx)
+{
+    struct reactor_item *item;
+
+    if (r == NULL || fd < 0 || evctx == NULL)
+        return -EINVAL;
+    item = calloc(1, sizeof(*item));
+    if (item == NULL)
+        return -ENOMEM;
+    item->kind = ITEM_DRM;
+    item->u.evctx = evctx;
+    return reactor_add(r, item, fd);
+}
+
+/*
+ * Waits for a handler running on another worker to finish.  Called
+ * from the fd's own handler, the item is freed when it returns.
+ */
+int
+drmShimReactorRemoveDrm (drmShimReactorPtr r, int fd)
+{
+    struct reactor_item *item = NULL;
+    unsigned int i;
+    uint64_t id;
+
+    if (r == NULL)
+        return -EINVAL;
+    pthread_mutex_lock(&r->lock);
+    for (i = 0; i < r->nslots; i++) {
+        item = r->slots[i];
+        if (item != NULL && item->kind == ITEM_DRM &&
+            item->caller_fd == fd && !item->removed)
+            break;
+        item = NULL;
+    }
+    if (item == NULL) {
+        pthread_mutex_unlock(&r->lock);
+        return -ENOENT;
+    }
+    item->removed = 1;
+    if (!item->busy) {
+        epoll_ctl(r->epfd, EPOLL_CTL_DEL, item->fd, NULL);
+        item_release(r, i, item);
+    } else if (!pthread_equal(item->owner, pthread_self())) {
+        id = item_id(i, item->gen);
+        while (item_lookup(r, id) != NULL)
+            pthread_cond_wait(&r->idle, &r->lock);
+    }
+    pthread_mutex_unlock(&r->lock);
+    return 0;
+}
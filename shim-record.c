@@ -0,0 +1,167 @@
+/*
+ * shim-record.c
+ *
+ * Recorder that writes every forwarded call to a memory-mapped
+ * trace file, for later replay with drm-shim-replay.
+ *
+ * Copyright (c) 2018-2019, Matthew Madison
+ * Distributed under license; see the LICENSE file for details.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "xf86drm.h"
+#include "shim-private.h"
+#include "shim-record.h"
+#include "config.h"
+
+#ifdef SHIM_INSTRUMENTATION
+/*
+ * Enabled by setting DRM_SHIM_RECORD to the path of the trace
+ * file, which must not already exist ("%p" in the path is replaced
+ * by the process ID).  DRM_SHIM_RECORD_SIZE sets the file size in MiB (default
+ * 64); once it is full, further calls are counted as dropped.
+ */
+#define RECORD_DEFAULT_MB	64
+#define RECORD_CHUNK_SIZE	(64 * 1024)
+
+static char *rec_base;
+static struct shim_record_header *rec_hdr;
+
+static __thread struct shim_record_chunk *my_chunk;
+static __thread uint32_t my_tid;
+
+static struct shim_record_chunk *
+chunk_alloc (void)
+{
+    uint64_t off;
+    struct shim_record_chunk *chunk;
+
+    off = __atomic_fetch_add(&rec_hdr->next_chunk, RECORD_CHUNK_SIZE, __ATOMIC_RELAXED);
+    if (off + RECORD_CHUNK_SIZE > rec_hdr->file_size)
+        return NULL;
+    if (my_tid == 0)
+        my_tid = (uint32_t) syscall(SYS_gettid);
+    chunk = (struct shim_record_chunk *) (rec_base + off);
+    chunk->tid = my_tid;
+    __atomic_store_n(&chunk->used, 0, __ATOMIC_RELEASE);
+    return chunk;
+}
+
+/*
+ * Space for the record is claimed, and the arguments written,
+ * before the call is made; ret and timing are filled in by
+ * shim_record_end.  Records are claimed in call order, so a
+ * nested call (the vendor library calling back into drmIoctl,
+ * for example) gets its own record after the outer one.
+ */
+void *
+shim_record_begin (unsigned int id, unsigned int nargs,
+                   const uint64_t *argv, const uint8_t *kinds)
+{
+    struct shim_record_chunk *chunk = my_chunk;
+    struct shim_record_entry *rec;
+    uint64_t *words;
+    size_t payload = 0, size;
+    unsigned int i;
+
+    if (id == FUNCID_drmIoctl && argv[2] != 0)
+        payload = _IOC_SIZE((unsigned long) argv[1]);
+    size = sizeof(*rec) + nargs * sizeof(uint64_t) + ((payload + 7) & ~7UL);
+
+    if (chunk == NULL || chunk->used + size > RECORD_CHUNK_SIZE - sizeof(*chunk)) {
+        chunk = my_chunk = chunk_alloc();
+        if (chunk == NULL) {
+            __atomic_fetch_add(&rec_hdr->dropped, 1, __ATOMIC_RELAXED);
+            return NULL;
+        }
+    }
+    rec = (struct shim_record_entry *) ((char *) (chunk + 1) + chunk->used);
+    memset(rec, 0, sizeof(*rec));
+    rec->func = id;
+    rec->size = size;
+    rec->nargs = nargs;
+    rec->payload = payload;
+    words = (uint64_t *) (rec + 1);
+    for (i = 0; i < nargs; i++) {
+        words[i] = argv[i];
+        if (kinds[i])
+            rec->ptrmask |= 1U << i;
+    }
+    if (payload != 0)
+        memcpy(words + nargs, (const void *) (uintptr_t) argv[2], payload);
+    __atomic_store_n(&chunk->used, chunk->used + size, __ATOMIC_RELEASE);
+    return rec;
+}
+
+void
+shim_record_end (void *recp, uint64_t start, uint64_t elapsed, uint64_t ret)
+{
+    struct shim_record_entry *rec = recp;
+
+    rec->start_ns = start - rec_hdr->start_ns;
+    rec->duration_ns = elapsed > UINT32_MAX ? UINT32_MAX : (uint32_t) elapsed;
+    rec->ret = ret;
+    __atomic_store_n(&rec->complete, 1, __ATOMIC_RELEASE);
+}
+
+static void __attribute__((constructor(101)))
+shim_record_init (void)
+{
+    const char *path = getenv("DRM_SHIM_RECORD");
+    const char *env;
+    unsigned long mb = RECORD_DEFAULT_MB;
+    uint32_t first;
+    size_t size;
+    unsigned int i;
+    void *map;
+    int fd;
+
+    if (path == NULL || *path == '\0')
+        return;
+    env = getenv("DRM_SHIM_RECORD_SIZE");
+    if (env != NULL && strtoul(env, NULL, 0) > 0)
+        mb = strtoul(env, NULL, 0);
+    size = mb << 20;
+    first = sizeof(*rec_hdr) + shim_func_count * SHIM_RECORD_NAMELEN;
+    first = (first + 63) & ~63U;
+    if (size < first + RECORD_CHUNK_SIZE)
+        return;
+    fd = shim_trace_open(path, O_RDWR|O_CREAT|O_EXCL);
+    if (fd < 0)
+        return;
+    if (ftruncate(fd, size) < 0) {
+        close(fd);
+        return;
+    }
+    map = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return;
+    rec_base = map;
+    rec_hdr = map;
+    memcpy(rec_hdr->magic, SHIM_RECORD_MAGIC, sizeof(rec_hdr->magic));
+    rec_hdr->version = SHIM_RECORD_VERSION;
+    rec_hdr->nfuncs = shim_func_count;
+    rec_hdr->chunk_size = RECORD_CHUNK_SIZE;
+    rec_hdr->first_chunk = first;
+    rec_hdr->file_size = size;
+    rec_hdr->next_chunk = first;
+    rec_hdr->start_ns = shim_now_ns();
+    for (i = 0; i < shim_func_count; i++)
+        strncpy(rec_base + sizeof(*rec_hdr) + i * SHIM_RECORD_NAMELEN,
+                shim_func_names[i], SHIM_RECORD_NAMELEN - 1);
+    __atomic_fetch_or(&shim_instr_on, SHIM_INSTR_RECORD, __ATOMIC_RELEASE);
+}
+
+static void __attribute__((destructor))
+shim_record_fini (void)
+{
+    __atomic_fetch_and(&shim_instr_on, ~SHIM_INSTR_RECORD, __ATOMIC_RELAXED);
+}
+#endif /* SHIM_INSTRUMENTATION */
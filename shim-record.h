@@ -0,0 +1,65 @@
+/*
+ * shim-record.h
+ *
+ * Layout of the call trace files written by the shim's recorder
+ * and read by drm-shim-replay.
+ *
+ * Copyright (c) 2018-2019, Matthew Madison
+ * Distributed under license; see the LICENSE file for details.
+ */
+#ifndef SHIM_RECORD_H_
+#define SHIM_RECORD_H_
+
+#include <stdint.h>
+
+/*
+ * A trace file is a header, a table of function names indexed by
+ * function id, and then a sequence of fixed-size chunks.  Each
+ * thread appends records to the chunk it owns and takes a new one
+ * from the file when it fills up, so the only shared update is
+ * the atomic advance of next_chunk.
+ */
+#define SHIM_RECORD_MAGIC	"DRMSHRC1"
+#define SHIM_RECORD_VERSION	1
+#define SHIM_RECORD_NAMELEN	32
+
+struct shim_record_header {
+    char     magic[8];
+    uint32_t version;
+    uint32_t nfuncs;
+    uint32_t chunk_size;
+    uint32_t first_chunk;	/* file offset of the first chunk */
+    uint64_t file_size;
+    uint64_t next_chunk;	/* file offset of the next free chunk */
+    uint64_t dropped;		/* records lost when the file filled */
+    uint64_t start_ns;		/* CLOCK_MONOTONIC time of record start */
+    uint64_t reserved;
+};
+
+struct shim_record_chunk {
+    uint32_t tid;
+    uint32_t used;		/* bytes of records following this header */
+};
+
+/*
+ * Each record is followed by nargs 64-bit argument words and then
+ * payload bytes, padded to a multiple of 8.  For drmIoctl, the
+ * payload is the argument structure as passed in, _IOC_SIZE(request)
+ * bytes long.  Bit n of ptrmask is set if argument n is a pointer.
+ * complete is set once the call has returned and ret and
+ * duration_ns are valid.
+ */
+struct shim_record_entry {
+    uint64_t start_ns;		/* relative to header start_ns */
+    uint64_t ret;
+    uint32_t duration_ns;
+    uint16_t func;
+    uint16_t size;		/* total bytes, including this header */
+    uint16_t ptrmask;
+    uint16_t payload;
+    uint8_t  nargs;
+    uint8_t  complete;
+    uint8_t  pad[2];
+};
+
+#endif /* SHIM_RECORD_H_ */
@@ -0,0 +1,353 @@
+/*
+ * shim-slab.c
+ *
+ * Sub-allocator for small GEM buffers.  Requests of up to
+ * SLAB_MAX_CHUNK bytes are carved out of larger GEM objects (slabs),
+ * each dedicated to one power-of-two chunk size, so that uniform
+ * buffers, cursors and the like do not each cost a kernel object
+ * and a whole page.  Allocations are returned as (handle, offset).
+ *
+ * Copyright (c) 2018-2019, Matthew Madison
+ * Distributed under license; see the LICENSE file for details.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include "xf86drm.h"
+#include "tegra_drm.h"
+#include "drm-shim.h"
+
+#define SLAB_PAGE_SIZE		4096U
+#define SLAB_MIN_SHIFT		6	/* 64-byte chunks, one cache line */
+#define SLAB_MAX_SHIFT		12
+#define SLAB_MAX_CHUNK		(1U << SLAB_MAX_SHIFT)
+#define SLAB_NCLASSES		(SLAB_MAX_SHIFT - SLAB_MIN_SHIFT + 1)
+#define SLAB_LARGE		SLAB_NCLASSES
+#define SLAB_DEFAULT_SIZE	(64U << 10)
+#define SLAB_MIN_SIZE		(16U << 10)
+#define SLAB_MAX_SIZE		(4U << 20)
+
+/*
+ * A slab tracks its free chunks in a bitmap, one bit per chunk and
+ * set when the chunk is free, and the size asked for by each
+ * allocated chunk, for the fragmentation statistics.  Allocations
+ * too large for a chunk get a GEM object to themselves, which is
+ * recorded as a slab of class SLAB_LARGE with a single chunk.
+ *
+ * Each class's slabs are on a list with those that have free
+ * chunks ahead of those that are full, so an allocation only needs
+ * to look at the first.
+ */
+struct slab {
+    struct slab *next, *prev;
+    uint32_t handle;
+    uint32_t size;
+    unsigned int cls;
+    unsigned int nchunks;
+    unsigned int nfree;
+    unsigned int hint;		/* first bitmap word that may have a free chunk */
+    uint32_t large_requested;	/* size asked for, for SLAB_LARGE */
+    uint16_t *requested;
+    uint64_t bitmap[];
+};
+
+struct _drmShimSlab {
+    int fd;
+    uint32_t flags;
+    uint32_t slab_size;
+    pthread_mutex_t lock;
+    struct slab classes[SLAB_NCLASSES];
+    struct slab **by_handle;
+    uint32_t nhandles;
+    drmShimSlabStats stats;
+};
+
+static inline void
+slab_list_del (struct slab *s)
+{
+    s->prev->next = s->next;
+    s->next->prev = s->prev;
+}
+
+static inline void
+slab_list_add (struct slab *head, struct slab *s)
+{
+    s->next = head->next;
+    s->prev = head;
+    head->next->prev = s;
+    head->next = s;
+}
+
+static inline void
+slab_list_add_tail (struct slab *head, struct slab *s)
+{
+    slab_list_add(head->prev, s);
+}
+
+/*
+ * slab_size is rounded up to a power of two between 16KiB and 4MiB;
+ * 0 selects 64KiB.  flags are passed on to DRM_IOCTL_TEGRA_GEM_CREATE
+ * for every object the allocator creates.
+ */
+drmShimSlabPtr
+drmShimSlabCreate (int fd, uint32_t slab_size, uint32_t flags)
+{
+    drmShimSlabPtr alloc;
+    unsigned int i;
+
+    if (fd < 0)
+        return NULL;
+    if (slab_size == 0)
+        slab_size = SLAB_DEFAULT_SIZE;
+    else if (slab_size <= SLAB_MIN_SIZE)
+        slab_size = SLAB_MIN_SIZE;
+    else if (slab_size >= SLAB_MAX_SIZE)
+        slab_size = SLAB_MAX_SIZE;
+    else
+        slab_size = 1U << (32 - __builtin_clz(slab_size - 1));
+    alloc = calloc(1, sizeof(*alloc));
+    if (alloc == NULL)
+        return NULL;
+    alloc->fd = fd;
+    alloc->flags = flags;
+    alloc->slab_size = slab_size;
+    pthread_mutex_init(&alloc->lock, NULL);
+    for (i = 0; i < SLAB_NCLASSES; i++)
+        alloc->classes[i].next = alloc->classes[i].prev = &alloc->classes[i];
+    return alloc;
+}
+
+/* Called with the lock held. */
+static void
+slab_release (drmShimSlabPtr alloc, struct slab *s)
+{
+    struct drm_gem_close args;
+
+    memset(&args, 0, sizeof(args));
+    args.handle = s->handle;
+    drmIoctl(alloc->fd, DRM_IOCTL_GEM_CLOSE, &args);
+    alloc->stats.gem_closes++;
+    alloc->stats.slab_bytes -= s->size;
+    if (s->cls != SLAB_LARGE)
+        alloc->stats.slabs--;
+    alloc->by_handle[s->handle] = NULL;
+    free(s->requested);
+    free(s);
+}
+
+/*
+ * Outstanding allocations are freed along with the allocator.
+ */
+void
+drmShimSlabDestroy (drmShimSlabPtr alloc)
+{
+    uint32_t i;
+
+    if (alloc == NULL)
+        return;
+    for (i = 0; i < alloc->nhandles; i++)
+        if (alloc->by_handle[i] != NULL)
+            slab_release(alloc, alloc->by_handle[i]);
+    free(alloc->by_handle);
+    pthread_mutex_destroy(&alloc->lock);
+    free(alloc);
+}
+
+/* Creates a GEM object and records it.  Called with the lock held. */
+static struct slab *
+slab_new (drmShimSlabPtr alloc, unsigned int cls, uint32_t size)
+{
+    struct drm_tegra_gem_create args;
+    struct slab **tbl, *s;
+    unsigned int nchunks = 1, nwords = 0, i;
+    uint32_t n;
+
+    if (cls != SLAB_LARGE) {
+        nchunks = alloc->slab_size >> (cls + SLAB_MIN_SHIFT);
+        nwords = (nchunks + 63) / 64;
+    }
+    s = calloc(1, sizeof(*s) + nwords * sizeof(uint64_t));
+    if (s == NULL)
+        return NULL;
+    if (cls != SLAB_LARGE) {
+        s->requested = calloc(nchunks, sizeof(*s->requested));
+        if (s->requested == NULL) {
+            free(s);
+            return NULL;
+        }
+        for (i = 0; i < nwords; i++)
+            s->bitmap[i] = ~0ULL;
+        if (nchunks % 64 != 0)
+            s->bitmap[nwords - 1] = (1ULL << (nchunks % 64)) - 1;
+    }
+    memset(&args, 0, sizeof(args));
+    args.size = size;
+    args.flags = alloc->flags;
+    if (drmIoctl(alloc->fd, DRM_IOCTL_TEGRA_GEM_CREATE, &args) != 0)
+        goto fail;
+    if (args.handle >= alloc->nhandles) {
+        for (n = alloc->nhandles ? alloc->nhandles : 256; n <= args.handle; n *= 2);
+        tbl = realloc(alloc->by_handle, n * sizeof(*tbl));
+        if (tbl == NULL) {
+            struct drm_gem_close close_args = { .handle = args.handle };
+            drmIoctl(alloc->fd, DRM_IOCTL_GEM_CLOSE, &close_args);
+            errno = ENOMEM;
+            goto fail;
+        }
+        memset(tbl + alloc->nhandles, 0, (n - alloc->nhandles) * sizeof(*tbl));
+        alloc->by_handle = tbl;
+        alloc->nhandles = n;
+    }
+    s->handle = args.handle;
+    s->size = size;
+    s->cls = cls;
+    s->nchunks = nchunks;
+    s->nfree = nchunks;
+    alloc->by_handle[s->handle] = s;
+    alloc->stats.gem_creates++;
+    alloc->stats.slab_bytes += size;
+    if (cls != SLAB_LARGE)
+        alloc->stats.slabs++;
+    return s;
+
+  fail:
+    free(s->requested);
+    free(s);
+    return NULL;
+}
+
+/*
+ * Offsets are aligned to the chunk size, which is the larger of
+ * size and align rounded up to a power of two, so align may be up
+ * to SLAB_MAX_CHUNK.  Returns 0 or a negative errno.
+ */
+int
+drmShimSlabAlloc (drmShimSlabPtr alloc, uint32_t size, uint32_t align,
+                  uint32_t *handle, uint32_t *offset)
+{
+    struct slab *head, *s;
+    unsigned int cls, w, bit;
+    uint32_t need;
+    int ret = 0;
+
+    if (alloc == NULL || handle == NULL || offset == NULL || size == 0 ||
+        size > -SLAB_PAGE_SIZE || (align & (align - 1)) != 0 || align > SLAB_MAX_CHUNK)
+        return -EINVAL;
+    need = size > align ? size : align;
+    pthread_mutex_lock(&alloc->lock);
+    alloc->stats.allocs++;
+    if (need > SLAB_MAX_CHUNK) {
+        s = slab_new(alloc, SLAB_LARGE, (size + SLAB_PAGE_SIZE - 1) & ~(SLAB_PAGE_SIZE - 1));
+        if (s == NULL) {
+            ret = -errno;
+            goto out;
+        }
+        s->nfree = 0;
+        s->large_requested = size;
+        alloc->stats.large_objects++;
+        alloc->stats.used_bytes += s->size;
+        alloc->stats.requested_bytes += size;
+        *handle = s->handle;
+        *offset = 0;
+        goto out;
+    }
+    cls = need <= (1U << SLAB_MIN_SHIFT) ? 0 : 32 - __builtin_clz(need - 1) - SLAB_MIN_SHIFT;
+    head = &alloc->classes[cls];
+    s = head->next;
+    if (s == head || s->nfree == 0) {
+        s = slab_new(alloc, cls, alloc->slab_size);
+        if (s == NULL) {
+            ret = -errno;
+            goto out;
+        }
+        slab_list_add(head, s);
+    }
+    for (w = s->hint; s->bitmap[w] == 0; w++);
+    bit = __builtin_ctzll(s->bitmap[w]);
+    s->bitmap[w] &= ~(1ULL << bit);
+    s->hint = w;
+    s->requested[w * 64 + bit] = (uint16_t) (size - 1);
+    if (--s->nfree == 0) {
+        slab_list_del(s);
+        slab_list_add_tail(head, s);
+    }
+    alloc->stats.used_bytes += 1U << (cls + SLAB_MIN_SHIFT);
+    alloc->stats.requested_bytes += size;
+    *handle = s->handle;
+    *offset = (w * 64 + bit) << (cls + SLAB_MIN_SHIFT);
+  out:
+    pthread_mutex_unlock(&alloc->lock);
+    return ret;
+}
+
+/*
+ * A slab left with nothing allocated is kept only while it is the
+ * only one in its class with free chunks, so a workload that
+ * allocates and frees in a loop does not create and close a slab
+ * every time.
+ */
+int
+drmShimSlabFree (drmShimSlabPtr alloc, uint32_t handle, uint32_t offset)
+{
+    struct slab *s, *head, *other;
+    unsigned int shift, idx;
+
+    if (alloc == NULL)
+        return -EINVAL;
+    pthread_mutex_lock(&alloc->lock);
+    s = handle < alloc->nhandles ? alloc->by_handle[handle] : NULL;
+    if (s == NULL)
+        goto invalid;
+    if (s->cls == SLAB_LARGE) {
+        if (offset != 0 || s->nfree != 0)
+            goto invalid;
+        alloc->stats.frees++;
+        alloc->stats.large_objects--;
+        alloc->stats.used_bytes -= s->size;
+        alloc->stats.requested_bytes -= s->large_requested;
+        slab_release(alloc, s);
+        pthread_mutex_unlock(&alloc->lock);
+        return 0;
+    }
+    shift = s->cls + SLAB_MIN_SHIFT;
+    idx = offset >> shift;
+    if ((offset & ((1U << shift) - 1)) != 0 || idx >= s->nchunks ||
+        (s->bitmap[idx / 64] & (1ULL << (idx % 64))) != 0)
+        goto invalid;
+    alloc->stats.frees++;
+    s->bitmap[idx / 64] |= 1ULL << (idx % 64);
+    if (idx / 64 < s->hint)
+        s->hint = idx / 64;
+    alloc->stats.used_bytes -= 1U << shift;
+    alloc->stats.requested_bytes -= s->requested[idx] + 1U;
+    head = &alloc->classes[s->cls];
+    if (s->nfree++ == 0) {
+        slab_list_del(s);
+        slab_list_add(head, s);
+    }
+    if (s->nfree == s->nchunks) {
+        other = head->next != s ? head->next : s->next;
+        if (other != head && other->nfree > 0) {
+            slab_list_del(s);
+            slab_release(alloc, s);
+        }
+    }
+    pthread_mutex_unlock(&alloc->lock);
+    return 0;
+
+  invalid:
+    pthread_mutex_unlock(&alloc->lock);
+    return -EINVAL;
+}
+
+void
+drmShimSlabGetStats (drmShimSlabPtr alloc, drmShimSlabStats *stats)
+{
+    if (alloc == NULL || stats == NULL)
+        return;
+    pthread_mutex_lock(&alloc->lock);
+    *stats = alloc->stats;
+    pthread_mutex_unlock(&alloc->lock);
+}
@@ -0,0 +1,247 @@
+/*
+ * shim-stats.c
+ *
+ * Per-function call counters and latency histograms for the
+ * shim's forwarding wrappers.
+ *
+ * Copyright (c) 2018-2019, Matthew Madison
+ * Distributed under license; see the LICENSE file for details.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include "drm-shim.h"
+#include "shim-private.h"
+#include "config.h"
+
+int shim_instr_on;
+
+#ifdef SHIM_INSTRUMENTATION
+/*
+ * Each thread records into its own block, so the hot path is
+ * plain single-writer stores.  Blocks are pushed onto a global
+ * list the first time a thread makes a call and are never freed,
+ * so counts from threads that have exited are kept.  Readers sum
+ * over the list with relaxed loads.
+ */
+struct func_stats {
+    uint64_t calls;
+    uint64_t total_ns;
+    uint64_t hist[DRM_SHIM_HIST_BUCKETS];
+};
+
+struct thread_stats {
+    struct thread_stats *next;
+    struct func_stats funcs[];
+};
+
+static struct thread_stats *all_threads;
+static __thread struct thread_stats *my_stats;
+static int dump_fd = -1;
+
+static struct thread_stats *
+thread_stats_alloc (void)
+{
+    struct thread_stats *ts;
+
+    ts = calloc(1, sizeof(*ts) + shim_func_count * sizeof(ts->funcs[0]));
+    if (ts == NULL)
+        return NULL;
+    ts->next = __atomic_load_n(&all_threads, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&all_threads, &ts->next, ts, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    my_stats = ts;
+    return ts;
+}
+
+static inline void
+counter_add (uint64_t *ctr, uint64_t val)
+{
+    __atomic_store_n(ctr, *ctr + val, __ATOMIC_RELAXED);
+}
+
+void
+shim_stats_add (unsigned int id, uint64_t elapsed)
+{
+    struct thread_stats *ts = my_stats;
+    struct func_stats *fs;
+    unsigned int bucket;
+
+    if (ts == NULL && (ts = thread_stats_alloc()) == NULL)
+        return;
+    fs = &ts->funcs[id];
+    bucket = (elapsed == 0 ? 0 : 64 - __builtin_clzll(elapsed));
+    if (bucket >= DRM_SHIM_HIST_BUCKETS)
+        bucket = DRM_SHIM_HIST_BUCKETS - 1;
+    counter_add(&fs->calls, 1);
+    counter_add(&fs->total_ns, elapsed);
+    counter_add(&fs->hist[bucket], 1);
+}
+
+int
+drmShimStatsGet (unsigned int index, drmShimCallStatsPtr stats)
+{
+    struct thread_stats *ts;
+    unsigned int i;
+
+    if (index >= shim_func_count)
+        return -EINVAL;
+    memset(stats, 0, sizeof(*stats));
+    stats->name = shim_func_names[index];
+    for (ts = __atomic_load_n(&all_threads, __ATOMIC_ACQUIRE); ts != NULL; ts = ts->next) {
+        struct func_stats *fs = &ts->funcs[index];
+        stats->calls += __atomic_load_n(&fs->calls, __ATOMIC_RELAXED);
+        stats->total_ns += __atomic_load_n(&fs->total_ns, __ATOMIC_RELAXED);
+        for (i = 0; i < DRM_SHIM_HIST_BUCKETS; i++)
+            stats->hist[i] += __atomic_load_n(&fs->hist[i], __ATOMIC_RELAXED);
+    }
+    return 0;
+}
+
+/*
+ * The dump may run from a signal handler, so it formats by hand
+ * and only uses write().
+ */
+static char *
+fmt_u64 (char *p, uint64_t val)
+{
+    char tmp[24];
+    int n = 0;
+
+    do {
+        tmp[n++] = '0' + (val % 10);
+        val /= 10;
+    } while (val != 0);
+    while (n > 0)
+        *p++ = tmp[--n];
+    return p;
+}
+
+static char *
+fmt_str (char *p, const char *s)
+{
+    while (*s)
+        *p++ = *s++;
+    return p;
+}
+
+void
+drmShimStatsDump (int fd)
+{
+    drmShimCallStats st;
+    char buf[128 + DRM_SHIM_HIST_BUCKETS * 22];
+    unsigned int i, b;
+
+    for (i = 0; i < shim_func_count; i++) {
+        char *p = buf;
+        if (drmShimStatsGet(i, &st) < 0 || st.calls == 0)
+            continue;
+        p = fmt_str(p, st.name);
+        p = fmt_str(p, " calls=");
+        p = fmt_u64(p, st.calls);
+        p = fmt_str(p, " total_ns=");
+        p = fmt_u64(p, st.total_ns);
+        p = fmt_str(p, " hist=");
+        for (b = 0; b < DRM_SHIM_HIST_BUCKETS; b++) {
+            if (b > 0)
+                *p++ = ',';
+            p = fmt_u64(p, st.hist[b]);
+        }
+        *p++ = '\n';
+        if (write(fd, buf, p - buf) < 0)
+            return;
+    }
+}
+
+static void
+stats_signal (int sig)
+{
+    int saved_errno = errno;
+
+    drmShimStatsDump(dump_fd);
+    errno = saved_errno;
+}
+
+/*
+ * DRM_SHIM_STATS enables collection.  A value of "1" dumps the
+ * statistics to stderr at exit; any other value is taken as the
+ * path of a file to append the dump to, with "%p" replaced by the
+ * process ID.  DRM_SHIM_STATS_SIGNAL names a signal number that
+ * also triggers a dump.
+ */
+static void __attribute__((constructor))
+shim_stats_init (void)
+{
+    const char *env = getenv("DRM_SHIM_STATS");
+    const char *sigenv;
+
+    if (env == NULL || *env == '\0' || strcmp(env, "0") == 0)
+        return;
+    if (strcmp(env, "1") == 0)
+        dump_fd = STDERR_FILENO;
+    else
+        dump_fd = shim_trace_open(env, O_WRONLY|O_CREAT|O_APPEND);
+    sigenv = getenv("DRM_SHIM_STATS_SIGNAL");
+    if (sigenv != NULL && dump_fd >= 0) {
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = stats_signal;
+        sa.sa_flags = SA_RESTART;
+        sigemptyset(&sa.sa_mask);
+        sigaction(atoi(sigenv), &sa, NULL);
+    }
+    __atomic_fetch_or(&shim_instr_on, SHIM_INSTR_STATS, __ATOMIC_RELAXED);
+}
+
+static void __attribute__((destructor))
+shim_stats_fini (void)
+{
+    if (!(shim_instr_on & SHIM_INSTR_STATS))
+        return;
+    __atomic_fetch_and(&shim_instr_on, ~SHIM_INSTR_STATS, __ATOMIC_RELAXED);
+    if (dump_fd >= 0)
+        drmShimStatsDump(dump_fd);
+}
+
+int
+drmShimStatsEnabled (void)
+{
+    return (shim_instr_on & SHIM_INSTR_STATS) != 0;
+}
+
+unsigned int
+drmShimStatsCount (void)
+{
+    return shim_func_count;
+}
+
+#else /* !SHIM_INSTRUMENTATION */
+
+int
+drmShimStatsEnabled (void)
+{
+    return 0;
+}
+
+unsigned int
+drmShimStatsCount (void)
+{
+    return 0;
+}
+
+int
+drmShimStatsGet (unsigned int index, drmShimCallStatsPtr stats)
+{
+    return -ENOSYS;
+}
+
+void
+drmShimStatsDump (int fd)
+{
+}
+
+#endif /* SHIM_INSTRUMENTATION */
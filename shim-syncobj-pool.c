@@ -0,0 +1,260 @@
+/*
+ * shim-syncobj-pool.c
+ *
+ * Pool of syncobj handles, so a pipeline that uses a fresh syncobj
+ * per frame does not pay for a create and a destroy ioctl each time.
+ *
+ * Copyright (c) 2018-2019, Matthew Madison
+ * Distributed under license; see the LICENSE file for details.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include "xf86drm.h"
+#include "drm-shim.h"
+
+/* returned handles are reset this many at a time */
+#define POOL_RESET_BATCH	32
+
+/*
+ * Every POOL_TRIM_INTERVAL gets, handles that stayed free the whole
+ * time (beyond POOL_MIN_FREE) are more than demand needs; half of
+ * them are destroyed.
+ */
+#define POOL_TRIM_INTERVAL	1024
+#define POOL_MIN_FREE		8
+
+/*
+ * Handles returned to the pool wait on the dirty list until a batch
+ * of them can be reset with one ioctl, then move to the free list.
+ * A get that finds the free list empty creates a new handle unless
+ * a full batch is waiting, so the pool grows to hold one batch
+ * more than the number of handles in use, and a pipeline with a
+ * steady number of handles in flight makes one reset ioctl per
+ * POOL_RESET_BATCH frames.  Handles handed out are marked in a
+ * bitmap indexed by handle, so a put of one the pool does not own
+ * is refused.
+ */
+struct _drmShimSyncobjPool {
+    int fd;
+    pthread_mutex_t lock;
+    uint32_t *free;
+    unsigned int nfree;
+    unsigned int free_low;
+    unsigned int capacity;
+    uint32_t dirty[POOL_RESET_BATCH];
+    unsigned int ndirty;
+    unsigned int in_use;
+    uint32_t *out;
+    unsigned int nout;
+    unsigned int since_trim;
+    drmShimSyncobjPoolStats stats;
+};
+
+drmShimSyncobjPoolPtr
+drmShimSyncobjPoolCreate (int fd)
+{
+    drmShimSyncobjPoolPtr pool;
+
+    if (fd < 0)
+        return NULL;
+    pool = calloc(1, sizeof(*pool));
+    if (pool == NULL)
+        return NULL;
+    pool->fd = fd;
+    pthread_mutex_init(&pool->lock, NULL);
+    return pool;
+}
+
+/* Called with the lock held. */
+static int
+pool_mark (drmShimSyncobjPoolPtr pool, uint32_t handle)
+{
+    unsigned int words = handle / 32 + 1, n;
+    uint32_t *out;
+
+    if (words > pool->nout) {
+        for (n = pool->nout ? pool->nout : 8; n < words; n *= 2);
+        out = realloc(pool->out, n * sizeof(*out));
+        if (out == NULL)
+            return -ENOMEM;
+        memset(out + pool->nout, 0, (n - pool->nout) * sizeof(*out));
+        pool->out = out;
+        pool->nout = n;
+    }
+    pool->out[handle / 32] |= 1U << (handle % 32);
+    pool->in_use++;
+    return 0;
+}
+
+/* Returns -EINVAL if the handle is not out.  Called with the lock held. */
+static int
+pool_unmark (drmShimSyncobjPoolPtr pool, uint32_t handle)
+{
+    uint32_t bit = 1U << (handle % 32);
+
+    if (handle / 32 >= pool->nout || !(pool->out[handle / 32] & bit))
+        return -EINVAL;
+    pool->out[handle / 32] &= ~bit;
+    pool->in_use--;
+    return 0;
+}
+
+/* Called with the lock held. */
+static int
+pool_flush (drmShimSyncobjPoolPtr pool)
+{
+    unsigned int i;
+    int ret;
+
+    if (pool->ndirty == 0)
+        return 0;
+    if (pool->nfree + pool->ndirty > pool->capacity) {
+        unsigned int cap = (pool->nfree + pool->ndirty) * 2;
+        uint32_t *handles = realloc(pool->free, cap * sizeof(*handles));
+        if (handles == NULL)
+            return -ENOMEM;
+        pool->free = handles;
+        pool->capacity = cap;
+    }
+    ret = drmSyncobjReset(pool->fd, pool->dirty, pool->ndirty);
+    if (ret != 0) {
+        /* don't hand out handles in an unknown state */
+        for (i = 0; i < pool->ndirty; i++)
+            drmSyncobjDestroy(pool->fd, pool->dirty[i]);
+        pool->stats.destroys += pool->ndirty;
+        pool->ndirty = 0;
+        return ret;
+    }
+    memcpy(pool->free + pool->nfree, pool->dirty, pool->ndirty * sizeof(*pool->dirty));
+    pool->nfree += pool->ndirty;
+    pool->ndirty = 0;
+    pool->stats.reset_batches++;
+    return 0;
+}
+
+/* Called with the lock held. */
+static void
+pool_trim (drmShimSyncobjPoolPtr pool)
+{
+    unsigned int excess;
+
+    pool->since_trim = 0;
+    if (pool->free_low > POOL_MIN_FREE) {
+        excess = (pool->free_low - POOL_MIN_FREE) / 2;
+        while (excess-- > 0 && pool->nfree > 0) {
+            drmSyncobjDestroy(pool->fd, pool->free[--pool->nfree]);
+            pool->stats.destroys++;
+        }
+    }
+    pool->free_low = pool->nfree;
+}
+
+/*
+ * Hands out a reset syncobj, signalled first if flags includes
+ * DRM_SYNCOBJ_CREATE_SIGNALED.  A handle that cannot be tracked or
+ * signalled is destroyed rather than handed out or kept.
+ */
+int
+drmShimSyncobjPoolGet (drmShimSyncobjPoolPtr pool, uint32_t flags, uint32_t *handle)
+{
+    int ret = 0;
+
+    if (pool == NULL || handle == NULL)
+        return -EINVAL;
+    pthread_mutex_lock(&pool->lock);
+    pool->stats.gets++;
+    if (pool->nfree == 0 && pool->ndirty == POOL_RESET_BATCH)
+        pool_flush(pool);
+    if (pool->nfree > 0) {
+        *handle = pool->free[--pool->nfree];
+        if (pool->nfree < pool->free_low)
+            pool->free_low = pool->nfree;
+        pool->stats.hits++;
+    } else {
+        pool->free_low = 0;
+        if (drmSyncobjCreate(pool->fd, 0, handle) != 0)
+            ret = -errno;
+        else
+            pool->stats.creates++;
+    }
+    if (ret == 0 && (ret = pool_mark(pool, *handle)) < 0) {
+        drmSyncobjDestroy(pool->fd, *handle);
+        pool->stats.destroys++;
+    }
+    if (++pool->since_trim >= POOL_TRIM_INTERVAL)
+        pool_trim(pool);
+    pthread_mutex_unlock(&pool->lock);
+    if (ret == 0 && (flags & DRM_SYNCOBJ_CREATE_SIGNALED) &&
+        drmSyncobjSignal(pool->fd, handle, 1) != 0) {
+        ret = -errno;
+        pthread_mutex_lock(&pool->lock);
+        pool_unmark(pool, *handle);
+        pool->stats.destroys++;
+        pthread_mutex_unlock(&pool->lock);
+        drmSyncobjDestroy(pool->fd, *handle);
+    }
+    return ret;
+}
+
+int
+drmShimSyncobjPoolPut (drmShimSyncobjPoolPtr pool, uint32_t handle)
+{
+    int ret = 0;
+
+    if (pool == NULL || handle == 0)
+        return -EINVAL;
+    pthread_mutex_lock(&pool->lock);
+    if (pool_unmark(pool, handle) < 0) {
+        pthread_mutex_unlock(&pool->lock);
+        return -EINVAL;
+    }
+    if (pool->ndirty == POOL_RESET_BATCH)
+        pool_flush(pool);
+    pool->stats.puts++;
+    if (pool->ndirty < POOL_RESET_BATCH)
+        pool->dirty[pool->ndirty++] = handle;
+    else {
+        /* no room to keep it */
+        if (drmSyncobjDestroy(pool->fd, handle) != 0)
+            ret = -errno;
+        pool->stats.destroys++;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return ret;
+}
+
+void
+drmShimSyncobjPoolGetStats (drmShimSyncobjPoolPtr pool, drmShimSyncobjPoolStats *stats)
+{
+    if (pool == NULL || stats == NULL)
+        return;
+    pthread_mutex_lock(&pool->lock);
+    *stats = pool->stats;
+    stats->free = pool->nfree + pool->ndirty;
+    stats->in_use = pool->in_use;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * Destroys every pooled handle.  Handles still handed out are left
+ * to the caller.
+ */
+void
+drmShimSyncobjPoolDestroy (drmShimSyncobjPoolPtr pool)
+{
+    unsigned int i;
+
+    if (pool == NULL)
+        return;
+    for (i = 0; i < pool->nfree; i++)
+        drmSyncobjDestroy(pool->fd, pool->free[i]);
+    for (i = 0; i < pool->ndirty; i++)
+        drmSyncobjDestroy(pool->fd, pool->dirty[i]);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->out);
+    free(pool->free);
+    free(pool);
+}
@@ -0,0 +1,427 @@
+/*
+ * shim-syncobj.c
+ *
+ * Coalescing of concurrent drmSyncobjWait and drmSyncobjTimelineWait
+ * calls.  When enabled with DRM_SHIM_SYNCOBJ_COALESCE, threads
+ * waiting on the same fd share one blocked wait-for-any ioctl over
+ * all of their handles, instead of blocking one ioctl each.
+ *
+ * Copyright (c) 2018-2019, Matthew Madison
+ * Distributed under license; see the LICENSE file for details.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "xf86drm.h"
+#include "shim-private.h"
+
+#define COALESCE_MAX_GROUPS	16
+
+#ifndef DRM_SYNCOBJ_WAIT_FLAGS_WAIT_AVAILABLE
+#define DRM_SYNCOBJ_WAIT_FLAGS_WAIT_AVAILABLE (1 << 2)
+#endif
+
+typedef int (*syncobj_wait_fn)(int fd, uint32_t *handles, unsigned num_handles,
+                               int64_t timeout_nsec, unsigned flags,
+                               uint32_t *first_signaled);
+typedef int (*timeline_wait_fn)(int fd, uint32_t *handles, uint64_t *points,
+                                unsigned num_handles, int64_t timeout_nsec,
+                                unsigned flags, uint32_t *first_signaled);
+
+static syncobj_wait_fn next_wait;
+static timeline_wait_fn next_timeline_wait;
+static int coalesce_on;
+
+/* result for a waiter the group could not serve */
+#define WAIT_DIRECT 1
+
+struct waiter {
+    struct waiter *next;
+    uint32_t *handles;
+    uint64_t *points;
+    unsigned int count;
+    int64_t deadline;
+    int done;
+    int result;
+    uint32_t first;
+};
+
+/*
+ * Waiters on one fd making the same kind of wait (binary or
+ * timeline) form a group.  The first to arrive becomes the leader
+ * and waits for any handle of any waiter in the group, plus the
+ * group's wake syncobj, which later arrivals signal so the leader
+ * restarts its wait with their handles included.  Each time the
+ * wait returns, the leader completes the waiters it can and wakes
+ * them; when its own wait completes, another waiter takes over.
+ *
+ * The wake syncobj has no fence after it is reset, so merged waits
+ * always use WAIT_FOR_SUBMIT.  Each waiter first polls its own
+ * handles with its own flags, which returns the errors a waiter
+ * without WAIT_FOR_SUBMIT expects for handles with no fence, and
+ * skips the group entirely for handles already signalled.
+ *
+ * A group belongs to the open file the fd named when it was made,
+ * and makes its waits, and its wake syncobj, through a duplicate of
+ * the fd (see shim_file_hold()), so they never reach another file
+ * that has taken the fd number.  The wake syncobj is never destroyed,
+ * since a handle freed while another thread might still signal it
+ * could be reused for one of the caller's syncobjs; it goes with the
+ * file.  A group whose fd is closed, or now names another file, is
+ * retired: it takes no new waiters, and its slot is freed once the
+ * last one leaves.  A group whose wake syncobj cannot be created or
+ * reset is marked broken, and its waiters fall back to waiting
+ * directly.
+ */
+struct wait_group {
+    int used;
+    int fd;
+    int held;
+    int timeline;
+    int leader;
+    int broken;
+    int retired;
+    uint32_t wake;
+    struct waiter *waiters;
+    /* merged wait arrays, used only by the leader */
+    uint32_t *handles;
+    uint64_t *points;
+    struct waiter **owners;
+    unsigned int capacity;
+};
+
+static pthread_mutex_t coalesce_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t coalesce_cond = PTHREAD_COND_INITIALIZER;
+static struct wait_group groups[COALESCE_MAX_GROUPS];
+
+/* Called with coalesce_lock held. */
+static void
+group_release (struct wait_group *g)
+{
+    close(g->held);
+    free(g->handles);
+    free(g->points);
+    free(g->owners);
+    memset(g, 0, sizeof(*g));
+}
+
+/* Called with coalesce_lock held. */
+static void
+group_retire (struct wait_group *g)
+{
+    if (g->leader || g->waiters != NULL)
+        g->retired = 1;
+    else
+        group_release(g);
+}
+
+/*
+ * As for the BO cache, a group whose fd number has been reused for
+ * another file is retired when found, and all of them are checked
+ * before a new group is made.  Called with coalesce_lock held;
+ * returns NULL if the table is full.
+ */
+static struct wait_group *
+group_get (int fd, int timeline)
+{
+    struct wait_group *g, *slot = NULL;
+    unsigned int i;
+
+    for (i = 0; i < COALESCE_MAX_GROUPS; i++) {
+        g = &groups[i];
+        if (g->used && !g->retired && g->fd == fd && !shim_file_same(fd, g->held))
+            group_retire(g);
+        if (!g->used) {
+            if (slot == NULL)
+                slot = g;
+            continue;
+        }
+        if (!g->retired && g->fd == fd && g->timeline == timeline)
+            return g->broken ? NULL : g;
+    }
+    for (i = 0; i < COALESCE_MAX_GROUPS; i++) {
+        g = &groups[i];
+        if (g->used && !g->retired && !shim_file_same(g->fd, g->held)) {
+            group_retire(g);
+            if (!g->used && slot == NULL)
+                slot = g;
+        }
+    }
+    if (slot == NULL || (slot->held = shim_file_hold(fd)) < 0)
+        return NULL;
+    slot->used = 1;
+    slot->fd = fd;
+    slot->timeline = timeline;
+    return slot;
+}
+
+static int
+wait_once (int fd, uint32_t *handles, uint64_t *points, unsigned int count,
+           int64_t timeout_nsec, unsigned int flags, uint32_t *first_signaled)
+{
+    if (points != NULL)
+        return next_timeline_wait(fd, handles, points, count, timeout_nsec,
+                                  flags, first_signaled);
+    return next_wait(fd, handles, count, timeout_nsec, flags, first_signaled);
+}
+
+/* Called with coalesce_lock held; returns the merged count, or 0 */
+static unsigned int
+group_merge (struct wait_group *g, int64_t *deadline)
+{
+    struct waiter *w;
+    unsigned int i, n = 0;
+
+    *deadline = INT64_MAX;
+    for (w = g->waiters; w != NULL; w = w->next) {
+        if (n + w->count + 1 > g->capacity) {
+            unsigned int cap = (n + w->count + 1) * 2;
+            uint32_t *handles = realloc(g->handles, cap * sizeof(*handles));
+            uint64_t *points = handles == NULL ? NULL : realloc(g->points, cap * sizeof(*points));
+            struct waiter **owners = points == NULL ? NULL : realloc(g->owners, cap * sizeof(*owners));
+            if (handles != NULL)
+                g->handles = handles;
+            if (points != NULL)
+                g->points = points;
+            if (owners == NULL)
+                return 0;
+            g->owners = owners;
+            g->capacity = cap;
+        }
+        for (i = 0; i < w->count; i++) {
+            g->handles[n] = w->handles[i];
+            g->points[n] = w->points != NULL ? w->points[i] : 0;
+            g->owners[n++] = w;
+        }
+        if (w->deadline < *deadline)
+            *deadline = w->deadline;
+    }
+    g->handles[n] = g->wake;
+    g->points[n] = 0;
+    g->owners[n++] = NULL;
+    return n;
+}
+
+/*
+ * Called with coalesce_lock held.  Completes and unlinks the waiters
+ * a result applies to: for 0, those waiting on the given handle and
+ * point; for -ETIME, those whose deadline has passed; for anything
+ * else, all of them.
+ */
+static void
+group_complete (struct wait_group *g, int result, uint32_t handle, uint64_t point, int64_t now)
+{
+    struct waiter *w, **pw;
+    unsigned int i;
+
+    for (pw = &g->waiters; (w = *pw) != NULL; ) {
+        if (result == 0) {
+            for (i = 0; i < w->count; i++)
+                if (w->handles[i] == handle && (w->points == NULL || w->points[i] == point))
+                    break;
+            if (i == w->count) {
+                pw = &w->next;
+                continue;
+            }
+            w->first = i;
+        } else if (result == -ETIME && w->deadline > now) {
+            pw = &w->next;
+            continue;
+        }
+        w->result = result;
+        w->done = 1;
+        *pw = w->next;
+    }
+    pthread_cond_broadcast(&coalesce_cond);
+}
+
+/*
+ * Runs merged waits until the leader's own waiter is done.  Called
+ * and returns with coalesce_lock held.
+ */
+static void
+group_lead (struct wait_group *g, struct waiter *self)
+{
+    unsigned int n;
+    int64_t deadline;
+    uint32_t first;
+    int ret;
+
+    g->leader = 1;
+    while (!self->done) {
+        if (g->wake == 0) {
+            if (drmSyncobjCreate(g->held, 0, &g->wake) != 0 || g->wake == 0) {
+                g->wake = 0;
+                g->broken = 1;
+                group_complete(g, WAIT_DIRECT, 0, 0, 0);
+                break;
+            }
+        }
+        /*
+         * The wake syncobj is reset before the waiter list is read,
+         * so a waiter added after the merge is always seen signalled.
+         * If it cannot be reset, every wait would return at once.
+         */
+        pthread_mutex_unlock(&coalesce_lock);
+        ret = drmSyncobjReset(g->held, &g->wake, 1);
+        pthread_mutex_lock(&coalesce_lock);
+        if (ret != 0) {
+            g->broken = 1;
+            group_complete(g, WAIT_DIRECT, 0, 0, 0);
+            break;
+        }
+        n = group_merge(g, &deadline);
+        if (n == 0) {
+            group_complete(g, WAIT_DIRECT, 0, 0, 0);
+            break;
+        }
+        pthread_mutex_unlock(&coalesce_lock);
+        ret = wait_once(g->held, g->handles, g->timeline ? g->points : NULL, n, deadline,
+                        DRM_SYNCOBJ_WAIT_FLAGS_WAIT_FOR_SUBMIT, &first);
+        pthread_mutex_lock(&coalesce_lock);
+        if (ret == 0 && first < n && g->owners[first] == NULL)
+            continue;           /* woken to add new waiters */
+        if (ret == 0 && first < n)
+            group_complete(g, 0, g->handles[first], g->points[first], 0);
+        else if (ret == -ETIME)
+            group_complete(g, -ETIME, 0, 0, (int64_t) shim_now_ns());
+        else {
+            /*
+             * There is no telling whose handle was at fault, so every
+             * waiter retries on its own.
+             */
+            group_complete(g, WAIT_DIRECT, 0, 0, 0);
+        }
+    }
+    g->leader = 0;
+    if (g->retired && g->waiters == NULL)
+        group_release(g);
+    pthread_cond_broadcast(&coalesce_cond);
+}
+
+static int
+coalesced_wait (int fd, uint32_t *handles, uint64_t *points, unsigned int count,
+                int64_t timeout_nsec, unsigned int flags, uint32_t *first_signaled)
+{
+    struct waiter self = { NULL, handles, points, count, timeout_nsec, 0, 0, 0 };
+    struct wait_group *g;
+    int ret;
+
+    ret = wait_once(fd, handles, points, count, 0, flags, first_signaled);
+    if (ret != -ETIME)
+        return ret;
+    pthread_mutex_lock(&coalesce_lock);
+    g = group_get(fd, points != NULL);
+    if (g == NULL) {
+        pthread_mutex_unlock(&coalesce_lock);
+        return WAIT_DIRECT;
+    }
+    self.next = g->waiters;
+    g->waiters = &self;
+    /* signalled with the lock held, so the group cannot be released first */
+    if (g->leader && g->wake != 0)
+        drmSyncobjSignal(g->held, &g->wake, 1);
+    while (!self.done) {
+        if (!g->leader)
+            group_lead(g, &self);
+        else
+            pthread_cond_wait(&coalesce_cond, &coalesce_lock);
+    }
+    pthread_mutex_unlock(&coalesce_lock);
+    if (self.result == 0 && first_signaled != NULL)
+        *first_signaled = self.first;
+    return self.result;
+}
+
+/* Called from the close hook. */
+void
+shim_syncobj_forget_fd (int fd)
+{
+    unsigned int i;
+
+    if (!coalesce_on)
+        return;
+    pthread_mutex_lock(&coalesce_lock);
+    for (i = 0; i < COALESCE_MAX_GROUPS; i++)
+        if (groups[i].used && !groups[i].retired && groups[i].fd == fd)
+            group_retire(&groups[i]);
+    pthread_mutex_unlock(&coalesce_lock);
+}
+
+/*
+ * Waits for all of several handles, polls (a timeout already
+ * past), and waits for availability rather than signalling are not
+ * coalesced.
+ */
+static int
+coalescible (unsigned int count, int64_t timeout_nsec, unsigned int flags)
+{
+    if (count == 0 || (flags & DRM_SYNCOBJ_WAIT_FLAGS_WAIT_AVAILABLE))
+        return 0;
+    if (count > 1 && (flags & DRM_SYNCOBJ_WAIT_FLAGS_WAIT_ALL))
+        return 0;
+    return timeout_nsec > (int64_t) shim_now_ns();
+}
+
+static int
+shim_syncobj_wait (int fd, uint32_t *handles, unsigned num_handles,
+                   int64_t timeout_nsec, unsigned flags, uint32_t *first_signaled)
+{
+    int ret = WAIT_DIRECT;
+
+    if (coalescible(num_handles, timeout_nsec, flags))
+        ret = coalesced_wait(fd, handles, NULL, num_handles, timeout_nsec,
+                             flags & ~DRM_SYNCOBJ_WAIT_FLAGS_WAIT_ALL, first_signaled);
+    if (ret == WAIT_DIRECT)
+        ret = next_wait(fd, handles, num_handles, timeout_nsec, flags, first_signaled);
+    return ret;
+}
+
+static int
+shim_syncobj_timeline_wait (int fd, uint32_t *handles, uint64_t *points,
+                            unsigned num_handles, int64_t timeout_nsec,
+                            unsigned flags, uint32_t *first_signaled)
+{
+    int ret = WAIT_DIRECT;
+
+    if (points != NULL && coalescible(num_handles, timeout_nsec, flags))
+        ret = coalesced_wait(fd, handles, points, num_handles, timeout_nsec,
+                             flags & ~DRM_SYNCOBJ_WAIT_FLAGS_WAIT_ALL, first_signaled);
+    if (ret == WAIT_DIRECT)
+        ret = next_timeline_wait(fd, handles, points, num_handles, timeout_nsec,
+                                 flags, first_signaled);
+    return ret;
+}
+
+static void __attribute__((constructor(101)))
+shim_syncobj_init (void)
+{
+    const char *env = getenv("DRM_SHIM_SYNCOBJ_COALESCE");
+
+    coalesce_on = (env != NULL && *env != '\0' && strcmp(env, "0") != 0);
+}
+
+int
+shim_syncobj_enabled (void)
+{
+    return coalesce_on;
+}
+
+void *
+shim_syncobj_interpose (unsigned int id, void *fn)
+{
+    if (fn == NULL || !coalesce_on)
+        return fn;
+    if (id == FUNCID_drmSyncobjWait) {
+        next_wait = fn;
+        return shim_syncobj_wait;
+    }
+    if (id == FUNCID_drmSyncobjTimelineWait) {
+        next_timeline_wait = fn;
+        return shim_syncobj_timeline_wait;
+    }
+    return fn;
+}
@@ -0,0 +1,475 @@
+/*
+ * shim-syncpt.c
+ *
+ * Syncpoint waits with a cached last-seen value, so thresholds
+ * that have already passed need no ioctl, plus batched waits on
+ * several thresholds and export of a threshold as a pollable fd.
+ *
+ * Copyright (c) 2018-2019, Matthew Madison
+ * Distributed under license; see the LICENSE file for details.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "xf86drm.h"
+#include "tegra_drm.h"
+#include "drm-shim.h"
+#include "shim-private.h"
+
+/*
+ * Syncpoints belong to host1x, not to a DRM fd, so one value per
+ * syncpoint id is cached for the whole process.  Values only move
+ * forward (modulo wraparound), so a cached value that is out of
+ * date can only cause an extra read, never a wrong answer.  Each
+ * entry holds the value in its low 32 bits, with SYNCPT_VALID set
+ * once the syncpoint has been read.
+ */
+#define SYNCPT_CACHE_SIZE	1024
+
+/* wait slice when one ioctl cannot cover every threshold */
+#define SYNCPT_SLICE_MS		2
+
+#define SYNCPT_VALID		(1ULL << 32)
+
+static uint64_t syncpt_cache[SYNCPT_CACHE_SIZE];
+static struct shim_wait_est syncpt_est[SYNCPT_CACHE_SIZE];
+
+static inline int
+passed (uint32_t value, uint32_t thresh)
+{
+    return (int32_t) (value - thresh) >= 0;
+}
+
+static void
+cache_update (uint32_t id, uint32_t value)
+{
+    uint64_t old;
+
+    if (id >= SYNCPT_CACHE_SIZE)
+        return;
+    old = __atomic_load_n(&syncpt_cache[id], __ATOMIC_RELAXED);
+    do {
+        if ((old & SYNCPT_VALID) && passed((uint32_t) old, value))
+            return;
+    } while (!__atomic_compare_exchange_n(&syncpt_cache[id], &old, SYNCPT_VALID | value, 1,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+static inline int
+cache_passed (uint32_t id, uint32_t thresh)
+{
+    uint64_t value;
+
+    if (id >= SYNCPT_CACHE_SIZE)
+        return 0;
+    value = __atomic_load_n(&syncpt_cache[id], __ATOMIC_ACQUIRE);
+    return (value & SYNCPT_VALID) && passed((uint32_t) value, thresh);
+}
+
+int
+drmShimSyncptRead (int fd, uint32_t id, uint32_t *value)
+{
+    struct drm_tegra_syncpt_read args = { .id = id };
+
+    if (drmIoctl(fd, DRM_IOCTL_TEGRA_SYNCPT_READ, &args) < 0)
+        return -errno;
+    cache_update(id, args.value);
+    if (value != NULL)
+        *value = args.value;
+    return 0;
+}
+
+/*
+ * Returns 1 if the threshold has passed, 0 if not, or a negative
+ * error code.  Reads the syncpoint only if the cached value is not
+ * already past the threshold.
+ */
+int
+drmShimSyncptPassed (int fd, uint32_t id, uint32_t thresh)
+{
+    uint32_t value;
+    int ret;
+
+    if (cache_passed(id, thresh))
+        return 1;
+    ret = drmShimSyncptRead(fd, id, &value);
+    if (ret < 0)
+        return ret;
+    return passed(value, thresh);
+}
+
+/*
+ * Not through drmIoctl(), which would restart the wait each time it
+ * timed out; host1x times out with EAGAIN, reported as -ETIMEDOUT.
+ */
+static int
+syncpt_wait (int fd, uint32_t id, uint32_t thresh, uint32_t timeout)
+{
+    struct drm_tegra_syncpt_wait args = { .id = id, .thresh = thresh, .timeout = timeout };
+
+    if (shim_ioctl_eintr(fd, DRM_IOCTL_TEGRA_SYNCPT_WAIT, &args) < 0)
+        return errno == EAGAIN ? -ETIMEDOUT : -errno;
+    cache_update(id, args.value);
+    return 0;
+}
+
+static uint32_t
+remaining_ms (uint32_t timeout, uint64_t deadline)
+{
+    uint64_t now;
+
+    if (timeout == DRM_TEGRA_NO_TIMEOUT)
+        return DRM_TEGRA_NO_TIMEOUT;
+    now = shim_now_ns();
+    return now >= deadline ? 0 : (uint32_t) ((deadline - now + 999999) / 1000000);
+}
+
+/* Limits a spin budget to a wait's timeout */
+static uint64_t
+spin_budget (struct shim_wait_est *est, uint32_t timeout)
+{
+    uint64_t budget;
+
+    if (timeout == 0)
+        return 0;
+    budget = shim_wait_budget(est);
+    if (timeout != DRM_TEGRA_NO_TIMEOUT && budget > (uint64_t) timeout * 1000000ULL)
+        budget = (uint64_t) timeout * 1000000ULL;
+    return budget;
+}
+
+struct syncpt_check {
+    int fd;
+    uint32_t id;
+    uint32_t thresh;
+};
+
+static int
+check_syncpt (void *arg)
+{
+    struct syncpt_check *c = arg;
+
+    return drmShimSyncptPassed(c->fd, c->id, c->thresh);
+}
+
+/*
+ * Waits on one threshold the cache could not answer, spinning on
+ * syncpoint reads first if the wait policy says to.  The time to
+ * completion, spun or blocked, feeds the syncpoint's estimate.
+ */
+static int
+syncpt_wait_policy (int fd, uint32_t id, uint32_t thresh, uint32_t timeout)
+{
+    struct shim_wait_est *est = &syncpt_est[id % SYNCPT_CACHE_SIZE];
+    struct syncpt_check c = { fd, id, thresh };
+    uint64_t start = shim_now_ns();
+    uint64_t budget = spin_budget(est, timeout);
+    int ret;
+
+    if (budget != 0) {
+        ret = shim_wait_spin(budget, check_syncpt, &c);
+        if (ret < 0)
+            return ret;
+        if (ret > 0) {
+            shim_wait_observe(est, shim_now_ns() - start);
+            return 0;
+        }
+        timeout = remaining_ms(timeout, start + (uint64_t) timeout * 1000000ULL);
+    }
+    ret = syncpt_wait(fd, id, thresh, timeout);
+    if (ret == 0)
+        shim_wait_observe(est, shim_now_ns() - start);
+    return ret;
+}
+
+int
+drmShimSyncptWait (int fd, uint32_t id, uint32_t thresh, uint32_t timeout)
+{
+    if (cache_passed(id, thresh))
+        return 0;
+    return syncpt_wait_policy(fd, id, thresh, timeout);
+}
+
+/*
+ * Reads each distinct syncpoint in the set once, skipping those
+ * whose cached value already answers.  Returns the index of the
+ * first threshold found passed, or -1.
+ */
+static int
+read_batch (int fd, const drmShimSyncptThresh *th, unsigned int count, int *err)
+{
+    unsigned int i, j;
+    uint32_t value;
+    int found = -1;
+
+    *err = 0;
+    for (i = 0; i < count; i++) {
+        if (cache_passed(th[i].id, th[i].thresh)) {
+            if (found < 0)
+                found = i;
+            continue;
+        }
+        for (j = 0; j < i && th[j].id != th[i].id; j++);
+        if (j < i && th[j].id < SYNCPT_CACHE_SIZE)
+            continue;           /* already read this round */
+        *err = drmShimSyncptRead(fd, th[i].id, &value);
+        if (*err < 0)
+            return -1;
+        if (found < 0 && passed(value, th[i].thresh))
+            found = i;
+    }
+    return found;
+}
+
+struct batch_check {
+    int fd;
+    const drmShimSyncptThresh *th;
+    unsigned int count;
+    int found;
+};
+
+static int
+check_batch (void *arg)
+{
+    struct batch_check *b = arg;
+    int err;
+
+    b->found = read_batch(b->fd, b->th, b->count, &err);
+    return err < 0 ? err : b->found >= 0;
+}
+
+/*
+ * Waits on several thresholds.  With DRM_SHIM_SYNCPT_WAIT_ALL,
+ * each unexpired threshold is waited on in turn, rechecking the
+ * cache before each wait.  Otherwise the set is read in one pass,
+ * and if nothing has passed yet, the set is polled for the spin
+ * budget of the first threshold's syncpoint.  After that the first
+ * threshold is waited on for a short slice before the set is read
+ * again, since the kernel can only wait on one syncpoint at a time.
+ */
+int
+drmShimSyncptWaitMany (int fd, const drmShimSyncptThresh *th, unsigned int count,
+                       uint32_t timeout, int flags, unsigned int *first)
+{
+    struct batch_check b = { fd, th, count, -1 };
+    uint64_t start, deadline = 0, budget;
+    unsigned int i;
+    uint32_t left;
+    int ret;
+
+    if (count == 0)
+        return 0;
+    if (count == 1) {
+        if (first != NULL)
+            *first = 0;
+        return drmShimSyncptWait(fd, th[0].id, th[0].thresh, timeout);
+    }
+    start = shim_now_ns();
+    if (timeout != DRM_TEGRA_NO_TIMEOUT)
+        deadline = start + (uint64_t) timeout * 1000000ULL;
+
+    if (flags & DRM_SHIM_SYNCPT_WAIT_ALL) {
+        for (i = 0; i < count; i++) {
+            if (cache_passed(th[i].id, th[i].thresh))
+                continue;
+            ret = syncpt_wait_policy(fd, th[i].id, th[i].thresh, remaining_ms(timeout, deadline));
+            if (ret < 0)
+                return ret;
+        }
+        return 0;
+    }
+
+    ret = check_batch(&b);
+    if (ret > 0)
+        goto done;
+    budget = ret == 0 ? spin_budget(&syncpt_est[th[0].id % SYNCPT_CACHE_SIZE], timeout) : 0;
+    if (budget != 0)
+        ret = shim_wait_spin(budget, check_batch, &b);
+    while (ret == 0) {
+        left = remaining_ms(timeout, deadline);
+        if (left == 0)
+            return -ETIMEDOUT;
+        ret = syncpt_wait(fd, th[0].id, th[0].thresh,
+                          left < SYNCPT_SLICE_MS ? left : SYNCPT_SLICE_MS);
+        if (ret < 0 && ret != -ETIMEDOUT)
+            return ret;
+        ret = check_batch(&b);
+    }
+    if (ret < 0)
+        return ret;
+    shim_wait_observe(&syncpt_est[th[b.found].id % SYNCPT_CACHE_SIZE], shim_now_ns() - start);
+  done:
+    if (first != NULL)
+        *first = b.found;
+    return 0;
+}
+
+/*
+ * Exported thresholds are watched by a single waiter thread, started
+ * on first use.  It waits on all of the pending thresholds at once
+ * with drmShimSyncptWaitMany(), a slice at a time so that exports
+ * added meanwhile join the set, and signals each threshold's
+ * eventfd as it passes.  The thread is stopped when the library is
+ * unloaded, signalling the exports still pending so that nothing
+ * polls them forever.
+ */
+struct syncpt_export {
+    struct syncpt_export *next;
+    int drmfd;
+    int efd;
+    uint32_t id;
+    uint32_t thresh;
+};
+
+static pthread_mutex_t export_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t export_cond = PTHREAD_COND_INITIALIZER;
+static struct syncpt_export *exports;
+static int waiter_running;
+static int waiter_stop;
+static pthread_t waiter_thread;
+
+static void
+export_signal (struct syncpt_export *e)
+{
+    uint64_t one = 1;
+    ssize_t n;
+
+    n = write(e->efd, &one, sizeof(one));
+    (void) n;
+    close(e->efd);
+    close(e->drmfd);
+    free(e);
+}
+
+static void *
+export_waiter (void *arg)
+{
+    drmShimSyncptThresh *th = NULL, *nth, one;
+    struct syncpt_export *e, **pe;
+    unsigned int n, i, count, size = 0, first;
+    int fd = -1, ret;
+
+    pthread_mutex_lock(&export_lock);
+    while (!waiter_stop) {
+        if (exports == NULL) {
+            pthread_cond_wait(&export_cond, &export_lock);
+            continue;
+        }
+        for (n = 0, e = exports; e != NULL; e = e->next, n++);
+        if (n > size && (nth = realloc(th, n * sizeof(*th))) != NULL) {
+            th = nth;
+            size = n;
+        }
+        nth = size > 0 ? th : &one;
+        count = n < size ? n : (size > 0 ? size : 1);
+        /* the list is newest first; the oldest thresholds go first */
+        for (e = exports; n > count; e = e->next, n--);
+        for (i = count; i > 0; e = e->next) {
+            nth[--i].id = e->id;
+            nth[i].thresh = e->thresh;
+            fd = e->drmfd;
+        }
+        pthread_mutex_unlock(&export_lock);
+        /* only this thread frees exports, so fd stays open meanwhile */
+        ret = drmShimSyncptWaitMany(fd, nth, count, SYNCPT_SLICE_MS, 0, &first);
+        pthread_mutex_lock(&export_lock);
+        /* the wait leaves fresh values in the cache, unless it failed */
+        for (pe = &exports; (e = *pe) != NULL; ) {
+            if (cache_passed(e->id, e->thresh) ||
+                (ret < 0 && ret != -ETIMEDOUT &&
+                 drmShimSyncptPassed(e->drmfd, e->id, e->thresh) != 0)) {
+                *pe = e->next;
+                export_signal(e);
+            } else
+                pe = &e->next;
+        }
+    }
+    while ((e = exports) != NULL) {
+        exports = e->next;
+        export_signal(e);
+    }
+    pthread_mutex_unlock(&export_lock);
+    free(th);
+    return NULL;
+}
+
+static void __attribute__((destructor))
+export_fini (void)
+{
+    pthread_mutex_lock(&export_lock);
+    if (!waiter_running) {
+        pthread_mutex_unlock(&export_lock);
+        return;
+    }
+    waiter_stop = 1;
+    pthread_cond_signal(&export_cond);
+    pthread_mutex_unlock(&export_lock);
+    pthread_join(waiter_thread, NULL);
+}
+
+/*
+ * Returns an fd that polls readable once the threshold has passed
+ * (or once the syncpoint can no longer be read), or a negative
+ * error code.  The caller closes it.
+ */
+int
+drmShimSyncptExportFd (int fd, uint32_t id, uint32_t thresh)
+{
+    struct syncpt_export *e;
+    int efd, ret;
+
+    efd = eventfd(0, EFD_CLOEXEC);
+    if (efd < 0)
+        return -errno;
+    ret = drmShimSyncptPassed(fd, id, thresh);
+    if (ret != 0) {
+        if (ret < 0) {
+            close(efd);
+            return ret;
+        }
+        eventfd_write(efd, 1);
+        return efd;
+    }
+    e = calloc(1, sizeof(*e));
+    if (e == NULL) {
+        close(efd);
+        return -ENOMEM;
+    }
+    e->id = id;
+    e->thresh = thresh;
+    e->drmfd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    e->efd = fcntl(efd, F_DUPFD_CLOEXEC, 0);
+    if (e->drmfd < 0 || e->efd < 0) {
+        ret = -errno;
+        goto fail;
+    }
+    pthread_mutex_lock(&export_lock);
+    if (!waiter_running) {
+        ret = pthread_create(&waiter_thread, NULL, export_waiter, NULL);
+        if (ret != 0) {
+            pthread_mutex_unlock(&export_lock);
+            ret = -ret;
+            goto fail;
+        }
+        waiter_running = 1;
+    }
+    e->next = exports;
+    exports = e;
+    pthread_cond_signal(&export_cond);
+    pthread_mutex_unlock(&export_lock);
+    return efd;
+
+  fail:
+    if (e->drmfd >= 0)
+        close(e->drmfd);
+    if (e->efd >= 0)
+        close(e->efd);
+    free(e);
+    close(efd);
+    return ret;
+}
@@ -0,0 +1,512 @@
+/*
+ * shim-tile.c
+ *
+ * Copies between linear buffers and Tegra tiled surfaces: the 16x16
+ * tiled layout (16-byte by 16-row tiles) and the block-linear layout
+ * (64-byte by 8-row GOBs, stacked 2^value high in each block).  Whole
+ * tiles and GOBs are copied by kernels chosen for the CPU at load
+ * time; partial ones at the edges of a rectangle go 16 bytes or less
+ * at a time.
+ *
+ * Copyright (c) 2018-2019, Matthew Madison
+ * Distributed under license; see the LICENSE file for details.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "xf86drm.h"
+#include "tegra_drm.h"
+#include "drm-shim.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__aarch64__)
+#include <arm_neon.h>
+#define TILE_HAVE_NEON
+#endif
+
+#define TILE16_SIZE	16	/* bytes and rows in a 16x16 tile */
+#define GOB_WIDTH	64
+#define GOB_HEIGHT	8
+#define GOB_SIZE	512
+#define BLOCK_MAX_VALUE	5
+
+/*
+ * Within a GOB, 16-byte sectors cover 16 bytes of one row.  Sector
+ * k holds row GOB_ROW(k), starting GOB_COL(k) bytes in.
+ */
+#define GOB_ROW(k)	((((k) >> 1) & 6) | ((k) & 1))
+#define GOB_COL(k)	((((k) >> 4) & 1) * 32 + (((k) >> 1) & 1) * 16)
+
+/*
+ * Kernels copy a row of n tiles or GOBs, stride bytes apart in the
+ * tiled surface and side by side in the linear buffer.
+ */
+typedef void (*detile_fn)(const uint8_t *unit, size_t stride, uint32_t n,
+                          uint8_t *linear, size_t pitch);
+typedef void (*tile_fn)(uint8_t *unit, size_t stride, uint32_t n,
+                        const uint8_t *linear, size_t pitch);
+
+struct tile_kernels {
+    const char *name;
+    detile_fn tile16_detile;
+    tile_fn tile16_tile;
+    detile_fn gob_detile;
+    tile_fn gob_tile;
+};
+
+static void
+tile16_detile_generic (const uint8_t *tile, size_t stride, uint32_t n,
+                       uint8_t *linear, size_t pitch)
+{
+    unsigned int r;
+
+    for (; n > 0; n--, tile += stride, linear += 16) {
+        for (r = 0; r < TILE16_SIZE; r++)
+            memcpy(linear + r * pitch, tile + r * 16, 16);
+    }
+}
+
+static void
+tile16_tile_generic (uint8_t *tile, size_t stride, uint32_t n,
+                     const uint8_t *linear, size_t pitch)
+{
+    unsigned int r;
+
+    for (; n > 0; n--, tile += stride, linear += 16) {
+        for (r = 0; r < TILE16_SIZE; r++)
+            memcpy(tile + r * 16, linear + r * pitch, 16);
+    }
+}
+
+static void
+gob_detile_generic (const uint8_t *gob, size_t stride, uint32_t n,
+                    uint8_t *linear, size_t pitch)
+{
+    unsigned int k;
+
+    for (; n > 0; n--, gob += stride, linear += GOB_WIDTH) {
+        for (k = 0; k < GOB_SIZE / 16; k++)
+            memcpy(linear + GOB_ROW(k) * pitch + GOB_COL(k), gob + k * 16, 16);
+    }
+}
+
+static void
+gob_tile_generic (uint8_t *gob, size_t stride, uint32_t n,
+                  const uint8_t *linear, size_t pitch)
+{
+    unsigned int k;
+
+    for (; n > 0; n--, gob += stride, linear += GOB_WIDTH) {
+        for (k = 0; k < GOB_SIZE / 16; k++)
+            memcpy(gob + k * 16, linear + GOB_ROW(k) * pitch + GOB_COL(k), 16);
+    }
+}
+
+static const struct tile_kernels kernels_generic = {
+    "generic",
+    tile16_detile_generic, tile16_tile_generic,
+    gob_detile_generic, gob_tile_generic,
+};
+
+/*
+ * Vector kernels, instantiated for each instruction set with its
+ * 16-byte vector type, loads and stores.  Tiles are copied in memory
+ * order.  GOBs are copied two rows at a time, from the two 64-byte
+ * lines of the GOB that hold them, so every line on either side is
+ * read or written in one go.
+ */
+#define DEFINE_DETILE_KERNELS(isa, attr, vec_t, load_tiled, store_linear) \
+static void attr \
+tile16_detile_##isa (const uint8_t *tile, size_t stride, uint32_t n, \
+                     uint8_t *linear, size_t pitch) \
+{ \
+    vec_t v0, v1, v2, v3; \
+    unsigned int r; \
+ \
+    for (; n > 0; n--, tile += stride, linear += 16) \
+        for (r = 0; r < TILE16_SIZE; r += 4) { \
+            v0 = load_tiled(tile + r * 16); \
+            v1 = load_tiled(tile + r * 16 + 16); \
+            v2 = load_tiled(tile + r * 16 + 32); \
+            v3 = load_tiled(tile + r * 16 + 48); \
+            store_linear(linear + r * pitch, v0); \
+            store_linear(linear + (r + 1) * pitch, v1); \
+            store_linear(linear + (r + 2) * pitch, v2); \
+            store_linear(linear + (r + 3) * pitch, v3); \
+        } \
+} \
+ \
+static void attr \
+gob_detile_##isa (const uint8_t *gob, size_t stride, uint32_t n, \
+                  uint8_t *linear, size_t pitch) \
+{ \
+    vec_t v0, v1, v2, v3, v4, v5, v6, v7; \
+    const uint8_t *src; \
+    uint8_t *row; \
+    unsigned int p; \
+ \
+    for (; n > 0; n--, gob += stride, linear += GOB_WIDTH) \
+        for (p = 0; p < GOB_HEIGHT / 2; p++) { \
+            src = gob + p * 64; \
+            v0 = load_tiled(src); \
+            v1 = load_tiled(src + 16); \
+            v2 = load_tiled(src + 32); \
+            v3 = load_tiled(src + 48); \
+            v4 = load_tiled(src + 256); \
+            v5 = load_tiled(src + 272); \
+            v6 = load_tiled(src + 288); \
+            v7 = load_tiled(src + 304); \
+            row = linear + 2 * p * pitch; \
+            store_linear(row, v0); \
+            store_linear(row + 16, v2); \
+            store_linear(row + 32, v4); \
+            store_linear(row + 48, v6); \
+            row += pitch; \
+            store_linear(row, v1); \
+            store_linear(row + 16, v3); \
+            store_linear(row + 32, v5); \
+            store_linear(row + 48, v7); \
+        } \
+}
+
+#define DEFINE_TILE_KERNELS(isa, attr, vec_t, load_linear, store_tiled) \
+static void attr \
+tile16_tile_##isa (uint8_t *tile, size_t stride, uint32_t n, \
+                   const uint8_t *linear, size_t pitch) \
+{ \
+    vec_t v0, v1, v2, v3; \
+    unsigned int r; \
+ \
+    for (; n > 0; n--, tile += stride, linear += 16) \
+        for (r = 0; r < TILE16_SIZE; r += 4) { \
+            v0 = load_linear(linear + r * pitch); \
+            v1 = load_linear(linear + (r + 1) * pitch); \
+            v2 = load_linear(linear + (r + 2) * pitch); \
+            v3 = load_linear(linear + (r + 3) * pitch); \
+            store_tiled(tile + r * 16, v0); \
+            store_tiled(tile + r * 16 + 16, v1); \
+            store_tiled(tile + r * 16 + 32, v2); \
+            store_tiled(tile + r * 16 + 48, v3); \
+        } \
+} \
+ \
+static void attr \
+gob_tile_##isa (uint8_t *gob, size_t stride, uint32_t n, \
+                const uint8_t *linear, size_t pitch) \
+{ \
+    vec_t v0, v1, v2, v3, v4, v5, v6, v7; \
+    const uint8_t *row; \
+    uint8_t *dst; \
+    unsigned int p; \
+ \
+    for (; n > 0; n--, gob += stride, linear += GOB_WIDTH) \
+        for (p = 0; p < GOB_HEIGHT / 2; p++) { \
+            row = linear + 2 * p * pitch; \
+            v0 = load_linear(row); \
+            v2 = load_linear(row + 16); \
+            v4 = load_linear(row + 32); \
+            v6 = load_linear(row + 48); \
+            row += pitch; \
+            v1 = load_linear(row); \
+            v3 = load_linear(row + 16); \
+            v5 = load_linear(row + 32); \
+            v7 = load_linear(row + 48); \
+            dst = gob + p * 64; \
+            store_tiled(dst, v0); \
+            store_tiled(dst + 16, v1); \
+            store_tiled(dst + 32, v2); \
+            store_tiled(dst + 48, v3); \
+            store_tiled(dst + 256, v4); \
+            store_tiled(dst + 272, v5); \
+            store_tiled(dst + 288, v6); \
+            store_tiled(dst + 304, v7); \
+        } \
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SSE_LOADU(p)		_mm_loadu_si128((const __m128i *) (p))
+#define SSE_STOREU(p, v)	_mm_storeu_si128((__m128i *) (p), (v))
+#define SSE_LOAD_STREAM(p)	_mm_stream_load_si128((__m128i *) (p))
+
+DEFINE_DETILE_KERNELS(sse2, __attribute__((target("sse2"))), __m128i, SSE_LOADU, SSE_STOREU)
+DEFINE_TILE_KERNELS(sse2, __attribute__((target("sse2"))), __m128i, SSE_LOADU, SSE_STOREU)
+
+static const struct tile_kernels kernels_sse2 = {
+    "sse2",
+    tile16_detile_sse2, tile16_tile_sse2,
+    gob_detile_sse2, gob_tile_sse2,
+};
+
+/*
+ * GEM object mappings are often write-combined, which ordinary loads
+ * read a word at a time; SSE4.1 streaming loads fetch a whole line.
+ * They need 16-byte alignment, which tiles and GOBs in an aligned
+ * mapping have.
+ */
+DEFINE_DETILE_KERNELS(sse41_aligned, __attribute__((target("sse4.1"))), __m128i,
+                      SSE_LOAD_STREAM, SSE_STOREU)
+
+static void
+tile16_detile_sse41 (const uint8_t *tile, size_t stride, uint32_t n,
+                     uint8_t *linear, size_t pitch)
+{
+    if (((uintptr_t) tile & 15) != 0)
+        tile16_detile_sse2(tile, stride, n, linear, pitch);
+    else
+        tile16_detile_sse41_aligned(tile, stride, n, linear, pitch);
+}
+
+static void
+gob_detile_sse41 (const uint8_t *gob, size_t stride, uint32_t n,
+                  uint8_t *linear, size_t pitch)
+{
+    if (((uintptr_t) gob & 15) != 0)
+        gob_detile_sse2(gob, stride, n, linear, pitch);
+    else
+        gob_detile_sse41_aligned(gob, stride, n, linear, pitch);
+}
+
+static const struct tile_kernels kernels_sse41 = {
+    "sse4.1",
+    tile16_detile_sse41, tile16_tile_sse2,
+    gob_detile_sse41, gob_tile_sse2,
+};
+#endif /* x86 */
+
+#ifdef TILE_HAVE_NEON
+DEFINE_DETILE_KERNELS(neon, , uint8x16_t, vld1q_u8, vst1q_u8)
+DEFINE_TILE_KERNELS(neon, , uint8x16_t, vld1q_u8, vst1q_u8)
+
+static const struct tile_kernels kernels_neon = {
+    "neon",
+    tile16_detile_neon, tile16_tile_neon,
+    gob_detile_neon, gob_tile_neon,
+};
+#endif /* TILE_HAVE_NEON */
+
+static const struct tile_kernels *tk = &kernels_generic;
+
+/*
+ * Picks the best kernels the CPU supports, unless
+ * DRM_SHIM_TILE_KERNELS names another supported set (for comparing
+ * them).
+ */
+static void __attribute__((constructor))
+shim_tile_init (void)
+{
+    static const struct tile_kernels *const all[] = {
+#if defined(__x86_64__) || defined(__i386__)
+        &kernels_sse41, &kernels_sse2,
+#endif
+#ifdef TILE_HAVE_NEON
+        &kernels_neon,
+#endif
+        &kernels_generic,
+    };
+    const char *env = getenv("DRM_SHIM_TILE_KERNELS");
+    unsigned int i, pass;
+
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+#endif
+    for (pass = (env == NULL); pass < 2; pass++)
+        for (i = 0; i < sizeof(all)/sizeof(all[0]); i++) {
+#if defined(__x86_64__) || defined(__i386__)
+            if (all[i] == &kernels_sse41 && !__builtin_cpu_supports("sse4.1"))
+                continue;
+            if (all[i] == &kernels_sse2 && !__builtin_cpu_supports("sse2"))
+                continue;
+#endif
+            if (pass == 0 && strcmp(env, all[i]->name) != 0)
+                continue;
+            tk = all[i];
+            return;
+        }
+}
+
+const char *
+drmShimSurfaceKernels (void)
+{
+    return tk->name;
+}
+
+static int
+surface_valid (const drmShimSurface *surf)
+{
+    if (surf == NULL || surf->pitch == 0)
+        return 0;
+    switch (surf->mode) {
+    case DRM_TEGRA_GEM_TILING_MODE_PITCH:
+        return 1;
+    case DRM_TEGRA_GEM_TILING_MODE_TILED:
+        return surf->pitch % TILE16_SIZE == 0;
+    case DRM_TEGRA_GEM_TILING_MODE_BLOCK:
+        return surf->pitch % GOB_WIDTH == 0 && surf->value <= BLOCK_MAX_VALUE;
+    }
+    return 0;
+}
+
+static size_t
+surface_offset (const drmShimSurface *surf, uint32_t x, uint32_t y)
+{
+    uint32_t block_height;
+    size_t block_size;
+
+    switch (surf->mode) {
+    case DRM_TEGRA_GEM_TILING_MODE_TILED:
+        return (size_t) (y / TILE16_SIZE) * surf->pitch * TILE16_SIZE +
+            (x / 16) * 256 + (y % TILE16_SIZE) * 16 + x % 16;
+    case DRM_TEGRA_GEM_TILING_MODE_BLOCK:
+        block_height = GOB_HEIGHT << surf->value;
+        block_size = (size_t) GOB_SIZE << surf->value;
+        return (size_t) (y / block_height) * (surf->pitch / GOB_WIDTH) * block_size +
+            (x / GOB_WIDTH) * block_size + (y % block_height / GOB_HEIGHT) * GOB_SIZE +
+            (x % 64 / 32) * 256 + (y % 8 / 2) * 64 + (x % 32 / 16) * 32 + (y % 2) * 16 + x % 16;
+    }
+    return (size_t) y * surf->pitch + x;
+}
+
+/*
+ * Bytes the tiled surface occupies: its height is padded to whole
+ * tiles, or to whole blocks in the block-linear layout.
+ */
+size_t
+drmShimSurfaceSize (const drmShimSurface *surf)
+{
+    uint32_t unit = 1;
+
+    if (!surface_valid(surf))
+        return 0;
+    if (surf->mode == DRM_TEGRA_GEM_TILING_MODE_TILED)
+        unit = TILE16_SIZE;
+    else if (surf->mode == DRM_TEGRA_GEM_TILING_MODE_BLOCK)
+        unit = GOB_HEIGHT << surf->value;
+    return (size_t) ((surf->height + unit - 1) / unit) * unit * surf->pitch;
+}
+
+int
+drmShimSurfaceQuery (int fd, uint32_t handle, uint32_t pitch, uint32_t height,
+                     drmShimSurface *surf)
+{
+    struct drm_tegra_gem_get_tiling args;
+
+    if (surf == NULL)
+        return -EINVAL;
+    memset(&args, 0, sizeof(args));
+    args.handle = handle;
+    if (drmIoctl(fd, DRM_IOCTL_TEGRA_GEM_GET_TILING, &args) != 0)
+        return -errno;
+    surf->mode = args.mode;
+    surf->value = args.value;
+    surf->pitch = pitch;
+    surf->height = height;
+    return surface_valid(surf) ? 0 : -EINVAL;
+}
+
+/*
+ * Copies part of a tile or GOB, in runs that stay within one
+ * 16-byte sector, which is contiguous in every layout.
+ */
+static void
+copy_partial (const drmShimSurface *surf, uint8_t *tiled, uint8_t *linear, size_t pitch,
+              uint32_t x0, uint32_t y0, uint32_t x1, uint32_t y1, int to_tiled)
+{
+    uint32_t x, y, n;
+    uint8_t *t;
+
+    for (y = y0; y < y1; y++, linear += pitch)
+        for (x = x0; x < x1; x += n) {
+            n = 16 - x % 16;
+            if (n > x1 - x)
+                n = x1 - x;
+            t = tiled + surface_offset(surf, x, y);
+            if (to_tiled)
+                memcpy(t, linear + (x - x0), n);
+            else
+                memcpy(linear + (x - x0), t, n);
+        }
+}
+
+/*
+ * Each band of tile or GOB rows is copied as a run of whole units,
+ * handed to the kernel in one call, with partial units either side.
+ */
+static int
+copy_rect (const drmShimSurface *surf, uint8_t *tiled, uint8_t *linear, size_t pitch,
+           uint32_t x, uint32_t y, uint32_t width, uint32_t height, int to_tiled)
+{
+    uint32_t uw, uh, uy, y0, y1, fx0, fx1;
+    size_t stride;
+    detile_fn detile;
+    tile_fn tile;
+    uint8_t *lin, *t;
+
+    if (!surface_valid(surf) || tiled == NULL || linear == NULL ||
+        x > surf->pitch || width > surf->pitch - x ||
+        y > surf->height || height > surf->height - y)
+        return -EINVAL;
+    if (surf->mode == DRM_TEGRA_GEM_TILING_MODE_PITCH) {
+        for (uy = 0; uy < height; uy++) {
+            t = tiled + (size_t) (y + uy) * surf->pitch + x;
+            if (to_tiled)
+                memcpy(t, linear + uy * pitch, width);
+            else
+                memcpy(linear + uy * pitch, t, width);
+        }
+        return 0;
+    }
+    if (surf->mode == DRM_TEGRA_GEM_TILING_MODE_TILED) {
+        uw = uh = TILE16_SIZE;
+        stride = 256;
+        detile = tk->tile16_detile;
+        tile = tk->tile16_tile;
+    } else {
+        uw = GOB_WIDTH;
+        uh = GOB_HEIGHT;
+        stride = (size_t) GOB_SIZE << surf->value;
+        detile = tk->gob_detile;
+        tile = tk->gob_tile;
+    }
+    fx0 = (x + uw - 1) / uw * uw;
+    fx1 = (x + width) / uw * uw;
+    if (fx0 >= fx1)
+        fx0 = fx1 = x + width;
+    for (uy = y - y % uh; uy < y + height; uy += uh) {
+        y0 = uy > y ? uy : y;
+        y1 = uy + uh < y + height ? uy + uh : y + height;
+        lin = linear + (size_t) (y0 - y) * pitch;
+        if (y1 - y0 < uh) {
+            copy_partial(surf, tiled, lin, pitch, x, y0, x + width, y1, to_tiled);
+            continue;
+        }
+        if (fx0 > x)
+            copy_partial(surf, tiled, lin, pitch, x, y0, fx0, y1, to_tiled);
+        if (fx1 > fx0) {
+            t = tiled + surface_offset(surf, fx0, uy);
+            if (to_tiled)
+                tile(t, stride, (fx1 - fx0) / uw, lin + (fx0 - x), pitch);
+            else
+                detile(t, stride, (fx1 - fx0) / uw, lin + (fx0 - x), pitch);
+        }
+        if (x + width > fx1)
+            copy_partial(surf, tiled, lin + (fx1 - x), pitch, fx1, y0, x + width, y1, to_tiled);
+    }
+    return 0;
+}
+
+int
+drmShimSurfaceDetile (const drmShimSurface *surf, const void *tiled,
+                      void *linear, uint32_t linear_pitch,
+                      uint32_t x, uint32_t y, uint32_t width, uint32_t height)
+{
+    return copy_rect(surf, (uint8_t *) tiled, linear, linear_pitch, x, y, width, height, 0);
+}
+
+int
+drmShimSurfaceTile (const drmShimSurface *surf, void *tiled,
+                    const void *linear, uint32_t linear_pitch,
+                    uint32_t x, uint32_t y, uint32_t width, uint32_t height)
+{
+    return copy_rect(surf, tiled, (uint8_t *) linear, linear_pitch, x, y, width, height, 1);
+}
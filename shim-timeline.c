@@ -0,0 +1,701 @@
+/*
+ * shim-timeline.c
+ *
+ * User-space timeline syncobjs, for a Tegra libdrm that does not
+ * provide drmSyncobjTimelineSignal(), drmSyncobjTimelineWait(),
+ * drmSyncobjQuery() or drmSyncobjTransfer().  When the backend
+ * lacks one of them, the shim binds it to the emulation here
+ * instead of to a stub.
+ *
+ * An emulated timeline keeps its last signalled point and a sorted,
+ * sparse map from each later point that has a fence attached (by
+ * drmSyncobjTransfer()) to that fence, as a sync_file fd.  As in
+ * the kernel, a point has signalled once every fence at or below
+ * it has, so fences are retired from the low end of the map as they
+ * signal, and a wait only ever polls the lowest pending one.
+ * Point 0 names a binary syncobj, which is handled with the binary
+ * syncobj calls, exporting and importing sync_files as needed.
+ *
+ * Timelines are keyed by open file and handle, made only for
+ * handles the binary syncobj calls know, and forgotten when the
+ * handle is destroyed with drmSyncobjDestroy(), the fd is closed
+ * with drmClose(), or the fd number is found to name another file.
+ * The underlying binary syncobj is left alone, so drmSyncobjWait()
+ * and the other binary calls do not see an emulated timeline's
+ * points.  As in libdrm, the emulated drmSyncobjTimelineWait()
+ * returns a negative errno and the others -1 with errno set.
+ *
+ * Copyright (c) 2018-2019, Matthew Madison
+ * Distributed under license; see the LICENSE file for details.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "xf86drm.h"
+#include "libsync.h"
+#include "shim-private.h"
+
+#ifndef DRM_SYNCOBJ_WAIT_FLAGS_WAIT_AVAILABLE
+#define DRM_SYNCOBJ_WAIT_FLAGS_WAIT_AVAILABLE (1 << 2)
+#endif
+
+#define TL_BUCKETS	256
+
+/* waits on this many handles or fewer need no allocation */
+#define TL_WAIT_STACK	16
+
+/*
+ * How often a wait rechecks entries it has no fd to poll for: binary
+ * syncobjs with no fence yet, or whose fence cannot be exported.
+ */
+#define TL_RECHECK_MS	1
+#define TL_RECHECK	(-2)
+
+struct tl_point {
+    uint64_t point;
+    int fence;
+};
+
+/*
+ * Pending points are points[first] through points[n - 1], in
+ * ascending order and all above value.  Points are nearly always
+ * added in order, so adding one is normally an append and
+ * retiring one just advances first.
+ */
+struct timeline {
+    struct timeline *next;
+    struct tl_fd *owner;
+    uint32_t handle;
+    uint64_t value;
+    struct tl_point *points;
+    unsigned int first, n, capacity;
+};
+
+/* Per-fd state, for the open file held names (see shim_file_hold()). */
+struct tl_fd {
+    struct tl_fd *next;
+    int fd;
+    int held;
+};
+
+/* Blocked waits, woken through their eventfds when any timeline changes. */
+struct tl_waiter {
+    struct tl_waiter *next;
+    int efd;
+};
+
+enum {
+    TL_SIGNALED,
+    TL_PENDING,
+    TL_UNSUBMITTED,
+};
+
+static pthread_mutex_t tl_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct timeline *tl_table[TL_BUCKETS];
+static unsigned int tl_count;
+static struct tl_fd *tl_fds;
+static struct tl_waiter *tl_waiters;
+static int (*next_destroy)(int fd, uint32_t handle);
+
+static inline struct timeline **
+tl_bucket (int fd, uint32_t handle)
+{
+    return &tl_table[((handle * 2654435761U) ^ (uint32_t) fd) % TL_BUCKETS];
+}
+
+/* Called with tl_lock held. */
+static void
+tl_notify (void)
+{
+    struct tl_waiter *w;
+
+    for (w = tl_waiters; w != NULL; w = w->next)
+        eventfd_write(w->efd, 1);
+}
+
+/*
+ * Marks every point up to value signalled, closing their fences.
+ * Called with tl_lock held.
+ */
+static void
+tl_retire (struct timeline *tl, uint64_t value)
+{
+    if (value > tl->value)
+        tl->value = value;
+    while (tl->first < tl->n && tl->points[tl->first].point <= tl->value)
+        close(tl->points[tl->first++].fence);
+    if (tl->first == tl->n)
+        tl->first = tl->n = 0;
+}
+
+/* Unlinks a timeline and frees it.  Called with tl_lock held. */
+static void
+tl_free (struct timeline **tp)
+{
+    struct timeline *tl = *tp;
+
+    *tp = tl->next;
+    tl_retire(tl, UINT64_MAX);
+    free(tl->points);
+    free(tl);
+    __atomic_store_n(&tl_count, tl_count - 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Drops an fd's timelines; their waits are woken to find out.
+ * Called with tl_lock held.
+ */
+static void
+tl_fd_free (struct tl_fd **fp)
+{
+    struct tl_fd *tf = *fp;
+    struct timeline **tp;
+    unsigned int i;
+
+    *fp = tf->next;
+    for (i = 0; i < TL_BUCKETS; i++)
+        for (tp = &tl_table[i]; *tp != NULL; )
+            if ((*tp)->owner == tf)
+                tl_free(tp);
+            else
+                tp = &(*tp)->next;
+    close(tf->held);
+    free(tf);
+    tl_notify();
+}
+
+/*
+ * As for the BO cache, state whose fd number has been reused for
+ * another file is dropped when found, and all of it is checked
+ * before state for a new fd is made.  Called with tl_lock held.
+ */
+static struct tl_fd *
+tl_fd_find (int fd, int create)
+{
+    struct tl_fd **fp, *tf;
+
+    for (fp = &tl_fds; (tf = *fp) != NULL; fp = &tf->next)
+        if (tf->fd == fd) {
+            if (shim_file_same(fd, tf->held))
+                return tf;
+            tl_fd_free(fp);
+            break;
+        }
+    if (!create)
+        return NULL;
+    for (fp = &tl_fds; (tf = *fp) != NULL; )
+        if (!shim_file_same(tf->fd, tf->held))
+            tl_fd_free(fp);
+        else
+            fp = &tf->next;
+    if ((tf = calloc(1, sizeof(*tf))) == NULL)
+        return NULL;
+    tf->held = shim_file_hold(fd);
+    if (tf->held < 0) {
+        free(tf);
+        return NULL;
+    }
+    tf->fd = fd;
+    tf->next = tl_fds;
+    __atomic_store_n(&tl_fds, tf, __ATOMIC_RELAXED);
+    return tf;
+}
+
+/* Returns 0, or -ENOENT if the handle is not a syncobj. */
+static int
+tl_valid (int fd, uint32_t handle)
+{
+    uint32_t h = handle;
+
+    if (drmSyncobjWait(fd, &h, 1, 0, DRM_SYNCOBJ_WAIT_FLAGS_WAIT_FOR_SUBMIT, NULL) == -ENOENT)
+        return -ENOENT;
+    return 0;
+}
+
+/*
+ * Returns NULL with errno set if there is no timeline and none can
+ * be made: ENOENT if the handle is not a syncobj.  Called with
+ * tl_lock held.
+ */
+static struct timeline *
+tl_find (int fd, uint32_t handle, int create)
+{
+    struct timeline **bucket = tl_bucket(fd, handle);
+    struct timeline *tl;
+    struct tl_fd *tf;
+
+    tf = tl_fd_find(fd, 0);
+    if (tf != NULL)
+        for (tl = *bucket; tl != NULL; tl = tl->next)
+            if (tl->owner == tf && tl->handle == handle)
+                return tl;
+    if (!create)
+        return NULL;
+    if (tl_valid(fd, handle) < 0) {
+        errno = ENOENT;
+        return NULL;
+    }
+    if (tf == NULL && (tf = tl_fd_find(fd, 1)) == NULL)
+        return NULL;
+    tl = calloc(1, sizeof(*tl));
+    if (tl == NULL)
+        return NULL;
+    tl->owner = tf;
+    tl->handle = handle;
+    tl->next = *bucket;
+    *bucket = tl;
+    __atomic_store_n(&tl_count, tl_count + 1, __ATOMIC_RELAXED);
+    return tl;
+}
+
+/* Retires fences that have signalled.  Called with tl_lock held. */
+static void
+tl_update (struct timeline *tl)
+{
+    struct pollfd pfd;
+
+    while (tl->first < tl->n) {
+        pfd.fd = tl->points[tl->first].fence;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, 0) <= 0)
+            break;
+        tl_retire(tl, tl->points[tl->first].point);
+    }
+}
+
+/* Index of the first pending point at or above point.  Called with tl_lock held. */
+static unsigned int
+tl_lower_bound (struct timeline *tl, uint64_t point)
+{
+    unsigned int lo = tl->first, hi = tl->n, mid;
+
+    if (lo < hi && tl->points[hi - 1].point < point)
+        return hi;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (tl->points[mid].point < point)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/*
+ * Point 0 stands for the timeline's latest point.  Called with
+ * tl_lock held.
+ */
+static uint64_t
+tl_latest (struct timeline *tl, uint64_t point)
+{
+    if (point != 0)
+        return point;
+    return tl->first < tl->n ? tl->points[tl->n - 1].point : tl->value;
+}
+
+/* Called with tl_lock held. */
+static int
+tl_state (struct timeline *tl, uint64_t point)
+{
+    tl_update(tl);
+    if (point <= tl->value)
+        return TL_SIGNALED;
+    if (tl_lower_bound(tl, point) == tl->n)
+        return TL_UNSUBMITTED;
+    return TL_PENDING;
+}
+
+/*
+ * Attaches a fence at a point, taking ownership of the fd.  A point
+ * that already has a fence gets the new one instead.  Called with
+ * tl_lock held.
+ */
+static int
+tl_attach (struct timeline *tl, uint64_t point, int fence)
+{
+    struct tl_point *points;
+    unsigned int idx, cap;
+
+    if (point <= tl->value) {
+        close(fence);
+        return 0;
+    }
+    idx = tl_lower_bound(tl, point);
+    if (idx < tl->n && tl->points[idx].point == point) {
+        close(tl->points[idx].fence);
+        tl->points[idx].fence = fence;
+        return 0;
+    }
+    if (tl->n == tl->capacity && tl->first > 0) {
+        memmove(tl->points, tl->points + tl->first, (tl->n - tl->first) * sizeof(*tl->points));
+        idx -= tl->first;
+        tl->n -= tl->first;
+        tl->first = 0;
+    }
+    if (tl->n == tl->capacity) {
+        cap = tl->capacity ? tl->capacity * 2 : 8;
+        points = realloc(tl->points, cap * sizeof(*points));
+        if (points == NULL) {
+            close(fence);
+            return -ENOMEM;
+        }
+        tl->points = points;
+        tl->capacity = cap;
+    }
+    memmove(tl->points + idx + 1, tl->points + idx, (tl->n - idx) * sizeof(*tl->points));
+    tl->points[idx].point = point;
+    tl->points[idx].fence = fence;
+    tl->n++;
+    return 0;
+}
+
+/*
+ * Checks one entry of a wait.  Returns 1 if it is done, a negative
+ * error code, or 0 if it is not done yet, with *fence set to a new
+ * fd that polls readable when it may be, to -1 if tl_notify() will
+ * wake the wait, or to TL_RECHECK.  Called with tl_lock held.
+ */
+static int
+tl_check (int fd, uint32_t handle, uint64_t point, unsigned int flags, int *fence)
+{
+    struct timeline *tl = tl_find(fd, handle, point != 0);
+    uint32_t h = handle;
+    int ret;
+
+    *fence = -1;
+    if (tl == NULL) {
+        if (point != 0)
+            return -errno;
+        ret = drmSyncobjWait(fd, &h, 1, 0, flags & ~DRM_SYNCOBJ_WAIT_FLAGS_WAIT_ALL, NULL);
+        if (ret != -ETIME)
+            return ret == 0 ? 1 : ret;
+        if (drmSyncobjExportSyncFile(fd, handle, fence) != 0 || *fence < 0)
+            *fence = TL_RECHECK;
+        return 0;
+    }
+    switch (tl_state(tl, tl_latest(tl, point))) {
+    case TL_SIGNALED:
+        return 1;
+    case TL_PENDING:
+        if (flags & DRM_SYNCOBJ_WAIT_FLAGS_WAIT_AVAILABLE)
+            return 1;
+        *fence = fcntl(tl->points[tl->first].fence, F_DUPFD_CLOEXEC, 0);
+        if (*fence < 0)
+            *fence = TL_RECHECK;
+        return 0;
+    default:
+        /* tl_notify() wakes the wait when a fence is attached */
+        return (flags & DRM_SYNCOBJ_WAIT_FLAGS_WAIT_FOR_SUBMIT) ? 0 : -EINVAL;
+    }
+}
+
+static int
+emu_drmSyncobjTimelineWait (int fd, uint32_t *handles, uint64_t *points,
+                            unsigned num_handles, int64_t timeout_nsec,
+                            unsigned flags, uint32_t *first_signaled)
+{
+    struct pollfd stack_pfds[TL_WAIT_STACK + 1], *pfds = stack_pfds;
+    struct tl_waiter waiter = { NULL, -1 }, **wp;
+    unsigned int i, npfds, ndone, recheck, registered = 0;
+    int64_t remaining = 0;
+    int first, fence, timeout_ms, ret = 0;
+
+    if (num_handles == 0)
+        return -EINVAL;
+    if (num_handles > TL_WAIT_STACK) {
+        pfds = malloc((num_handles + 1) * sizeof(*pfds));
+        if (pfds == NULL)
+            return -ENOMEM;
+    }
+    pthread_mutex_lock(&tl_lock);
+    for (;;) {
+        first = -1;
+        npfds = ndone = recheck = 0;
+        for (i = 0; i < num_handles; i++) {
+            ret = tl_check(fd, handles[i], points[i], flags, &fence);
+            if (ret < 0)
+                break;
+            if (ret > 0) {
+                ndone++;
+                if (first < 0)
+                    first = i;
+                continue;
+            }
+            if (fence == TL_RECHECK)
+                recheck = 1;
+            else if (fence >= 0) {
+                pfds[npfds].fd = fence;
+                pfds[npfds++].events = POLLIN;
+            }
+        }
+        if (ret >= 0) {
+            ret = 0;
+            if ((flags & DRM_SYNCOBJ_WAIT_FLAGS_WAIT_ALL) ? ndone == num_handles : ndone > 0) {
+                if (first_signaled != NULL)
+                    *first_signaled = first;
+            } else if ((remaining = timeout_nsec - (int64_t) shim_now_ns()) <= 0)
+                ret = -ETIME;
+            else if (waiter.efd < 0 &&
+                     (waiter.efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0)
+                ret = -errno;
+            else
+                ret = 1;
+        }
+        if (ret != 1) {
+            while (npfds > 0)
+                close(pfds[--npfds].fd);
+            break;
+        }
+        if (!registered) {
+            waiter.next = tl_waiters;
+            tl_waiters = &waiter;
+            registered = 1;
+        }
+        pthread_mutex_unlock(&tl_lock);
+
+        pfds[npfds].fd = waiter.efd;
+        pfds[npfds].events = POLLIN;
+        timeout_ms = remaining / 1000000 >= INT_MAX ? -1 : (int) ((remaining + 999999) / 1000000);
+        if (recheck && (timeout_ms < 0 || timeout_ms > TL_RECHECK_MS))
+            timeout_ms = TL_RECHECK_MS;
+        poll(pfds, npfds + 1, timeout_ms);
+        while (npfds > 0)
+            close(pfds[--npfds].fd);
+        eventfd_read(waiter.efd, &(eventfd_t) { 0 });
+
+        pthread_mutex_lock(&tl_lock);
+    }
+    for (wp = &tl_waiters; registered && *wp != NULL; wp = &(*wp)->next)
+        if (*wp == &waiter) {
+            *wp = waiter.next;
+            break;
+        }
+    pthread_mutex_unlock(&tl_lock);
+    if (waiter.efd >= 0)
+        close(waiter.efd);
+    if (pfds != stack_pfds)
+        free(pfds);
+    return ret;
+}
+
+static int
+emu_drmSyncobjTimelineSignal (int fd, const uint32_t *handles,
+                              uint64_t *points, uint32_t handle_count)
+{
+    struct timeline *tl;
+    uint32_t i;
+    int ret = 0;
+
+    for (i = 0; i < handle_count; i++)
+        if (points[i] == 0 && drmSyncobjSignal(fd, &handles[i], 1) != 0)
+            return -1;
+    pthread_mutex_lock(&tl_lock);
+    for (i = 0; i < handle_count; i++) {
+        if (points[i] == 0)
+            continue;
+        tl = tl_find(fd, handles[i], 1);
+        if (tl == NULL) {
+            ret = -errno;
+            break;
+        }
+        tl_retire(tl, points[i]);
+    }
+    tl_notify();
+    pthread_mutex_unlock(&tl_lock);
+    if (ret < 0) {
+        errno = -ret;
+        return -1;
+    }
+    return 0;
+}
+
+/* Syncobjs with no emulated timeline report point 0. */
+static int
+emu_drmSyncobjQuery (int fd, uint32_t *handles, uint64_t *points, uint32_t handle_count)
+{
+    struct timeline *tl;
+    uint32_t i;
+    int ret = 0;
+
+    pthread_mutex_lock(&tl_lock);
+    for (i = 0; i < handle_count && ret == 0; i++) {
+        tl = tl_find(fd, handles[i], 0);
+        if (tl != NULL) {
+            tl_update(tl);
+            points[i] = tl->value;
+        } else if ((ret = tl_valid(fd, handles[i])) == 0)
+            points[i] = 0;
+    }
+    pthread_mutex_unlock(&tl_lock);
+    if (ret < 0) {
+        errno = -ret;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Gets the fence for a transfer's source.  Returns 1 if it has
+ * already signalled, 0 with *fence set to a new sync_file fd, or
+ * a negative error code.  A timeline point's fence is the merge of
+ * every pending fence up to that point.
+ */
+static int
+tl_source (int fd, uint32_t handle, uint64_t point, uint32_t flags, int *fence)
+{
+    struct timeline *tl;
+    unsigned int idx;
+    int fds[TL_WAIT_STACK], *mfds, state, ret;
+
+    for (;;) {
+        pthread_mutex_lock(&tl_lock);
+        tl = tl_find(fd, handle, point != 0);
+        if (tl == NULL) {
+            ret = -errno;
+            pthread_mutex_unlock(&tl_lock);
+            if (point != 0)
+                return ret;
+            *fence = -1;
+            if (drmSyncobjExportSyncFile(fd, handle, fence) != 0)
+                return -errno;
+            return *fence < 0 ? -EINVAL : 0;
+        }
+        point = tl_latest(tl, point);
+        state = tl_state(tl, point);
+        if (state != TL_UNSUBMITTED)
+            break;
+        pthread_mutex_unlock(&tl_lock);
+        if (!(flags & DRM_SYNCOBJ_WAIT_FLAGS_WAIT_FOR_SUBMIT))
+            return -EINVAL;
+        ret = emu_drmSyncobjTimelineWait(fd, &handle, &point, 1, INT64_MAX,
+                                         DRM_SYNCOBJ_WAIT_FLAGS_WAIT_FOR_SUBMIT |
+                                         DRM_SYNCOBJ_WAIT_FLAGS_WAIT_AVAILABLE, NULL);
+        if (ret != 0)
+            return ret;
+    }
+    if (state == TL_SIGNALED) {
+        pthread_mutex_unlock(&tl_lock);
+        return 1;
+    }
+    idx = tl_lower_bound(tl, point);
+    mfds = fds;
+    if (idx - tl->first + 1 > TL_WAIT_STACK) {
+        mfds = malloc((idx - tl->first + 1) * sizeof(*mfds));
+        if (mfds == NULL) {
+            pthread_mutex_unlock(&tl_lock);
+            return -ENOMEM;
+        }
+    }
+    for (ret = 0; tl->first + ret <= idx; ret++)
+        mfds[ret] = tl->points[tl->first + ret].fence;
+    *fence = sync_merge_many("drm-shim-timeline", mfds, ret);
+    ret = *fence < 0 ? -errno : 0;
+    pthread_mutex_unlock(&tl_lock);
+    if (mfds != fds)
+        free(mfds);
+    return ret;
+}
+
+static int
+emu_drmSyncobjTransfer (int fd, uint32_t dst_handle, uint64_t dst_point,
+                        uint32_t src_handle, uint64_t src_point, uint32_t flags)
+{
+    struct timeline *tl;
+    int fence = -1, ret;
+
+    ret = tl_source(fd, src_handle, src_point, flags, &fence);
+    if (ret < 0) {
+        errno = -ret;
+        return -1;
+    }
+    if (dst_point == 0) {
+        if (ret > 0)
+            return drmSyncobjSignal(fd, &dst_handle, 1);
+        ret = drmSyncobjImportSyncFile(fd, dst_handle, fence);
+        if (ret != 0)
+            ret = -errno;
+        close(fence);
+    } else {
+        pthread_mutex_lock(&tl_lock);
+        tl = tl_find(fd, dst_handle, 1);
+        if (tl == NULL) {
+            ret = -errno;
+            if (fence >= 0)
+                close(fence);
+        } else if (ret > 0) {
+            tl_retire(tl, dst_point);
+            ret = 0;
+        } else
+            ret = tl_attach(tl, dst_point, fence);
+        tl_notify();
+        pthread_mutex_unlock(&tl_lock);
+    }
+    if (ret < 0) {
+        errno = -ret;
+        return -1;
+    }
+    return 0;
+}
+
+static int
+tl_destroy (int fd, uint32_t handle)
+{
+    struct timeline **tp, *tl;
+    struct tl_fd *tf;
+
+    if (__atomic_load_n(&tl_count, __ATOMIC_RELAXED) != 0) {
+        pthread_mutex_lock(&tl_lock);
+        tf = tl_fd_find(fd, 0);
+        for (tp = tl_bucket(fd, handle); tf != NULL && (tl = *tp) != NULL; tp = &tl->next)
+            if (tl->owner == tf && tl->handle == handle) {
+                tl_free(tp);
+                break;
+            }
+        pthread_mutex_unlock(&tl_lock);
+    }
+    return next_destroy(fd, handle);
+}
+
+void
+shim_timeline_forget_fd (int fd)
+{
+    struct tl_fd **fp, *tf;
+
+    if (__atomic_load_n(&tl_fds, __ATOMIC_RELAXED) == NULL)
+        return;
+    pthread_mutex_lock(&tl_lock);
+    for (fp = &tl_fds; (tf = *fp) != NULL; fp = &tf->next)
+        if (tf->fd == fd) {
+            tl_fd_free(fp);
+            break;
+        }
+    pthread_mutex_unlock(&tl_lock);
+}
+
+void *
+shim_timeline_lookup (const char *name)
+{
+    if (strcmp(name, "drmSyncobjTimelineWait") == 0)
+        return emu_drmSyncobjTimelineWait;
+    if (strcmp(name, "drmSyncobjTimelineSignal") == 0)
+        return emu_drmSyncobjTimelineSignal;
+    if (strcmp(name, "drmSyncobjQuery") == 0)
+        return emu_drmSyncobjQuery;
+    if (strcmp(name, "drmSyncobjTransfer") == 0)
+        return emu_drmSyncobjTransfer;
+    return NULL;
+}
+
+void *
+shim_timeline_interpose (void *fn)
+{
+    next_destroy = fn;
+    return tl_destroy;
+}
@@ -0,0 +1,144 @@
+/*
+ * shim-wait.c
+ *
+ * Spin-then-block policy for the syncpoint and fence waits.  A
+ * short GPU job often finishes sooner than a blocked thread can be
+ * woken, so waits can first poll for a bounded time before falling
+ * back to the blocking ioctl or poll().
+ *
+ * Copyright (c) 2018-2019, Matthew Madison
+ * Distributed under license; see the LICENSE file for details.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "drm-shim.h"
+#include "shim-private.h"
+
+#define WAIT_DEFAULT_SPIN_US	100
+#define WAIT_MAX_SPIN_US	100000
+
+/* shortest spin worth starting, once an estimate exists */
+#define WAIT_MIN_SPIN_NS	2000
+
+/*
+ * When a source's estimate exceeds the spin limit, one wait in
+ * this many spins anyway, so the estimate can recover if the jobs
+ * get shorter again.
+ */
+#define WAIT_PROBE_INTERVAL	16
+
+static int wait_policy = DRM_SHIM_WAIT_BLOCK;
+static uint64_t wait_max_spin_ns = WAIT_DEFAULT_SPIN_US * 1000ULL;
+static int wait_uniprocessor;
+
+int
+drmShimSetWaitPolicy (int policy, uint32_t max_spin_us)
+{
+    if (policy != DRM_SHIM_WAIT_BLOCK && policy != DRM_SHIM_WAIT_SPIN &&
+        policy != DRM_SHIM_WAIT_ADAPTIVE)
+        return -EINVAL;
+    if (max_spin_us == 0)
+        max_spin_us = WAIT_DEFAULT_SPIN_US;
+    if (max_spin_us > WAIT_MAX_SPIN_US)
+        max_spin_us = WAIT_MAX_SPIN_US;
+    __atomic_store_n(&wait_max_spin_ns, max_spin_us * 1000ULL, __ATOMIC_RELAXED);
+    __atomic_store_n(&wait_policy, policy, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/*
+ * DRM_SHIM_WAIT_SPIN sets the initial policy: "adaptive" or
+ * "adaptive:N" for adaptive spinning of at most N microseconds, a
+ * number N to always spin for N microseconds, or 0 to always block.
+ * Spinning is never done with only one CPU online, since the
+ * spinner would only delay whatever thread completes the wait.
+ */
+static void __attribute__((constructor))
+shim_wait_init (void)
+{
+    const char *env = getenv("DRM_SHIM_WAIT_SPIN");
+
+    wait_uniprocessor = sysconf(_SC_NPROCESSORS_ONLN) == 1;
+    if (env == NULL || *env == '\0')
+        return;
+    if (strncmp(env, "adaptive", 8) == 0)
+        drmShimSetWaitPolicy(DRM_SHIM_WAIT_ADAPTIVE,
+                             env[8] == ':' ? strtoul(env + 9, NULL, 0) : 0);
+    else if (strtoul(env, NULL, 0) != 0)
+        drmShimSetWaitPolicy(DRM_SHIM_WAIT_SPIN, strtoul(env, NULL, 0));
+    else
+        drmShimSetWaitPolicy(DRM_SHIM_WAIT_BLOCK, 0);
+}
+
+/*
+ * Returns how long to spin before blocking on a source with the
+ * given completion-time estimate.  Under the adaptive policy that
+ * is twice the estimate, so typical jobs finish within the spin,
+ * or nothing for sources whose jobs run longer than the limit.
+ */
+uint64_t
+shim_wait_budget (struct shim_wait_est *est)
+{
+    uint64_t max = __atomic_load_n(&wait_max_spin_ns, __ATOMIC_RELAXED);
+    uint64_t avg;
+
+    if (wait_uniprocessor)
+        return 0;
+    switch (__atomic_load_n(&wait_policy, __ATOMIC_RELAXED)) {
+    case DRM_SHIM_WAIT_SPIN:
+        return max;
+    case DRM_SHIM_WAIT_ADAPTIVE:
+        break;
+    default:
+        return 0;
+    }
+    avg = __atomic_load_n(&est->avg_ns, __ATOMIC_RELAXED);
+    if (avg == 0)
+        return max;
+    if (avg > max)
+        return __atomic_add_fetch(&est->probe, 1, __ATOMIC_RELAXED) % WAIT_PROBE_INTERVAL == 0 ? max : 0;
+    avg *= 2;
+    if (avg < WAIT_MIN_SPIN_NS)
+        avg = WAIT_MIN_SPIN_NS;
+    return avg < max ? avg : max;
+}
+
+/*
+ * Folds one observed completion time into the estimate, as a
+ * moving average weighted 1/8 to the newest sample.  Concurrent
+ * updates may lose a sample, which only slows adaptation.
+ */
+void
+shim_wait_observe (struct shim_wait_est *est, uint64_t elapsed_ns)
+{
+    uint32_t avg = __atomic_load_n(&est->avg_ns, __ATOMIC_RELAXED);
+    uint32_t sample = elapsed_ns > UINT32_MAX ? UINT32_MAX : (uint32_t) elapsed_ns;
+
+    if (avg == 0)
+        avg = sample;
+    else
+        avg = (uint32_t) (((uint64_t) avg * 7 + sample) / 8);
+    __atomic_store_n(&est->avg_ns, avg ? avg : 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Calls check() until it returns nonzero or the budget runs out.
+ * Returns check()'s last result: positive once the wait is over,
+ * 0 if the budget ran out, or a negative error code.
+ */
+int
+shim_wait_spin (uint64_t budget_ns, int (*check)(void *arg), void *arg)
+{
+    uint64_t deadline = shim_now_ns() + budget_ns;
+    int ret;
+
+    for (;;) {
+        ret = check(arg);
+        if (ret != 0 || shim_now_ns() >= deadline)
+            return ret;
+        shim_cpu_relax();
+    }
+}
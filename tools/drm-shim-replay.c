@@ -0,0 +1,253 @@
+/*
+ * drm-shim-replay.c
+ *
+ * Replays a call trace written by the shim's recorder
+ * (DRM_SHIM_RECORD) through the libdrm it is linked against.
+ *
+ * Only drmIoctl calls are reissued, since those carry their
+ * argument data in the trace, and only those whose argument
+ * structures hold nothing specific to the recorded process: no
+ * pointers into its memory, and no GEM handles or channel contexts
+ * it was given.  Other calls are counted but not replayed.  The
+ * summary compares recorded and replayed time for each ioctl
+ * number, over the calls that succeeded or failed the same way in
+ * both, and counts those that did not.
+ *
+ * Copyright (c) 2018-2019, Matthew Madison
+ * Distributed under license; see the LICENSE file for details.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "xf86drm.h"
+#include "tegra_drm.h"
+#include "shim-record.h"
+
+struct ioctl_totals {
+    uint64_t count;
+    uint64_t mismatched;
+    uint64_t recorded_ns;
+    uint64_t replayed_ns;
+};
+
+/*
+ * Syncpoint increments and waits are left out as well: replaying
+ * an increment would advance a syncpoint other work depends on, and
+ * a recorded wait threshold means nothing to the replay's
+ * syncpoints.
+ */
+static int
+replayable (unsigned long request)
+{
+    switch (request) {
+    case DRM_IOCTL_TEGRA_GEM_CREATE:
+    case DRM_IOCTL_TEGRA_SYNCPT_READ:
+        return 1;
+    }
+    return 0;
+}
+
+static const char *
+func_name (const struct shim_record_header *hdr, unsigned int id)
+{
+    static char unknown[16];
+
+    if (id < hdr->nfuncs)
+        return (const char *) (hdr + 1) + id * SHIM_RECORD_NAMELEN;
+    snprintf(unknown, sizeof(unknown), "func#%u", id);
+    return unknown;
+}
+
+static int
+cmp_records (const void *a, const void *b)
+{
+    const struct shim_record_entry *ra = *(const struct shim_record_entry * const *) a;
+    const struct shim_record_entry *rb = *(const struct shim_record_entry * const *) b;
+
+    return (ra->start_ns > rb->start_ns) - (ra->start_ns < rb->start_ns);
+}
+
+static uint64_t
+now_ns (void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+static void
+usage (const char *prog)
+{
+    fprintf(stderr, "Usage: %s [--dump] [--device NAME] tracefile\n", prog);
+}
+
+int
+main (int argc, char **argv)
+{
+    static const struct option opts[] = {
+        { "dump",   no_argument,       NULL, 'd' },
+        { "device", required_argument, NULL, 'D' },
+        { "help",   no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 },
+    };
+    const char *device = "tegra";
+    const struct shim_record_header *hdr;
+    const struct shim_record_entry **recs;
+    struct ioctl_totals totals[256];
+    size_t nrecs = 0, maxrecs, i;
+    unsigned int ioctl_id = UINT32_MAX, skipped = 0, unsafe = 0;
+    uint64_t off, end;
+    struct stat st;
+    char *base;
+    int dump = 0, c, fd, drmfd;
+
+    while ((c = getopt_long(argc, argv, "dD:h", opts, NULL)) != -1) {
+        switch (c) {
+        case 'd':
+            dump = 1;
+            break;
+        case 'D':
+            device = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return (c == 'h' ? 0 : 1);
+        }
+    }
+    if (optind != argc - 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    fd = open(argv[optind], O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror(argv[optind]);
+        return 1;
+    }
+    base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    hdr = (const struct shim_record_header *) base;
+    if ((size_t) st.st_size < sizeof(*hdr) ||
+        memcmp(hdr->magic, SHIM_RECORD_MAGIC, sizeof(hdr->magic)) != 0 ||
+        hdr->version != SHIM_RECORD_VERSION || hdr->file_size > (uint64_t) st.st_size) {
+        fprintf(stderr, "%s: not a shim call trace\n", argv[optind]);
+        return 1;
+    }
+    for (i = 0; i < hdr->nfuncs; i++)
+        if (strcmp(func_name(hdr, i), "drmIoctl") == 0)
+            ioctl_id = i;
+
+    /* Collect the completed records from every chunk and put them in time order */
+    end = hdr->next_chunk < hdr->file_size ? hdr->next_chunk : hdr->file_size;
+    maxrecs = (end - hdr->first_chunk) / sizeof(struct shim_record_entry) + 1;
+    recs = calloc(maxrecs, sizeof(*recs));
+    if (recs == NULL) {
+        perror("calloc");
+        return 1;
+    }
+    for (off = hdr->first_chunk; off + hdr->chunk_size <= end; off += hdr->chunk_size) {
+        const struct shim_record_chunk *chunk = (const void *) (base + off);
+        const char *p = (const char *) (chunk + 1);
+        const char *pend = p + chunk->used;
+
+        while (p + sizeof(struct shim_record_entry) <= pend) {
+            const struct shim_record_entry *rec = (const void *) p;
+            if (rec->size < sizeof(*rec))
+                break;
+            if (rec->complete)
+                recs[nrecs++] = rec;
+            p += rec->size;
+        }
+    }
+    qsort(recs, nrecs, sizeof(*recs), cmp_records);
+    printf("%zu calls recorded, %llu dropped\n", nrecs, (unsigned long long) hdr->dropped);
+
+    if (dump) {
+        for (i = 0; i < nrecs; i++) {
+            const struct shim_record_entry *rec = recs[i];
+            const uint64_t *words = (const uint64_t *) (rec + 1);
+            unsigned int a;
+
+            printf("%14.3f %10.3f %s(", rec->start_ns / 1000.0, rec->duration_ns / 1000.0,
+                   func_name(hdr, rec->func));
+            for (a = 0; a < rec->nargs; a++)
+                printf(rec->ptrmask & (1U << a) ? "%s%#llx" : "%s%llu", a ? ", " : "",
+                       (unsigned long long) words[a]);
+            printf(") = %lld\n", (long long) rec->ret);
+        }
+        return 0;
+    }
+
+    drmfd = drmOpen(device, NULL);
+    if (drmfd < 0) {
+        fprintf(stderr, "%s: could not open DRM device %s\n", argv[0], device);
+        return 1;
+    }
+    memset(totals, 0, sizeof(totals));
+    for (i = 0; i < nrecs; i++) {
+        const struct shim_record_entry *rec = recs[i];
+        const uint64_t *words = (const uint64_t *) (rec + 1);
+        unsigned long request;
+        unsigned char buf[1 << 14];
+        uint64_t t0, elapsed;
+        struct ioctl_totals *tot;
+        int ret;
+
+        if (rec->func != ioctl_id || rec->nargs != 3) {
+            skipped++;
+            continue;
+        }
+        request = (unsigned long) words[1];
+        if (!replayable(request) || rec->payload > sizeof(buf)) {
+            unsafe++;
+            continue;
+        }
+        memcpy(buf, words + 3, rec->payload);
+        t0 = now_ns();
+        ret = drmIoctl(drmfd, request, rec->payload ? buf : NULL);
+        elapsed = now_ns() - t0;
+        if (request == DRM_IOCTL_TEGRA_GEM_CREATE && ret == 0) {
+            struct drm_gem_close close_args;
+            memset(&close_args, 0, sizeof(close_args));
+            close_args.handle = ((struct drm_tegra_gem_create *) buf)->handle;
+            drmIoctl(drmfd, DRM_IOCTL_GEM_CLOSE, &close_args);
+        }
+        tot = &totals[DRM_IOCTL_NR(request)];
+        tot->count += 1;
+        if ((ret == 0) != ((int) rec->ret == 0)) {
+            tot->mismatched += 1;
+            continue;
+        }
+        tot->replayed_ns += elapsed;
+        tot->recorded_ns += rec->duration_ns;
+    }
+    drmClose(drmfd);
+
+    printf("%u non-ioctl calls not replayed\n", skipped);
+    printf("%u ioctls with process-specific arguments not replayed\n", unsafe);
+    printf("%-8s %10s %10s %14s %14s\n", "ioctl_nr", "count", "mismatched",
+           "recorded_us", "replayed_us");
+    for (i = 0; i < 256; i++) {
+        if (totals[i].count == 0)
+            continue;
+        printf("0x%02zx     %10llu %10llu %14.1f %14.1f\n", i,
+               (unsigned long long) totals[i].count,
+               (unsigned long long) totals[i].mismatched,
+               totals[i].recorded_ns / 1000.0, totals[i].replayed_ns / 1000.0);
+    }
+    return 0;
+}
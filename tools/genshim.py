@@ -1,51 +1,211 @@
-#!/usr/bin/env python
+#!/usr/bin/env python3
 #
-# Hacky parser for the function prototypes
-# in xf86drm.h and xf86drmMode.h to generate
-# the macros used in libdrm-shim.c.
+# genshim.py
+#
+# Generates shim-funcs.h, the FUNCDEFS list of functions the shim
+# forwards, from the prototypes in xf86drm.h and xf86drmMode.h.
+# Run from Makefile.am whenever the headers change.
+#
+# Usage: genshim.py [-o OUTPUT] header...
+#
+# Entries are sorted by name, so each function's FUNCID_ value
+# depends only on the set of functions in the headers.  Variadic
+# functions cannot be forwarded and are left out (the shim
+# implements drmMsg itself).
+#
+# Copyright (c) 2018-2019, Matthew Madison
+# Distributed under license; see the LICENSE file for details.
 #
 
-from __future__ import print_function
+import argparse
 import re
 import sys
 
-fpat = re.compile(r'^extern +([^ ]+) +([^ ]+) *(\(.*\));')
-
-def strip_args(args):
-    if args == '(void)' or args == '()':
-        return '()'
-    arglist = args[0:len(args)-1].split(',')
-    strippedlist = []
-    for arg in arglist:
-        if '**' in arg:
-            strippedlist.append(arg.split('**')[1])
-        elif '*' in arg:
-            strippedlist.append(arg.split('*')[1])
-        else:
-            awords = arg.strip().split(' ')
-            a = awords[len(awords)-1]
-            if '[' in a:
-                a = a[:a.index('[')]
-            strippedlist.append(a)
-    return '(' + ', '.join(strippedlist) + ')'
-
-with open(sys.argv[1], 'r') as f:
-    for line in f:
-        m = fpat.match(line)
-        if m is None:
+# Stub return statements other than the default 'return 0'
+STUB_RETURNS = {
+    'drmGetDevice2': 'return -EINVAL',
+    'drmGetDevices2': 'return -EINVAL',
+    'drmOpen': 'return -EINVAL',
+    'drmOpenOnce': 'return -1',
+}
+
+TYPE_WORDS = {
+    'void', 'char', 'short', 'int', 'long', 'float', 'double', 'signed',
+    'unsigned', 'const', 'volatile', 'struct', 'union', 'enum',
+}
+
+HEADER = '''\
+/*
+ * shim-funcs.h
+ *
+ * The libdrm functions forwarded by the shim.  Each entry gives
+ * the return type, name, parameter list, argument list for the
+ * forwarded call, and the statement the stub uses when the Tegra
+ * libdrm does not provide the function.
+ *
+ * Generated by tools/genshim.py from %s; do not edit.
+ */
+#ifndef SHIM_FUNCS_H_
+#define SHIM_FUNCS_H_
+
+#include <stdint.h>
+#include <errno.h>
+#include "xf86drm.h"
+#include "xf86drmMode.h"
+
+#undef FUNCDEF
+#define FUNCDEFS \\
+'''
+
+FOOTER = '''
+#endif /* SHIM_FUNCS_H_ */
+'''
+
+
+class ParseError(Exception):
+    pass
+
+
+def strip_source(text):
+    """Remove comments, preprocessor lines and extern "C" wrappers."""
+    text = re.sub(r'/\*.*?\*/', ' ', text, flags=re.S)
+    text = re.sub(r'//[^\n]*', '', text)
+    text = re.sub(r'^[ \t]*#(?:[^\n]*\\\n)*[^\n]*', '', text, flags=re.M)
+    return re.sub(r'extern\s*"C"\s*\{', '', text)
+
+
+def declarations(text):
+    """Yield each top-level declaration, skipping function bodies."""
+    depth = 0
+    stmt = []
+    for ch in text:
+        if ch == '{':
+            depth += 1
+        elif ch == '}':
+            if depth == 0:
+                continue        # closes an extern "C" block
+            depth -= 1
+            if depth == 0:
+                head = ''.join(stmt).split('{', 1)[0].strip()
+                if head.endswith(')'):
+                    stmt = []   # inline function definition
+                    continue
+        stmt.append(ch)
+        if ch == ';' and depth == 0:
+            yield ' '.join(''.join(stmt).split())
+            stmt = []
+
+
+def split_params(params):
+    parts, depth, cur = [], 0, ''
+    for ch in params:
+        if ch == ',' and depth == 0:
+            parts.append(cur.strip())
+            cur = ''
             continue
-        functype = m.group(1)
-        funcname = m.group(2)
-        if funcname.startswith('*'):
-            functype = functype + ' *'
-            funcname = funcname[1:]
-        funcargs = m.group(3)
-        if functype == 'void':
-            retfunc = 'return'
-        elif funcname == 'drmOpen':
-            retfunc = 'return -EINVAL'
-        else:
-            retfunc = 'return 0'
-        print('    FUNCDEF(%s, %s, %s, %s, %s) \\' % (functype, funcname,
-                                                      funcargs, strip_args(funcargs),
-                                                      retfunc))
+        if ch in '([':
+            depth += 1
+        elif ch in ')]':
+            depth -= 1
+        cur += ch
+    if cur.strip():
+        parts.append(cur.strip())
+    return parts
+
+
+def tidy(decl):
+    """Normalize spacing, attaching '*' to the following name."""
+    decl = re.sub(r'\s*(\*+)\s*', r' \1', decl.strip())
+    decl = re.sub(r'\s*([(\[\])])\s*', r'\1', decl)
+    return re.sub(r'\s+', ' ', decl)
+
+
+def param_name(param, index):
+    """Return (declaration, name), inventing a name if there is none."""
+    fptr = re.search(r'\(\s*\*\s*(\w*)\s*\)', param)
+    if fptr:
+        name = fptr.group(1) or 'arg%d' % index
+        param = param[:fptr.start()] + '(*' + name + ')' + param[fptr.end():]
+        return tidy(param), name
+    base = re.sub(r'\[[^\]]*\]', '', param).strip()
+    words = re.findall(r'\w+', base)
+    if len(words) >= 2 and words[-1] not in TYPE_WORDS and base.endswith(words[-1]):
+        return tidy(param), words[-1]
+    name = 'arg%d' % index
+    m = re.search(r'\[', param)
+    if m:
+        param = param[:m.start()] + ' ' + name + param[m.start():]
+    else:
+        param = param + ' ' + name
+    return tidy(param), name
+
+
+def parse_prototype(decl):
+    """Return (type, name, params, args), or None if decl is not a prototype."""
+    if decl.startswith(('typedef ', 'static ', 'struct ', 'union ', 'enum ')):
+        if not re.match(r'(struct|union|enum) \w+ *\**\s*\w+\s*\(', decl):
+            return None
+    m = re.match(r'(?:extern\s+)?(.*?)\b(\w+)\s*\(', decl)
+    if m is None or not m.group(1).strip():
+        return None
+    rettype, name = m.group(1), m.group(2)
+    depth, start = 0, m.end() - 1
+    for pos in range(start, len(decl)):
+        if decl[pos] == '(':
+            depth += 1
+        elif decl[pos] == ')':
+            depth -= 1
+            if depth == 0:
+                break
+    else:
+        raise ParseError('unbalanced parentheses in: ' + decl)
+    params = split_params(decl[start + 1:pos])
+    if '...' in params:
+        sys.stderr.write('genshim.py: skipping variadic function %s\n' % name)
+        return None
+    if params in ([], ['void']):
+        return tidy(rettype), name, '(void)', '()'
+    decls, names = zip(*[param_name(p, i) for i, p in enumerate(params)])
+    return tidy(rettype), name, '(' + ', '.join(decls) + ')', '(' + ', '.join(names) + ')'
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Generate shim-funcs.h')
+    parser.add_argument('-o', '--output', help='output file (default stdout)')
+    parser.add_argument('headers', nargs='+')
+    opts = parser.parse_args()
+
+    funcs = {}
+    for path in opts.headers:
+        with open(path, 'r') as f:
+            text = strip_source(f.read())
+        for decl in declarations(text):
+            proto = parse_prototype(decl)
+            if proto is None:
+                continue
+            if proto[1] in funcs and funcs[proto[1]] != proto:
+                raise ParseError('conflicting declarations of ' + proto[1])
+            funcs[proto[1]] = proto
+
+    lines = []
+    for name in sorted(funcs):
+        rettype, _, params, args = funcs[name]
+        ret = 'return' if rettype == 'void' else STUB_RETURNS.get(name, 'return 0')
+        lines.append('    FUNCDEF(%s, %s, %s, %s, %s)' % (rettype, name, params, args, ret))
+    names = ' and '.join(p.split('/')[-1] for p in opts.headers)
+    out = HEADER % names + ' \\\n'.join(lines) + '\n' + FOOTER
+
+    if opts.output:
+        with open(opts.output, 'w') as f:
+            f.write(out)
+    else:
+        sys.stdout.write(out)
+    return 0
+
+
+if __name__ == '__main__':
+    try:
+        sys.exit(main())
+    except ParseError as e:
+        sys.stderr.write('genshim.py: %s\n' % e)
+        sys.exit(1)
@@ -0,0 +1,107 @@
+#!/usr/bin/env python3
+#
+# Decode a drmIoctl trace file written by the shim when run with
+# DRM_SHIM_IOCTL_TRACE set (requires --enable-instrumentation).
+#
+# Usage: ioctl-trace-decode.py [--events N] tracefile
+#
+# Prints the per-ioctl summary, sorted by total time, and
+# optionally the N slowest calls still held in the event ring.
+#
+
+from __future__ import print_function
+import argparse
+import struct
+import sys
+
+HEADER = struct.Struct('<8sIIIIQQ')
+SLOT = struct.Struct('<QQQII')
+EVENT = struct.Struct('<QQIIiI')
+MAGIC = b'DRMIOTR1'
+
+DRM_COMMAND_BASE = 0x40
+
+CORE_NAMES = {
+    0x00: 'VERSION',
+    0x09: 'GEM_CLOSE',
+    0x0a: 'GEM_FLINK',
+    0x0b: 'GEM_OPEN',
+    0x0c: 'GET_CAP',
+    0x2d: 'PRIME_HANDLE_TO_FD',
+    0x2e: 'PRIME_FD_TO_HANDLE',
+    0x3a: 'WAIT_VBLANK',
+    0xa0: 'MODE_GETRESOURCES',
+    0xa1: 'MODE_GETCRTC',
+    0xa2: 'MODE_SETCRTC',
+    0xb0: 'MODE_PAGE_FLIP',
+    0xbc: 'MODE_ATOMIC',
+    0xbf: 'SYNCOBJ_CREATE',
+    0xc0: 'SYNCOBJ_DESTROY',
+    0xc1: 'SYNCOBJ_HANDLE_TO_FD',
+    0xc2: 'SYNCOBJ_FD_TO_HANDLE',
+    0xc3: 'SYNCOBJ_WAIT',
+    0xc4: 'SYNCOBJ_RESET',
+    0xc5: 'SYNCOBJ_SIGNAL',
+}
+
+TEGRA_NAMES = [
+    'TEGRA_GEM_CREATE', 'TEGRA_GEM_MMAP', 'TEGRA_SYNCPT_READ',
+    'TEGRA_SYNCPT_INCR', 'TEGRA_SYNCPT_WAIT', 'TEGRA_OPEN_CHANNEL',
+    'TEGRA_CLOSE_CHANNEL', 'TEGRA_GET_SYNCPT', 'TEGRA_SUBMIT',
+    'TEGRA_GET_SYNCPT_BASE', 'TEGRA_GEM_SET_TILING',
+    'TEGRA_GEM_GET_TILING', 'TEGRA_GEM_SET_FLAGS', 'TEGRA_GEM_GET_FLAGS',
+]
+
+
+def ioctl_name(nr):
+    if DRM_COMMAND_BASE <= nr < DRM_COMMAND_BASE + len(TEGRA_NAMES):
+        return TEGRA_NAMES[nr - DRM_COMMAND_BASE]
+    return CORE_NAMES.get(nr, 'NR_0x%02x' % nr)
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Decode a shim drmIoctl trace')
+    parser.add_argument('--events', type=int, default=0,
+                        help='also list the N slowest calls in the event ring')
+    parser.add_argument('tracefile')
+    args = parser.parse_args()
+
+    with open(args.tracefile, 'rb') as f:
+        data = f.read()
+    magic, version, nslots, nevents, _, _, head = HEADER.unpack_from(data, 0)
+    if magic != MAGIC or version != 1:
+        print('%s: not a shim ioctl trace' % args.tracefile, file=sys.stderr)
+        return 1
+    off = HEADER.size
+    slots = []
+    for nr in range(nslots):
+        count, total, maxns, request, errors = SLOT.unpack_from(data, off + nr * SLOT.size)
+        if count:
+            slots.append((total, nr, count, maxns, request, errors))
+    off += nslots * SLOT.size
+
+    print('%-24s %10s %14s %10s %10s %8s' % ('ioctl', 'count', 'total_us', 'avg_us',
+                                            'max_us', 'errors'))
+    for total, nr, count, maxns, request, errors in sorted(slots, reverse=True):
+        print('%-24s %10d %14.1f %10.2f %10.1f %8d' % (ioctl_name(nr), count, total / 1000.0,
+                                                      total / 1000.0 / count, maxns / 1000.0,
+                                                      errors))
+
+    if args.events > 0:
+        events = []
+        for i in range(min(head, nevents)):
+            seq, start, dur, request, result, tid = EVENT.unpack_from(data, off + i * EVENT.size)
+            if seq == 0 or (seq - 1) % nevents != i:
+                continue
+            events.append((dur, start, request, result, tid))
+        events.sort(reverse=True)
+        print()
+        print('%14s %10s %8s %-24s %s' % ('start_us', 'dur_us', 'tid', 'ioctl', 'result'))
+        for dur, start, request, result, tid in events[:args.events]:
+            print('%14.1f %10.1f %8d %-24s %d' % (start / 1000.0, dur / 1000.0, tid,
+                                                 ioctl_name(request & 0xff), result))
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,51 @@
+#!/bin/sh
+#
+# startup-bench.sh
+#
+# Compare process startup cost between two builds of the shim
+# (for example, one configured with --enable-lazy-binding and one
+# without).  Run this on the target, where the Tegra libdrm is
+# actually loaded.
+#
+# Usage: startup-bench.sh <libdir-a> <libdir-b> [iterations] -- command [args...]
+#
+# Each libdir should contain a libdrm.so.2 built from this tree.
+# The command should be a short-lived program linked against libdrm.
+#
+
+usage() {
+    echo "Usage: $0 <libdir-a> <libdir-b> [iterations] -- command [args...]" >&2
+    exit 1
+}
+
+[ $# -ge 4 ] || usage
+liba="$1"
+libb="$2"
+shift 2
+iterations=200
+if [ "$1" != "--" ]; then
+    iterations="$1"
+    shift
+fi
+[ "$1" = "--" ] || usage
+shift
+
+run_one() {
+    libdir="$1"
+    shift
+    start=$(date +%s%N)
+    i=0
+    while [ $i -lt $iterations ]; do
+        LD_LIBRARY_PATH="$libdir" "$@" >/dev/null 2>&1
+        i=$((i + 1))
+    done
+    end=$(date +%s%N)
+    echo "$libdir: $(( (end - start) / iterations / 1000 )) us/exec ($iterations runs)"
+}
+
+# warm the page cache before timing
+LD_LIBRARY_PATH="$liba" "$@" >/dev/null 2>&1
+LD_LIBRARY_PATH="$libb" "$@" >/dev/null 2>&1
+
+run_one "$liba" "$@"
+run_one "$libb" "$@"